@@ -0,0 +1,480 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Asynchronous read-ahead for the sequential reader (--read-ahead).
+ * Reading through the mapping blocks on a page fault whenever the
+ * kernel's own read-ahead has not caught up, and the CPU sits idle
+ * meanwhile.  Instead, we keep the next --read-ahead selected
+ * timesteps of the input in flight in a ring of buffers: timestep k
+ * goes to slot k % depth, and as soon as the converter is done with a
+ * timestep, its slot is queued for the timestep depth places further
+ * on.  Each timestep (both records with their markers) is one read,
+ * submitted through io_uring where the kernel has it, or else done by
+ * a thread of our own with pread, helped along by posix_fadvise.
+ *
+ * With --direct-io, the input is opened again with O_DIRECT, and the
+ * reads are widened to whole blocks, so a bulk conversion does not
+ * push everything else on the node out of the page cache.  Where the
+ * file system does not allow O_DIRECT, we read through the cache and
+ * drop each timestep from it once it is converted. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sprintars2nc.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+
+/* offset and size alignment of O_DIRECT reads */
+#define DIRECT_ALIGN 4096
+
+/* header record, data record marker */
+#define DATA_OFFSET (4 + GTOOL_HEAD_LEN + 4 + 4)
+
+/* big-endian 4-byte unsigned integer at p */
+static uint32_t be32 (const unsigned char *p)
+{
+     return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	  (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+typedef enum { AIO_IDLE, AIO_QUEUED, AIO_DONE } aio_state_t;
+typedef struct {
+     aio_state_t state;
+     size_t k;			/* selected timestep */
+     int eof;			/* past the last one? */
+     size_t pos;		/* where the timestep starts */
+     size_t off, len;		/* what is read: the timestep, widened to
+				 * blocks for O_DIRECT */
+     size_t got;
+     unsigned char *buf;
+     struct iovec iov;
+     int err;
+} aio_slot_t;
+
+struct aio {
+     gtool_t *g;
+     int fd;			/* the input's, or one with O_DIRECT */
+     int direct;		/* reading with O_DIRECT? */
+     int drop;			/* drop converted timesteps from the cache? */
+     size_t align;
+     size_t rec;		/* bytes of one timestep */
+     size_t data_len;		/* bytes of its data record */
+     int depth;
+     aio_slot_t *slots;
+     size_t next;		/* next timestep for the converter */
+     int uring;		/* else the pread thread */
+#ifdef HAVE_IO_URING
+     int ring_fd;
+     void *sq_map, *cq_map;
+     size_t sq_map_len, cq_map_len;
+     unsigned *sq_tail, *sq_mask, *sq_array;
+     unsigned *cq_head, *cq_tail, *cq_mask;
+     struct io_uring_sqe *sqes;
+     size_t sqes_len;
+     struct io_uring_cqe *cqes;
+#endif
+     pthread_t thread;
+     size_t k_read;		/* next timestep for the thread */
+     int quit;
+     pthread_mutex_t lock;
+     pthread_cond_t cond;
+};
+
+/* the slot of selected timestep k is done with n more bytes, or with
+ * a result < 0 (-errno) or 0 (end of file); return whether the read
+ * is complete */
+static int advance (struct aio *a, aio_slot_t *s, long res)
+{
+     if (res < 0)
+	  s->err = -res;
+     else if (res == 0 && s->got < s->pos - s->off + a->rec) {
+	  fprintf(stderr, "truncated record at offset %zu\n", s->pos);
+	  s->err = EIO;
+     } else
+	  s->got += res;
+     return s->err != 0 || res == 0 || s->got == s->len;
+}
+
+#ifdef HAVE_IO_URING
+static int uring_setup (struct aio *a)
+{
+     struct io_uring_params p;
+     unsigned char *sq, *cq;
+
+     memset(&p, 0, sizeof(p));
+     a->ring_fd = syscall(__NR_io_uring_setup, a->depth, &p);
+     if (a->ring_fd < 0)
+	  return errno;
+     a->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+     a->cq_map_len = p.cq_off.cqes +
+	  p.cq_entries * sizeof(struct io_uring_cqe);
+     if (p.features & IORING_FEAT_SINGLE_MMAP && a->cq_map_len > a->sq_map_len)
+	  a->sq_map_len = a->cq_map_len;
+     a->sq_map = mmap(0, a->sq_map_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, a->ring_fd,
+		      IORING_OFF_SQ_RING);
+     a->cq_map = p.features & IORING_FEAT_SINGLE_MMAP ? a->sq_map :
+	  mmap(0, a->cq_map_len, PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_CQ_RING);
+     a->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+     a->sqes = mmap(0, a->sqes_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQES);
+     if (a->sq_map == MAP_FAILED || a->cq_map == MAP_FAILED ||
+	 a->sqes == MAP_FAILED) {
+	  const int err = errno;
+	  close(a->ring_fd);
+	  return err;
+     }
+     sq = a->sq_map;
+     cq = a->cq_map;
+     a->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+     a->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+     a->sq_array = (unsigned *)(sq + p.sq_off.array);
+     a->cq_head = (unsigned *)(cq + p.cq_off.head);
+     a->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+     a->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+     a->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+     return 0;
+}
+
+/* submit the rest of the read of slot s; there is never more than one
+ * read per slot in flight, so the queue cannot overflow */
+static void uring_submit (struct aio *a, aio_slot_t *s)
+{
+     const unsigned tail = *a->sq_tail;
+     const unsigned i = tail & *a->sq_mask;
+     struct io_uring_sqe *sqe = &a->sqes[i];
+
+     s->iov.iov_base = s->buf + s->got;
+     s->iov.iov_len = s->len - s->got;
+     memset(sqe, 0, sizeof(*sqe));
+     sqe->opcode = IORING_OP_READV;
+     sqe->fd = a->fd;
+     sqe->off = s->off + s->got;
+     sqe->addr = (uintptr_t)&s->iov;
+     sqe->len = 1;
+     sqe->user_data = s - a->slots;
+     a->sq_array[i] = i;
+     __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+     while (syscall(__NR_io_uring_enter, a->ring_fd, 1, 0, 0, 0, 0) < 0)
+	  if (errno != EINTR) {
+	       perror("Submitting read");
+	       exit(1);
+	  }
+}
+
+/* wait for one read to complete, and resubmit it if it came up
+ * short */
+static void uring_reap (struct aio *a)
+{
+     const unsigned head = *a->cq_head;
+     struct io_uring_cqe *cqe;
+     aio_slot_t *s;
+
+     while (head == __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE))
+	  if (syscall(__NR_io_uring_enter, a->ring_fd, 0, 1,
+		      IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR) {
+	       perror("Waiting for read");
+	       exit(1);
+	  }
+     cqe = &a->cqes[head & *a->cq_mask];
+     s = &a->slots[cqe->user_data];
+     if (advance(a, s, cqe->res))
+	  s->state = AIO_DONE;
+     else
+	  uring_submit(a, s);
+     __atomic_store_n(a->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_close (struct aio *a)
+{
+     munmap(a->sqes, a->sqes_len);
+     if (a->cq_map != a->sq_map)
+	  munmap(a->cq_map, a->cq_map_len);
+     munmap(a->sq_map, a->sq_map_len);
+     close(a->ring_fd);
+}
+#endif
+
+/* the fallback: one thread reading the queued slots in order */
+static void *read_slots (void *arg)
+{
+     struct aio *a = arg;
+
+     pthread_mutex_lock(&a->lock);
+     while (1) {
+	  aio_slot_t *s = &a->slots[a->k_read % a->depth];
+	  while (!a->quit &&
+		 (s->state != AIO_QUEUED || s->k != a->k_read))
+	       pthread_cond_wait(&a->cond, &a->lock);
+	  if (a->quit)
+	       break;
+	  pthread_mutex_unlock(&a->lock);
+	  while (1) {
+	       ssize_t res = pread(a->fd, s->buf + s->got, s->len - s->got,
+				   s->off + s->got);
+	       if (res == -1 && errno == EINTR)
+		    continue;
+	       if (advance(a, s, res == -1 ? -errno : res))
+		    break;
+	  }
+	  pthread_mutex_lock(&a->lock);
+	  s->state = AIO_DONE;
+	  a->k_read++;
+	  pthread_cond_broadcast(&a->cond);
+     }
+     pthread_mutex_unlock(&a->lock);
+     return 0;
+}
+
+/* start reading selected timestep k into its slot */
+static void queue (struct aio *a, size_t k)
+{
+     gtool_t *g = a->g;
+     aio_slot_t *s = &a->slots[k % a->depth];
+     const size_t t = g->first + k * g->stride;
+
+     s->k = k;
+     s->got = 0;
+     s->err = 0;
+     s->eof = t >= g->n_index || t > g->last;
+     if (s->eof) {
+	  /* nothing to read; the thread waits for a timestep that never
+	   * comes */
+	  s->state = AIO_DONE;
+	  return;
+     }
+     s->pos = g->index[t];
+     s->off = s->pos / a->align * a->align;
+     s->len = (s->pos + a->rec + a->align - 1) / a->align * a->align -
+	  s->off;
+#ifdef HAVE_IO_URING
+     if (a->uring) {
+	  s->state = AIO_QUEUED;
+	  uring_submit(a, s);
+	  return;
+     }
+#endif
+     /* let the kernel fetch the whole window at once */
+     if (!a->direct)
+	  posix_fadvise(a->fd, s->off, s->len, POSIX_FADV_WILLNEED);
+     pthread_mutex_lock(&a->lock);
+     s->state = AIO_QUEUED;
+     pthread_cond_broadcast(&a->cond);
+     pthread_mutex_unlock(&a->lock);
+}
+
+/* wait for the slot of selected timestep k */
+static aio_slot_t *wait_slot (struct aio *a, size_t k)
+{
+     aio_slot_t *s = &a->slots[k % a->depth];
+
+#ifdef HAVE_IO_URING
+     if (a->uring) {
+	  while (s->state != AIO_DONE)
+	       uring_reap(a);
+	  return s;
+     }
+#endif
+     pthread_mutex_lock(&a->lock);
+     while (s->state != AIO_DONE)
+	  pthread_cond_wait(&a->cond, &a->lock);
+     pthread_mutex_unlock(&a->lock);
+     return s;
+}
+
+/* queue the first depth timesteps */
+static void start (struct aio *a)
+{
+     a->next = 0;
+     if (!a->uring) {
+	  pthread_mutex_lock(&a->lock);
+	  a->k_read = 0;
+	  pthread_mutex_unlock(&a->lock);
+     }
+     for (int i = 0; i < a->depth; ++i)
+	  queue(a, i);
+}
+
+/* wait until nothing is in flight any more */
+static void drain (struct aio *a)
+{
+     for (size_t k = a->next; k < a->next + a->depth; ++k)
+	  wait_slot(a, k);
+}
+
+/* read the timesteps of g, each with n values (or the full field if a
+ * box is set), depth at a time ahead of read_sprintars_tstep; needs the
+ * index (select_sprintars); return 0 or an error number */
+int aio_open (gtool_t *g, size_t n, int depth, int direct, io_t io)
+{
+     struct aio *a;
+     int err = ENOSYS;
+
+     if (g->stream || g->index == 0)
+	  return ESPIPE;
+     a = calloc(1, sizeof(struct aio));
+     a->g = g;
+     a->fd = g->fd;
+     a->depth = depth;
+     a->align = 1;
+     if (g->boxed)
+	  n = g->n_lon * g->n_lat * g->n_lvl;
+     a->data_len = sizeof(float) * n;
+     a->rec = DATA_OFFSET + a->data_len + 4;
+#ifdef O_DIRECT
+     if (direct) {
+	  char path[64];
+	  snprintf(path, sizeof(path), "/proc/self/fd/%d", g->fd);
+	  a->fd = open(path, O_RDONLY | O_DIRECT);
+	  if (a->fd != -1) {
+	       a->direct = 1;
+	       a->align = DIRECT_ALIGN;
+	  } else {
+	       /* e.g. tmpfs: read through the cache, but do not keep
+		* what we have converted */
+	       a->fd = g->fd;
+	       a->drop = 1;
+	       if (verbose())
+		    printf("no O_DIRECT (%s); dropping converted "
+			   "timesteps from the page cache instead\n",
+			   strerror(errno));
+	  }
+     }
+#else
+     a->drop = direct;
+#endif
+     a->slots = calloc(depth, sizeof(aio_slot_t));
+     {
+	  const size_t len = (a->rec + 2 * a->align - 1) / a->align *
+	       a->align;
+	  unsigned char *bufs = pool_alloc(len * depth,
+					   "the read-ahead buffers");
+	  for (int i = 0; i < depth; ++i)
+	       a->slots[i].buf = bufs + i * len;
+     }
+#ifdef HAVE_IO_URING
+     if (io == IO_URING)
+	  err = uring_setup(a);
+#endif
+     a->uring = err == 0;
+     if (!a->uring) {
+	  if (io == IO_URING && verbose())
+	       printf("no io_uring (%s); reading ahead on a thread\n",
+		      strerror(err));
+	  pthread_mutex_init(&a->lock, 0);
+	  pthread_cond_init(&a->cond, 0);
+	  if (pthread_create(&a->thread, 0, read_slots, a) != 0) {
+	       perror("Starting read-ahead thread");
+	       exit(1);
+	  }
+     }
+     if (verbose())
+	  printf("read-ahead: %d timestep(s) of %zu bytes in flight "
+		 "(%s%s)\n", depth, a->rec, a->uring ? "io_uring" : "pread",
+		 a->direct ? ", O_DIRECT" : "");
+     g->aio = a;
+     start(a);
+     return 0;
+}
+
+/* the next selected timestep: its data record, valid until the next
+ * call; the slot of the one before goes back into the queue */
+const void *aio_tstep (gtool_t *g, int *eof, int *err)
+{
+     struct aio *a = g->aio;
+     const unsigned char *p;
+     aio_slot_t *s;
+
+     if (a->next > 0) {
+	  aio_slot_t *prev = &a->slots[(a->next - 1) % a->depth];
+	  if (a->drop && !prev->eof)
+	       posix_fadvise(a->fd, prev->off, prev->len,
+			     POSIX_FADV_DONTNEED);
+	  queue(a, a->next - 1 + a->depth);
+     }
+     s = wait_slot(a, a->next++);
+     *eof = s->eof;
+     *err = s->err;
+     if (s->eof || s->err != 0)
+	  return 0;
+     p = s->buf + (s->pos - s->off);
+     if (be32(p) != GTOOL_HEAD_LEN ||
+	 be32(p + 4 + GTOOL_HEAD_LEN) != GTOOL_HEAD_LEN) {
+	  fprintf(stderr, "header record at offset %zu is not %d "
+		  "bytes\n", s->pos, GTOOL_HEAD_LEN);
+	  *err = EIO;
+	  return 0;
+     }
+     if (be32(p + DATA_OFFSET - 4) != a->data_len ||
+	 be32(p + DATA_OFFSET + a->data_len) != a->data_len) {
+	  fprintf(stderr, "data record at offset %zu does not have the "
+		  "expected %zu bytes\n", s->pos, a->data_len);
+	  *err = EIO;
+	  return 0;
+     }
+     return p + DATA_OFFSET;
+}
+
+/* start over at the first selected timestep */
+void aio_rewind (gtool_t *g)
+{
+     drain(g->aio);
+     start(g->aio);
+}
+
+void aio_close (gtool_t *g)
+{
+     struct aio *a = g->aio;
+
+     drain(a);
+#ifdef HAVE_IO_URING
+     if (a->uring)
+	  uring_close(a);
+#endif
+     if (!a->uring) {
+	  pthread_mutex_lock(&a->lock);
+	  a->quit = 1;
+	  pthread_cond_broadcast(&a->cond);
+	  pthread_mutex_unlock(&a->lock);
+	  pthread_join(a->thread, 0);
+     }
+     if (a->fd != g->fd)
+	  close(a->fd);
+     pool_free(a->slots[0].buf);
+     free(a->slots);
+     free(a);
+     g->aio = 0;
+}
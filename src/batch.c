@@ -0,0 +1,190 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Batch conversion (--manifest).  Every line of the manifest is one
+ * job, written like the command line arguments
+ * infile[:varname:units] ... outfile; blank lines and lines starting
+ * with # are skipped.  All options, and the dimension tables that main
+ * has read by the time we get here, are shared by the jobs.
+ *
+ * Each job runs in a child process, which inherits the tables and has
+ * the conversion state (and the NetCDF library, which is not thread
+ * safe) to itself; a job that fails takes nothing else down with it.
+ * Up to jobs() children run at once, and whenever one finishes the
+ * next idle slot takes the largest job nobody has started yet, so the
+ * big 3D files go first and the run does not end waiting for one of
+ * them. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sprintars2nc.h"
+
+typedef struct {
+     int line;			/* line of the manifest, for messages */
+     var_t *vars;
+     int n_vars;
+     char out_fname[1024];
+     off_t size;		/* total size of the input files */
+     pid_t pid;
+} job_t;
+
+/* largest job first, otherwise in manifest order */
+static int by_size (const void *a_, const void *b_)
+{
+     const job_t *a = a_, *b = b_;
+     if (a->size != b->size)
+	  return a->size > b->size ? -1 : 1;
+     return a->line - b->line;
+}
+
+/* read the jobs from the manifest */
+static job_t *read_manifest (const char *fname, int *n_jobs)
+{
+     FILE *f = fopen(fname, "r");
+     job_t *queue = 0;
+     char *line = 0;
+     size_t line_len = 0;
+     int n_lines = 0;
+
+     if (f == 0) {
+	  perror("Opening manifest");
+	  exit(1);
+     }
+     *n_jobs = 0;
+     while (getline(&line, &line_len, f) != -1) {
+	  char *args[1024];
+	  int n_args = 0;
+	  job_t *job;
+
+	  n_lines++;
+	  for (char *tok = strtok(line, " \t\r\n"); tok != 0;
+	       tok = strtok(0, " \t\r\n")) {
+	       if (n_args == 1024) {
+		    fprintf(stderr, "%s:%d: too many input files\n",
+			    fname, n_lines);
+		    exit(1);
+	       }
+	       args[n_args++] = tok;
+	  }
+	  if (n_args == 0 || args[0][0] == '#')
+	       continue;
+
+	  queue = realloc(queue, sizeof(job_t) * (*n_jobs + 1));
+	  job = &queue[(*n_jobs)++];
+	  job->line = n_lines;
+	  if (parse_files(n_args, args,
+			  &job->vars, &job->n_vars, job->out_fname) != 0) {
+	       fprintf(stderr, "%s:%d: expected "
+		       "infile[:varname:units] ... outfile\n",
+		       fname, n_lines);
+	       exit(1);
+	  }
+	  /* inputs that cannot be found count as empty; their job will
+	   * say what is wrong when it runs */
+	  job->size = 0;
+	  for (int v = 0; v < job->n_vars; ++v) {
+	       struct stat st;
+	       if (stat(job->vars[v].fname, &st) == 0)
+		    job->size += st.st_size;
+	  }
+	  job->pid = 0;
+     }
+     free(line);
+     fclose(f);
+     return queue;
+}
+
+/* run all jobs of the manifest, converting each with convert; return
+ * the number of jobs that failed */
+int run_manifest (const char *fname,
+		  void (*convert)(int n_vars, var_t *vars,
+				  const char *out_fname))
+{
+     int n_jobs, next = 0, running = 0, failed = 0;
+     job_t *queue = read_manifest(fname, &n_jobs);
+     int pool = jobs();
+
+     if (pool == 0) {
+	  /* one job per --threads worth of processors */
+	  pool = sysconf(_SC_NPROCESSORS_ONLN) / threads();
+	  if (pool < 1)
+	       pool = 1;
+     }
+     qsort(queue, n_jobs, sizeof(job_t), by_size);
+     if (verbose())
+	  printf("manifest: %d job(s), %d at a time\n", n_jobs, pool);
+
+     while (next < n_jobs || running > 0) {
+	  int status;
+	  pid_t pid;
+
+	  /* fill the idle slots, largest jobs first */
+	  while (running < pool && next < n_jobs) {
+	       job_t *job = &queue[next++];
+	       if (verbose())
+		    printf("job %d/%d: %s (line %d, %lld bytes)\n",
+			   next, n_jobs, job->out_fname, job->line,
+			   (long long)job->size);
+	       /* do not let the child repeat what is still buffered */
+	       fflush(stdout);
+	       fflush(stderr);
+	       job->pid = fork();
+	       if (job->pid == -1) {
+		    perror("Starting job");
+		    exit(1);
+	       }
+	       if (job->pid == 0) {
+		    convert(job->n_vars, job->vars, job->out_fname);
+		    exit(0);
+	       }
+	       running++;
+	  }
+
+	  /* wait for any of them to finish */
+	  pid = wait(&status);
+	  if (pid == -1) {
+	       perror("Waiting for job");
+	       exit(1);
+	  }
+	  running--;
+	  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	       for (int j = 0; j < n_jobs; ++j) {
+		    if (queue[j].pid == pid) {
+			 fprintf(stderr, "%s:%d: job for %s failed\n",
+				 fname, queue[j].line, queue[j].out_fname);
+			 break;
+		    }
+	       }
+	       failed++;
+	  }
+     }
+     if (failed > 0)
+	  fprintf(stderr, "%d of %d job(s) failed\n", failed, n_jobs);
+     for (int j = 0; j < n_jobs; ++j)
+	  free(queue[j].vars);
+     free(queue);
+     return failed;
+}
@@ -0,0 +1,425 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Throughput benchmark (make bench).  For each grid, generates a 2D and
+ * a 3D input file with gtoolgen, then converts each of them in every
+ * output mode, timing each run with the wall clock and reading the
+ * peak resident set size of the child from wait4.  Every run becomes
+ * one JSON line in the results file; given the results of an earlier
+ * run (--baseline), runs that got slower than the tolerance are
+ * reported and the exit status is 2. */
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* grid presets: the spectral truncations SPRINTARS is usually run at */
+typedef struct {
+     char name[64];
+     int n_lon, n_lat, n_lvl;
+} grid_t;
+static const grid_t presets[] = {
+     { "t42", 128, 64, 20 },
+     { "t85", 256, 128, 40 },
+     { "t106", 320, 160, 56 },
+     { "t213", 640, 320, 57 },
+};
+
+/* output modes and the converter options that select them */
+typedef struct {
+     const char *name;
+     const char *args[4];
+} out_mode_t;
+static const out_mode_t modes[] = {
+     { "nc2", { "-f", "nc2", 0 } },
+     { "nc4", { "-f", "nc4", 0 } },
+     { "nc4-deflate", { "-f", "nc4", "-c", 0 } },
+};
+#define N_MODES (sizeof(modes) / sizeof(modes[0]))
+
+/* settings */
+static const char *converter = "./sprintars2nc";
+static const char *generator = "./gtoolgen";
+static const char *dir = "bench-data";
+static const char *out_fname = "bench.jsonl";
+static const char *baseline = 0;
+static double tolerance = 10;
+static int steps = 8;
+static const char *threads = "1";
+static int keep = 0;
+
+/* one measurement */
+typedef struct {
+     char grid[64], field[8], stage[32];
+     int steps;
+     double bytes, seconds;
+     long max_rss_kb;
+} result_t;
+
+static void usage (int code)
+{
+     printf("Usage: s2nc-bench [options]\n\n"
+	    "--grid <t42|t85|t106|t213|XxYxZ>  (default: t42 and t213)\n"
+	    "                       grid to benchmark; may be repeated\n"
+	    "--steps <n>            (default: 8) timesteps per input file\n"
+	    "--threads <n>          (default: 1) converter --threads\n"
+	    "--dir <dir>            (default: bench-data) where to put the\n"
+	    "                       generated and converted files\n"
+	    "--out <file>           (default: bench.jsonl) results, one\n"
+	    "                       JSON object per run\n"
+	    "--baseline <file>      results of an earlier run to compare\n"
+	    "                       with; may be the --out file, which is\n"
+	    "                       read before it is overwritten\n"
+	    "--tolerance <percent>  (default: 10) slowdown against the\n"
+	    "                       baseline that counts as a regression\n"
+	    "--converter <path>     (default: ./sprintars2nc)\n"
+	    "--generator <path>     (default: ./gtoolgen)\n"
+	    "--keep                 keep the generated files\n"
+	    "-h | --help            print this message and exit\n");
+     exit(code);
+}
+
+static int parse_grid (const char *arg, grid_t *grid)
+{
+     for (size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); ++i) {
+	  if (strcmp(arg, presets[i].name) == 0) {
+	       *grid = presets[i];
+	       return 1;
+	  }
+     }
+     if (sscanf(arg, "%dx%dx%d", &grid->n_lon, &grid->n_lat,
+		&grid->n_lvl) != 3 ||
+	 grid->n_lon < 1 || grid->n_lat < 1 || grid->n_lvl < 2)
+	  return 0;
+     snprintf(grid->name, sizeof(grid->name), "%s", arg);
+     return 1;
+}
+
+/* run argv with stdout sent to /dev/null, time it and note its peak
+ * RSS; exit if it fails */
+static void run (char *const argv[], result_t *res)
+{
+     struct timespec t0, t1;
+     struct rusage ru;
+     int status;
+     pid_t pid;
+
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     pid = fork();
+     if (pid == -1) {
+	  perror("Starting benchmark run");
+	  exit(1);
+     }
+     if (pid == 0) {
+	  const int null = open("/dev/null", O_WRONLY);
+	  if (null != -1)
+	       dup2(null, STDOUT_FILENO);
+	  execv(argv[0], argv);
+	  perror(argv[0]);
+	  _exit(127);
+     }
+     while (wait4(pid, &status, 0, &ru) == -1) {
+	  if (errno != EINTR) {
+	       perror("Waiting for benchmark run");
+	       exit(1);
+	  }
+     }
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	  fprintf(stderr, "%s failed (%s %s, %s)\n", argv[0],
+		  res->grid, res->field, res->stage);
+	  exit(1);
+     }
+     res->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+     res->max_rss_kb = ru.ru_maxrss;
+}
+
+static double file_size (const char *fname)
+{
+     struct stat st;
+
+     return stat(fname, &st) == 0 ? st.st_size : 0;
+}
+
+static void report (FILE *out, const result_t *res)
+{
+     const double mb_s = res->bytes / 1e6 / res->seconds;
+     const double steps_s = res->steps / res->seconds;
+
+     printf("%-12s %-3s %-12s %9.1f MB %8.3f s %9.1f MB/s %8.2f steps/s "
+	    "%8ld kB\n", res->grid, res->field, res->stage, res->bytes / 1e6,
+	    res->seconds, mb_s, steps_s, res->max_rss_kb);
+     fprintf(out, "{\"grid\":\"%s\",\"field\":\"%s\",\"stage\":\"%s\","
+	     "\"steps\":%d,\"bytes\":%.0f,\"seconds\":%.6f,"
+	     "\"mb_s\":%.3f,\"steps_s\":%.3f,\"max_rss_kb\":%ld}\n",
+	     res->grid, res->field, res->stage, res->steps, res->bytes,
+	     res->seconds, mb_s, steps_s, res->max_rss_kb);
+     fflush(out);
+}
+
+/* generate the 2D or 3D input of grid and convert it in every mode */
+static void bench_field (FILE *out, const grid_t *grid, int three_d,
+			 result_t *results, int *n_results)
+{
+     char prefix[1024], in[1024], nc[1024], lon[1024], lat[1024],
+	  lvl[1024], x[16], y[16], z[16], t[16];
+     const char *field = three_d ? "3d" : "2d";
+     result_t res;
+
+     snprintf(prefix, sizeof(prefix), "%s/%s", dir, grid->name);
+     snprintf(in, sizeof(in), "%s_%s.gtool", prefix, field);
+     snprintf(nc, sizeof(nc), "%s_%s.nc", prefix, field);
+     snprintf(lon, sizeof(lon), "%s.lon", prefix);
+     snprintf(lat, sizeof(lat), "%s.lat", prefix);
+     snprintf(lvl, sizeof(lvl), "%s.lvl", prefix);
+     snprintf(x, sizeof(x), "%d", grid->n_lon);
+     snprintf(y, sizeof(y), "%d", grid->n_lat);
+     snprintf(z, sizeof(z), "%d", three_d ? grid->n_lvl : 1);
+     snprintf(t, sizeof(t), "%d", steps);
+
+     memset(&res, 0, sizeof(res));
+     snprintf(res.grid, sizeof(res.grid), "%s", grid->name);
+     snprintf(res.field, sizeof(res.field), "%s", field);
+     res.steps = steps;
+     {
+	  char *argv[] = { (char *)generator, "-x", x, "-y", y, "-z", z,
+			   "-t", t, "-T", prefix, in, 0 };
+	  snprintf(res.stage, sizeof(res.stage), "generate");
+	  run(argv, &res);
+	  res.bytes = file_size(in);
+	  report(out, &res);
+	  results[(*n_results)++] = res;
+     }
+     for (size_t m = 0; m < N_MODES; ++m) {
+	  char *argv[32];
+	  int n = 0;
+	  argv[n++] = (char *)converter;
+	  argv[n++] = "--clobber";
+	  argv[n++] = "--lonfile";
+	  argv[n++] = lon;
+	  argv[n++] = "--latfile";
+	  argv[n++] = lat;
+	  if (three_d) {
+	       argv[n++] = "--sigmafile";
+	       argv[n++] = lvl;
+	  }
+	  argv[n++] = "--t0";
+	  argv[n++] = "2000-01-01 00:00:00";
+	  argv[n++] = "--tstep";
+	  argv[n++] = "10800";
+	  argv[n++] = "--varname";
+	  argv[n++] = "t";
+	  argv[n++] = "--varunits";
+	  argv[n++] = "K";
+	  argv[n++] = "--threads";
+	  argv[n++] = (char *)threads;
+	  for (int a = 0; modes[m].args[a] != 0; ++a)
+	       argv[n++] = (char *)modes[m].args[a];
+	  argv[n++] = in;
+	  argv[n++] = nc;
+	  argv[n] = 0;
+	  snprintf(res.stage, sizeof(res.stage), "%s", modes[m].name);
+	  run(argv, &res);
+	  res.bytes = file_size(in);
+	  report(out, &res);
+	  results[(*n_results)++] = res;
+	  if (!keep)
+	       remove(nc);
+     }
+     if (!keep)
+	  remove(in);
+}
+
+/* the whole baseline, read before the results file is opened, which
+ * may well be the same file (--baseline bench.jsonl) */
+static char *read_baseline ()
+{
+     FILE *f = fopen(baseline, "r");
+     char *text = 0;
+     size_t len = 0, got;
+
+     if (f == 0) {
+	  perror("Opening baseline");
+	  exit(1);
+     }
+     do {
+	  text = realloc(text, len + 4096 + 1);
+	  got = fread(text + len, 1, 4096, f);
+	  len += got;
+     } while (got > 0);
+     if (ferror(f)) {
+	  perror("Reading baseline");
+	  exit(1);
+     }
+     fclose(f);
+     text[len] = 0;
+     return text;
+}
+
+/* compare with the matching runs of the baseline; return the number of
+ * regressions */
+static int compare (char *text, const result_t *results, int n_results)
+{
+     int n_slower = 0;
+
+     printf("\ncompared with %s (tolerance %g%%):\n", baseline, tolerance);
+     for (char *line = text, *end; *line != 0; line = end) {
+	  char grid[64], field[8], stage[32];
+	  const char *p;
+	  double mb_s;
+	  end = strchr(line, '\n');
+	  if (end != 0)
+	       *end++ = 0;
+	  else
+	       end = line + strlen(line);
+	  p = strstr(line, "\"mb_s\":");
+	  if (p == 0 ||
+	      sscanf(line, "{\"grid\":\"%63[^\"]\",\"field\":\"%7[^\"]\","
+		     "\"stage\":\"%31[^\"]\"", grid, field, stage) != 3)
+	       continue;
+	  mb_s = strtod(p + 7, 0);
+	  for (int i = 0; i < n_results; ++i) {
+	       const result_t *res = &results[i];
+	       double now;
+	       if (strcmp(res->grid, grid) != 0 ||
+		   strcmp(res->field, field) != 0 ||
+		   strcmp(res->stage, stage) != 0 ||
+		   strcmp(stage, "generate") == 0)
+		    continue;
+	       now = res->bytes / 1e6 / res->seconds;
+	       printf("%-12s %-3s %-12s %9.1f -> %9.1f MB/s (%+.1f%%)%s\n",
+		      grid, field, stage, mb_s, now,
+		      100 * (now / mb_s - 1),
+		      now < mb_s * (1 - tolerance / 100) ?
+		      "  REGRESSION" : "");
+	       if (now < mb_s * (1 - tolerance / 100))
+		    n_slower++;
+	  }
+     }
+     return n_slower;
+}
+
+int main (int argc, char *argv[])
+{
+     grid_t grids[16];
+     int n_grids = 0, n_results = 0;
+     result_t *results;
+     char *base_text = 0;
+     FILE *out;
+
+     while (1) {
+	  static struct option long_options[] = {
+	       {"grid",      required_argument, 0, 'g' },
+	       {"steps",     required_argument, 0, 's' },
+	       {"threads",   required_argument, 0, 'j' },
+	       {"dir",       required_argument, 0, 'd' },
+	       {"out",       required_argument, 0, 'o' },
+	       {"baseline",  required_argument, 0, 'b' },
+	       {"tolerance", required_argument, 0, 'r' },
+	       {"converter", required_argument, 0, 'c' },
+	       {"generator", required_argument, 0, 'G' },
+	       {"keep",      no_argument,       0, 'k' },
+	       {"help",      no_argument,       0, 'h' },
+	       {0,           0,                 0,  0 }
+	  };
+	  const int c = getopt_long(argc, argv, "h", long_options, 0);
+	  if (c == -1)
+	       break;
+	  switch (c) {
+	  case 'g':
+	       if (n_grids == sizeof(grids) / sizeof(grids[0]) ||
+		   !parse_grid(optarg, &grids[n_grids])) {
+		    fprintf(stderr, "bad --grid %s\n", optarg);
+		    usage(1);
+	       }
+	       n_grids++;
+	       break;
+	  case 's':
+	       steps = atoi(optarg);
+	       break;
+	  case 'j':
+	       threads = optarg;
+	       break;
+	  case 'd':
+	       dir = optarg;
+	       break;
+	  case 'o':
+	       out_fname = optarg;
+	       break;
+	  case 'b':
+	       baseline = optarg;
+	       break;
+	  case 'r':
+	       tolerance = atof(optarg);
+	       break;
+	  case 'c':
+	       converter = optarg;
+	       break;
+	  case 'G':
+	       generator = optarg;
+	       break;
+	  case 'k':
+	       keep = 1;
+	       break;
+	  case 'h':
+	       usage(0);
+	  default:
+	       usage(1);
+	  }
+     }
+     if (optind != argc || steps < 1)
+	  usage(1);
+     if (n_grids == 0) {
+	  parse_grid("t42", &grids[n_grids++]);
+	  parse_grid("t213", &grids[n_grids++]);
+     }
+     if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+	  perror("Creating benchmark directory");
+	  exit(1);
+     }
+     if (baseline != 0)
+	  base_text = read_baseline();
+     out = fopen(out_fname, "w");
+     if (out == 0) {
+	  perror("Opening results file");
+	  exit(1);
+     }
+
+     results = malloc(sizeof(result_t) * n_grids * 2 * (N_MODES + 1));
+     for (int g = 0; g < n_grids; ++g) {
+	  bench_field(out, &grids[g], 0, results, &n_results);
+	  bench_field(out, &grids[g], 1, results, &n_results);
+     }
+     fclose(out);
+     printf("results written to %s\n", out_fname);
+
+     if (baseline != 0 && compare(base_text, results, n_results) > 0)
+	  return 2;
+     return 0;
+}
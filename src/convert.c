@@ -17,63 +17,460 @@
  *   Bug reports and feature requests are welcome.  Contact me at
  *   johannes.muelmenstaedt@uni-leipzig.de */
 
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "sprintars2nc.h"
 
-static float *buf = 0;
+/* Pipelined conversion (--threads): worker threads each claim the
+ * next timestep by number, read it with pread (pread_sprintars), turn
+ * it into native floats and compute the diagnostics, and the caller of
+ * convert_tstep writes them out.  The workers hand timesteps over in a
+ * ring of slots; slot s % n_slots always holds timestep s, so the
+ * writer sees them in input order no matter which worker finished
+ * first.  The slot buffers are consecutive in memory and n_slots is a
+ * multiple of the write batch, so each batch can be written straight
+ * from the ring. */
+typedef enum { SLOT_FREE, SLOT_BUSY, SLOT_DECODED, SLOT_END } slot_state_t;
+typedef struct {
+     slot_state_t state;
+     void *raw;			/* big-endian record (or its box) */
+     float *buf;		/* decoded field */
+     float *col;		/* sigma levels before --to-pressure */
+     float *ps;			/* surface pressure, ditto */
+     diag_t diag;
+     int err;			/* reader status, for SLOT_END */
+} slot_t;
+
+/* one input file and its output variable; with several inputs, each
+ * has its own ring, and the workers serve all of them */
+typedef struct {
+     gtool_t *in;
+     size_t n;			/* values per timestep */
+     size_t n_field;		/* values per level */
+     size_t n_out;		/* values written per timestep */
+     int interp;		/* interpolate to pressure levels? */
+     float scale, offset;	/* --pack */
+     float *buf;		/* batch buffer without --threads */
+     void *cut;			/* box cut out of the record, ditto */
+     float *col, *ps;		/* --to-pressure scratch, ditto */
+     slot_t *ring;
+     int next_claim;		/* next timestep for a worker */
+     int next_read;		/* next timestep to read from a stream */
+     int end;			/* first timestep past the end, or -1 */
+} input_t;
+
+static input_t *inputs = 0;
+static int n_inputs;
 static int step;
-static int idim, jdim, kdim;
 
-/* initialize conversion buffer using the field dimension */
-int init_convert(int idim_, int jdim_, int kdim_)
+/* timesteps per nc_put_vara_float call (--write-batch), and how many
+ * decoded timesteps are waiting to be written */
+static int batch = 1;
+static int fill = 0;
+
+/* memory for batched timesteps if --write-batch auto is given (or
+ * less, with --max-memory) */
+#define WRITE_BATCH_MEMORY (256 << 20)
+
+static int pipelined = 0;
+static int n_slots;
+static int next_write;
+static pthread_t *workers;
+static int n_workers;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* apply --keep-bits to a decoded field, or work out what --pack will
+ * do to it, and note the error in diag; with --reduce, the rounding
+ * waits for the reduced field (reduce.c) */
+static void quantize(const input_t *input, float *field, diag_t *diag)
+{
+     const double t0 = stats_clock();
+     float err = 0;
+
+     if (keep_bits() > 0 && reduce() == REDUCE_NONE)
+	  err = round_bits(field, input->n_out, keep_bits());
+     else if (pack() != PACK_NONE && diag != 0)
+	  err = pack_error(field, input->n_out, pack(),
+			   input->scale, input->offset);
+     else
+	  return;
+     if (diag != 0 && err > diag->err_max)
+	  diag->err_max = err;
+     stats_add(STAGE_QUANTIZE, t0, sizeof(float) * input->n_out);
+}
+
+/* the input with the earliest timestep nobody has claimed yet, or 0
+ * once all inputs have ended; *ready tells whether its slot is free */
+static input_t *next_claim(int *ready)
+{
+     input_t *next = 0;
+
+     for (int v = 0; v < n_inputs; ++v) {
+	  input_t *input = &inputs[v];
+	  if (input->end == -1 &&
+	      (next == 0 || input->next_claim < next->next_claim))
+	       next = input;
+     }
+     *ready = next != 0 &&
+	  next->ring[next->next_claim % n_slots].state == SLOT_FREE;
+     return next;
+}
+
+static void *work(void *arg)
+{
+     pthread_mutex_lock(&lock);
+     while (1) {
+	  input_t *input;
+	  slot_t *slot;
+	  int ready, t, eof, err;
+	  double t0;
+	  /* another worker may claim the timestep we are waiting for,
+	   * so look for work again after every wakeup */
+	  while ((input = next_claim(&ready)) != 0 && !ready)
+	       pthread_cond_wait(&cond, &lock);
+	  if (input == 0) {
+	       pthread_mutex_unlock(&lock);
+	       return 0;
+	  }
+	  t = input->next_claim++;
+	  slot = &input->ring[t % n_slots];
+	  slot->state = SLOT_BUSY;
+	  /* a stream has to be read in order; decoding need not be */
+	  while (input->in->stream && input->next_read != t)
+	       pthread_cond_wait(&cond, &lock);
+	  pthread_mutex_unlock(&lock);
+
+	  t0 = stats_clock();
+	  err = pread_sprintars(input->in, t, input->n, slot->raw, &eof);
+	  if (input->in->stream) {
+	       pthread_mutex_lock(&lock);
+	       input->next_read++;
+	       pthread_cond_broadcast(&cond);
+	       pthread_mutex_unlock(&lock);
+	  }
+	  if (!eof && err == 0) {
+	       stats_add(STAGE_READ, t0, sizeof(float) * input->n);
+	       t0 = stats_clock();
+	       decode_be_float_diag(input->interp ? slot->col : slot->buf,
+				    slot->raw, input->n,
+				    init_diag(&slot->diag));
+	       stats_add(STAGE_DECODE, t0, sizeof(float) * input->n);
+	       if (input->interp)
+		    vinterp(slot->buf, slot->col, t, slot->ps);
+	       quantize(input, slot->buf, &slot->diag);
+	  }
+
+	  pthread_mutex_lock(&lock);
+	  slot->err = err;
+	  if (eof || err != 0) {
+	       /* no more claims for this input; the writer stops at the
+		* earliest end */
+	       slot->state = SLOT_END;
+	       if (input->end == -1 || t < input->end)
+		    input->end = t;
+	  } else {
+	       slot->state = SLOT_DECODED;
+	  }
+	  pthread_cond_broadcast(&cond);
+     }
+}
+
+/* bytes of one pipeline slot of every input */
+static size_t slot_bytes()
+{
+     size_t bytes = 0;
+
+     for (int v = 0; v < n_inputs; ++v) {
+	  bytes += sizeof(float) * (inputs[v].n_out + inputs[v].n);
+	  if (inputs[v].interp)
+	       bytes += sizeof(float) *
+		    (inputs[v].n + 2 * inputs[v].n_field);
+     }
+     return bytes;
+}
+
+/* bytes that one timestep of every input takes once packed (--pack),
+ * on top of its batch */
+static size_t packed_bytes()
+{
+     size_t n = 0;
+
+     if (pack() == PACK_NONE || reduce() != REDUCE_NONE)
+	  return 0;
+     for (int v = 0; v < n_inputs; ++v)
+	  n += inputs[v].n_out;
+     return n * (pack() == PACK_SHORT ? sizeof(short) : 1);
+}
+
+/* start the worker threads, keeping the slots within memory bytes if
+ * it is not 0; the caller is the writer */
+static void init_pipeline(int threads, size_t memory)
 {
-     idim = idim_;
-     jdim = jdim_;
-     kdim = kdim_;
-     buf = malloc(sizeof(float) * idim * jdim * kdim);
+     n_workers = threads - 1;
+     /* room for one batch being written while the next one fills */
+     n_slots = (2 * (n_workers + 1) + batch - 1) / batch * batch;
+     if (memory != 0 && n_slots * slot_bytes() > memory)
+	  n_slots = memory / slot_bytes() / batch * batch;
+     if (n_slots < 2 * batch)
+	  n_slots = 2 * batch;
+     for (int v = 0; v < n_inputs; ++v) {
+	  input_t *input = &inputs[v];
+	  float *bufs = pool_alloc(sizeof(float) * input->n_out * n_slots,
+				   "the pipeline slots");
+	  float *raws = pool_alloc(sizeof(float) * input->n * n_slots,
+				   "the pipeline slots");
+	  float *cols = 0, *ps = 0;
+	  if (input->interp) {
+	       cols = pool_alloc(sizeof(float) * input->n * n_slots,
+				 "the pipeline slots");
+	       ps = pool_alloc(sizeof(float) * 2 * input->n_field * n_slots,
+			       "the pipeline slots");
+	  }
+	  input->ring = calloc(n_slots, sizeof(slot_t));
+	  for (int i = 0; i < n_slots; ++i) {
+	       slot_t *slot = &input->ring[i];
+	       slot->state = SLOT_FREE;
+	       slot->buf = bufs + i * input->n_out;
+	       slot->raw = raws + i * input->n;
+	       if (input->interp) {
+		    slot->col = cols + i * input->n;
+		    slot->ps = ps + i * 2 * input->n_field;
+	       }
+	  }
+	  input->next_claim = input->next_read = 0;
+	  input->end = -1;
+     }
+     next_write = 0;
+     pipelined = 1;
+     workers = malloc(sizeof(pthread_t) * n_workers);
+     for (int i = 0; i < n_workers; ++i) {
+	  if (pthread_create(&workers[i], 0, work, 0) != 0) {
+	       perror("Starting worker thread");
+	       exit(1);
+	  }
+     }
+     if (verbose())
+	  printf("pipeline: %d reader/decoder thread(s), %d slots\n",
+		 n_workers, n_slots);
+}
+
+/* initialize conversion buffers using the field dimensions of each
+ * variable; with more than one thread, start the pipeline instead */
+int init_convert(int n_vars, const var_t *vars, int idim, int jdim)
+{
+     size_t n = 0, fixed = 0, memory = 0;
+
+     n_inputs = n_vars;
+     inputs = calloc(n_inputs, sizeof(input_t));
+     for (int v = 0; v < n_inputs; ++v) {
+	  inputs[v].in = vars[v].in;
+	  inputs[v].scale = vars[v].scale;
+	  inputs[v].offset = vars[v].offset;
+	  inputs[v].n_field = (size_t)idim * jdim;
+	  inputs[v].n = inputs[v].n_field * vars[v].kdim;
+	  inputs[v].n_out = inputs[v].n_field * vars[v].out_kdim;
+	  inputs[v].interp = vars[v].kdim > 1 && plev_file() != 0;
+	  n += inputs[v].n_out;
+	  if (inputs[v].in->boxed)
+	       fixed += sizeof(float) * inputs[v].n;
+	  if (inputs[v].interp)
+	       fixed += sizeof(float) *
+		    (inputs[v].n + 2 * inputs[v].n_field);
+     }
+     /* with --max-memory, the batches (and slots) get half of what is
+      * left, so that --transpose has room, too */
+     if (max_memory() > 0)
+	  memory = pool_left() / 2;
      step = -1;
+     fill = 0;
+     batch = write_batch();
+     if (batch == 0) {
+	  /* as many timesteps as fit the budget; the pipeline keeps
+	   * two batches in flight */
+	  size_t budget = WRITE_BATCH_MEMORY;
+	  if (memory != 0 && memory < budget)
+	       budget = memory;
+	  if (threads() > 1)
+	       batch = budget / (2 * slot_bytes() + packed_bytes());
+	  else
+	       batch = budget > fixed ? (budget - fixed) /
+		    (sizeof(float) * n + packed_bytes()) : 0;
+	  if (batch < 1)
+	       batch = 1;
+     }
+     if (verbose())
+	  printf("writing %d timestep(s) per batch\n", batch);
+     init_decode();
+     /* a reduction writes its windows one record at a time */
+     batch_nc(reduce() != REDUCE_NONE ? 1 : batch);
+     /* (what is left of the budget is never 0, which means none) */
+     if (memory != 0)
+	  memory = memory > batch * packed_bytes() ?
+	       memory - batch * packed_bytes() : 1;
+     if (threads() > 1)
+	  init_pipeline(threads(), memory);
+     else
+	  for (int v = 0; v < n_inputs; ++v) {
+	       input_t *input = &inputs[v];
+	       input->buf = pool_alloc(sizeof(float) * input->n_out * batch,
+				       "the write batches");
+	       if (input->in->boxed)
+		    input->cut = pool_alloc(sizeof(float) * input->n,
+					    "the write batches");
+	       if (input->interp) {
+		    input->col = pool_alloc(sizeof(float) * input->n,
+					    "the write batches");
+		    input->ps = pool_alloc(sizeof(float) * 2 *
+					   input->n_field,
+					   "the write batches");
+	       }
+	  }
      return 0;
 }
 
-/* convert one timestep; return timestep number */
+/* write the timesteps of variable v collected so far, which end at the
+ * current step and start at buf, or add them to their windows */
+static void flush_batch(int v, float *buf)
+{
+     if (fill == 0)
+	  return;
+     if (reduce() != REDUCE_NONE)
+	  reduce_nc(v, buf, step - fill + 1, fill);
+     else
+	  write_nc(v, buf, step - fill + 1, fill);
+}
+
+/* write the batch collected in the rings and hand their slots back to
+ * the readers */
+static void flush_ring()
+{
+     const int first = next_write - fill;
+
+     for (int v = 0; v < n_inputs; ++v)
+	  flush_batch(v, inputs[v].ring[first % n_slots].buf);
+     pthread_mutex_lock(&lock);
+     for (int v = 0; v < n_inputs; ++v)
+	  for (int s = first; s < next_write; ++s)
+	       inputs[v].ring[s % n_slots].state = SLOT_FREE;
+     pthread_cond_broadcast(&cond);
+     pthread_mutex_unlock(&lock);
+     fill = 0;
+}
+
+/* give up if the inputs do not all have the same number of timesteps */
+static void check_ended(int ended)
+{
+     if (ended != 0 && ended != n_inputs) {
+	  fprintf(stderr, "Input files end after different numbers of "
+		  "timesteps (at timestep %d)\n", step + 1);
+	  exit(1);
+     }
+}
+
+/* pipelined version of convert_tstep: wait for the next timestep of
+ * every input in input order and write it */
+static int write_stage(diag_t *diag)
+{
+     const int s = next_write % n_slots;
+     const double t0 = stats_clock();
+     int ended = 0;
+
+     pthread_mutex_lock(&lock);
+     for (int v = 0; v < n_inputs; ++v) {
+	  const slot_t *slot = &inputs[v].ring[s];
+	  while (slot->state != SLOT_DECODED && slot->state != SLOT_END)
+	       pthread_cond_wait(&cond, &lock);
+	  if (slot->state == SLOT_END) {
+	       if (slot->err != 0) {
+		    errno = slot->err;
+		    perror("During conversion");
+		    exit(slot->err);
+	       }
+	       ended++;
+	  }
+     }
+     pthread_mutex_unlock(&lock);
+     stats_add(STAGE_WAIT, t0, 0);
+     check_ended(ended);
+     if (ended) {
+	  flush_ring();
+	  for (int i = 0; i < n_workers; ++i)
+	       pthread_join(workers[i], 0);
+	  return EOF;
+     }
+     step++;
+     if (diag != 0) {
+	  *diag = inputs[0].ring[s].diag;
+	  diag->tstep = step;
+     }
+     next_write++;
+     if (++fill == batch)
+	  flush_ring();
+     return 0;
+}
+
+/* convert one timestep of every input; return timestep number */
 int convert_tstep(diag_t *diag)
 {
-     int eof, err;
+     int ended = 0;
      
-     assert(buf != 0);
-     if (kdim == 1) {
-	  read_sprintars_tstep_2d(buf, &idim, &jdim, 
-				  &eof, &err);
-     } else {
-	  read_sprintars_tstep_3d(buf, &idim, &jdim, &kdim, 
-				  &eof, &err);
+     if (pipelined)
+	  return write_stage(diag);
+     assert(inputs != 0);
+     for (int v = 0; v < n_inputs; ++v) {
+	  input_t *input = &inputs[v];
+	  int eof, err;
+	  const void *raw;
+	  float *field;
+	  double t0 = stats_clock();
+
+	  assert(input->buf != 0);
+	  raw = read_sprintars_tstep(input->in, input->n, &eof, &err);
+	  /* did anything abnormal happen? */
+	  if (err != 0) {
+	       errno = err;
+	       perror("During conversion");
+	       exit(err);
+	  }
+	  if (eof) {
+	       ended++;
+	       continue;
+	  }
+	  raw = cut_sprintars(input->in, raw, input->cut);
+	  stats_add(STAGE_READ, t0, sizeof(float) * input->n);
+	  field = input->buf + fill * input->n_out;
+	  /* diagnostics come with the decoding */
+	  t0 = stats_clock();
+	  if (diag != 0 && v == 0)
+	       decode_be_float_diag(input->interp ? input->col : field,
+				    raw, input->n, diag);
+	  else
+	       decode_be_float(input->interp ? input->col : field,
+			       raw, input->n);
+	  stats_add(STAGE_DECODE, t0, sizeof(float) * input->n);
+	  if (input->interp)
+	       vinterp(field, input->col, step + 1, input->ps);
+	  quantize(input, field, v == 0 ? diag : 0);
      }
-     /* did anything abnormal happen? */
-     if (eof) {
+     check_ended(ended);
+     if (ended) {
+	  for (int v = 0; v < n_inputs; ++v)
+	       flush_batch(v, inputs[v].buf);
+	  fill = 0;
 	  return EOF;
      }
-     if (err != 0) {
-	  perror("During conversion");
-	  exit(err);
-     }
      step++;
-     /* diagnostics */
-     if (diag != 0) {
-     	  for (int i = 0; i < idim; ++i)
-     	       for (int j = 0; j < jdim; ++j)
-     		    for (int k = 0; k < kdim; ++k) {
-     			 float val = buf[(i * jdim + j) * kdim + k];
-     			 if (val > diag->val_max)
-     			      diag->val_max = val;
-     			 if (val < diag->val_min)
-     			      diag->val_min = val;
-     			 diag->val_mean += val;
-     		    }
-     	  diag->val_mean /= idim * jdim * kdim;
+     if (diag != 0)
 	  diag->tstep = step;
+     if (++fill == batch) {
+	  for (int v = 0; v < n_inputs; ++v)
+	       flush_batch(v, inputs[v].buf);
+	  fill = 0;
      }
-     write_nc(buf, step);
      return 0;
 }
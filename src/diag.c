@@ -28,22 +28,41 @@ diag_t *init_diag (diag_t *diag)
      diag->val_min = 2e20;
      diag->val_max = -2e20;
      diag->val_mean = 0;
+     diag->val_std = 0;
+     diag->n_nan = 0;
+     diag->err_max = 0;
      return diag;
 }
 
 void display_diag (const diag_t *diag)
 {
+     double rate, eta;
+
      assert(diag != 0);
      if (isatty(fileno(stdout))) {
 	  printf("\015\033[32m --->   \033[1m\033[31mtstep %5d\t"
 		 "min %8.3g, "
 		 "max %8.3g, "
-		 "mean %8.3g. "
-     	         "\033[0m\033[32m   <---\033[0m\015",
+		 "mean %8.3g, "
+		 "std %8.3g",
 		 diag->tstep,
 		 diag->val_min,
 		 diag->val_max,
-		 diag->val_mean);
+		 diag->val_mean,
+		 diag->val_std);
+	  if (diag->n_nan > 0)
+	       printf(", %zu NaN", diag->n_nan);
+	  /* how much --keep-bits or --pack changed the values */
+	  if (pack() != PACK_NONE || keep_bits() > 0)
+	       printf(", error %8.3g", diag->err_max);
+	  /* throughput so far and time left */
+	  stats_progress(&rate, &eta);
+	  printf(", %.1f MB/s", rate);
+	  if (eta >= 0)
+	       printf(", ETA %d:%02d:%02d", (int)eta / 3600,
+		      (int)eta / 60 % 60, (int)eta % 60);
+	  printf(". "
+     	         "\033[0m\033[32m   <---\033[0m\015");
      	  fflush(stdout);
      }
 }
@@ -0,0 +1,328 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Parallel compression for NetCDF4 output (--compress-threads).  The
+ * deflate filter inside nc_put_vara_float runs on one core, so instead
+ * we cut each row of chunks (all chunks that share a time index) out of
+ * the decoded fields ourselves, shuffle and deflate the chunks on a
+ * pool of worker threads exactly as the HDF5 filters would, and hand
+ * the finished chunks to H5Dwrite_chunk.  The file is defined by nc.c
+ * as usual and reopened through HDF5 only for the data writes, so the
+ * result is an ordinary NetCDF4 file. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sprintars2nc.h"
+
+#ifdef HAVE_DIRECT_CHUNKS
+#include <hdf5.h>
+#include <zlib.h>
+
+static hid_t file_id = -1, dset_id = -1;
+/* records the dataset has room for; a fixed time dimension has them
+ * all from the start */
+static hsize_t n_records;
+
+/* variable shape and chunk shape, always as (time, lvl, lat, lon); 2D
+ * variables have a single level */
+static int ndims;
+static size_t shape[4], chunk[4];
+static int shuffle_, level;
+
+/* chunks per row and their compressed images */
+static int n_chunks;
+static size_t chunk_bytes;
+static unsigned char **zbuf;
+static size_t *zlen;
+static int *done;
+
+/* timesteps collected for the current row (chunk[0] of them) */
+static float *row = 0;
+static int row_first, row_fill;
+
+/* worker pool; each worker gathers (and shuffles) its chunks in its
+ * own part of scratch */
+static pthread_t *workers;
+static int n_workers;
+static unsigned char *scratch;
+static int next_chunk, quit;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* copy chunk c of the current row into dst, zero-padding where the
+ * chunk sticks out of the variable, and shuffle the bytes if asked */
+static void gather_chunk(int c, float *dst, unsigned char *tmp)
+{
+     const size_t n_lon = (shape[3] + chunk[3] - 1) / chunk[3];
+     const size_t n_lat = (shape[2] + chunk[2] - 1) / chunk[2];
+     const size_t x0 = c % n_lon * chunk[3];
+     const size_t y0 = c / n_lon % n_lat * chunk[2];
+     const size_t l0 = c / n_lon / n_lat * chunk[1];
+     const size_t n = chunk[0] * chunk[1] * chunk[2] * chunk[3];
+     float *out = tmp != 0 ? (float *)tmp : dst;
+
+     memset(out, 0, sizeof(float) * n);
+     for (size_t t = 0; t < (size_t)row_fill; ++t)
+	  for (size_t l = 0; l < chunk[1] && l0 + l < shape[1]; ++l)
+	       for (size_t y = 0; y < chunk[2] && y0 + y < shape[2]; ++y) {
+		    const size_t nx = x0 + chunk[3] <= shape[3] ?
+			 chunk[3] : shape[3] - x0;
+		    memcpy(out + ((t * chunk[1] + l) * chunk[2] + y) *
+			   chunk[3],
+			   row + ((t * shape[1] + l0 + l) * shape[2] +
+				  y0 + y) * shape[3] + x0,
+			   sizeof(float) * nx);
+	       }
+     if (tmp != 0) {
+	  /* HDF5 shuffle: all first bytes, then all second bytes, ... */
+	  unsigned char *d = (unsigned char *)dst;
+	  for (size_t b = 0; b < sizeof(float); ++b)
+	       for (size_t i = 0; i < n; ++i)
+		    d[b * n + i] = tmp[i * sizeof(float) + b];
+     }
+}
+
+static void *compress_chunks(void *arg)
+{
+     unsigned char *mine = scratch + (intptr_t)arg *
+	  (shuffle_ ? 2 : 1) * chunk_bytes;
+     float *raw = (float *)mine;
+     unsigned char *tmp = shuffle_ ? mine + chunk_bytes : 0;
+
+     pthread_mutex_lock(&lock);
+     while (1) {
+	  uLongf len = compressBound(chunk_bytes);
+	  double t0;
+	  int c;
+	  while (!quit && next_chunk >= n_chunks)
+	       pthread_cond_wait(&cond, &lock);
+	  if (quit)
+	       break;
+	  c = next_chunk++;
+	  pthread_mutex_unlock(&lock);
+
+	  t0 = stats_clock();
+	  gather_chunk(c, raw, tmp);
+	  if (compress2(zbuf[c], &len, (const Bytef *)raw, chunk_bytes,
+			level) != Z_OK) {
+	       fprintf(stderr, "Compressing chunk %d failed\n", c);
+	       exit(2);
+	  }
+	  stats_add(STAGE_COMPRESS, t0, chunk_bytes);
+
+	  pthread_mutex_lock(&lock);
+	  zlen[c] = len;
+	  done[c] = 1;
+	  pthread_cond_broadcast(&cond);
+     }
+     pthread_mutex_unlock(&lock);
+     return 0;
+}
+
+/* compress the collected row on the workers and write its chunks in
+ * order as they become ready */
+static void flush_row()
+{
+     hsize_t extent[4], offset[4];
+     double t0;
+     const size_t n_lon = (shape[3] + chunk[3] - 1) / chunk[3];
+     const size_t n_lat = (shape[2] + chunk[2] - 1) / chunk[2];
+
+     if (row_fill == 0)
+	  return;
+     extent[0] = row_first + row_fill;
+     for (int d = 1; d < 4; ++d)
+	  extent[d] = shape[d];
+     if (ndims == 3) {
+	  extent[1] = extent[2];
+	  extent[2] = extent[3];
+     }
+     if (extent[0] > n_records) {
+	  if (H5Dset_extent(dset_id, extent) < 0) {
+	       fprintf(stderr, "Extending the output variable failed\n");
+	       exit(2);
+	  }
+	  n_records = extent[0];
+     }
+
+     pthread_mutex_lock(&lock);
+     for (int c = 0; c < n_chunks; ++c)
+	  done[c] = 0;
+     next_chunk = 0;
+     pthread_cond_broadcast(&cond);
+     for (int c = 0; c < n_chunks; ++c) {
+	  while (!done[c])
+	       pthread_cond_wait(&cond, &lock);
+	  pthread_mutex_unlock(&lock);
+
+	  offset[0] = row_first;
+	  offset[1] = c / n_lon / n_lat * chunk[1];
+	  offset[2] = c / n_lon % n_lat * chunk[2];
+	  offset[3] = c % n_lon * chunk[3];
+	  if (ndims == 3) {
+	       offset[1] = offset[2];
+	       offset[2] = offset[3];
+	  }
+	  t0 = stats_clock();
+	  if (H5Dwrite_chunk(dset_id, H5P_DEFAULT, 0, offset,
+			     zlen[c], zbuf[c]) < 0) {
+	       fprintf(stderr, "Writing chunk %d failed\n", c);
+	       exit(2);
+	  }
+	  stats_add(STAGE_CHUNK_WRITE, t0, zlen[c]);
+
+	  pthread_mutex_lock(&lock);
+     }
+     pthread_mutex_unlock(&lock);
+     row_first += row_fill;
+     row_fill = 0;
+}
+
+void direct_open(const char *fname, const char *varname,
+		 int ndims_, const size_t *shape_, const size_t *chunks_,
+		 int shuffle, int compress, int threads)
+{
+     hid_t space;
+     hsize_t dims[4];
+
+     file_id = H5Fopen(fname, H5F_ACC_RDWR, H5P_DEFAULT);
+     if (file_id < 0) {
+	  fprintf(stderr, "Reopening %s through HDF5 failed\n", fname);
+	  exit(2);
+     }
+     dset_id = H5Dopen2(file_id, varname, H5P_DEFAULT);
+     if (dset_id < 0) {
+	  fprintf(stderr, "Opening variable %s through HDF5 failed\n",
+		  varname);
+	  exit(2);
+     }
+     space = H5Dget_space(dset_id);
+     H5Sget_simple_extent_dims(space, dims, 0);
+     H5Sclose(space);
+     n_records = dims[0];
+
+     ndims = ndims_;
+     if (ndims == 3) {
+	  const size_t s[4] = { 0, 1, shape_[1], shape_[2] };
+	  const size_t k[4] = { chunks_[0], 1, chunks_[1], chunks_[2] };
+	  memcpy(shape, s, sizeof(s));
+	  memcpy(chunk, k, sizeof(k));
+     } else {
+	  memcpy(shape, shape_, sizeof(shape));
+	  memcpy(chunk, chunks_, sizeof(chunk));
+     }
+     shuffle_ = shuffle;
+     level = compress;
+     chunk_bytes = sizeof(float) * chunk[0] * chunk[1] * chunk[2] * chunk[3];
+     n_chunks = (shape[1] + chunk[1] - 1) / chunk[1] *
+	  ((shape[2] + chunk[2] - 1) / chunk[2]) *
+	  ((shape[3] + chunk[3] - 1) / chunk[3]);
+     zbuf = malloc(sizeof(unsigned char *) * n_chunks);
+     zbuf[0] = pool_alloc(compressBound(chunk_bytes) * n_chunks,
+			  "the compressed chunks");
+     for (int c = 1; c < n_chunks; ++c)
+	  zbuf[c] = zbuf[c - 1] + compressBound(chunk_bytes);
+     zlen = malloc(sizeof(size_t) * n_chunks);
+     done = malloc(sizeof(int) * n_chunks);
+     row = pool_alloc(sizeof(float) * chunk[0] * shape[1] * shape[2] *
+		      shape[3], "the rows of chunks");
+     row_first = row_fill = 0;
+
+     n_workers = threads;
+     next_chunk = n_chunks;
+     quit = 0;
+     scratch = pool_alloc((shuffle_ ? 2 : 1) * chunk_bytes * n_workers,
+			  "the compression buffers");
+     workers = malloc(sizeof(pthread_t) * n_workers);
+     for (int i = 0; i < n_workers; ++i) {
+	  if (pthread_create(&workers[i], 0, compress_chunks,
+			     (void *)(intptr_t)i) != 0) {
+	       perror("Starting compression thread");
+	       exit(1);
+	  }
+     }
+     if (verbose())
+	  printf("direct chunk writes: %d chunks per row, "
+		 "%d compression thread(s)\n", n_chunks, n_workers);
+}
+
+/* collect nsteps fields starting at step; write each row of chunks as
+ * soon as it is complete */
+void direct_write(const float *buf, int step, int nsteps)
+{
+     const size_t n = shape[1] * shape[2] * shape[3];
+
+     if (step != row_first + row_fill) {
+	  fprintf(stderr, "direct chunk writes must be in order "
+		  "(got step %d, expected %d)\n", step, row_first + row_fill);
+	  exit(2);
+     }
+     for (int s = 0; s < nsteps; ++s) {
+	  memcpy(row + n * row_fill, buf + n * s, sizeof(float) * n);
+	  if (++row_fill == (int)chunk[0])
+	       flush_row();
+     }
+}
+
+void direct_close()
+{
+     flush_row();
+     pthread_mutex_lock(&lock);
+     quit = 1;
+     pthread_cond_broadcast(&cond);
+     pthread_mutex_unlock(&lock);
+     for (int i = 0; i < n_workers; ++i)
+	  pthread_join(workers[i], 0);
+     H5Dclose(dset_id);
+     H5Fclose(file_id);
+     pool_free(zbuf[0]);
+     free(zbuf);
+     free(zlen);
+     free(done);
+     pool_free(row);
+     pool_free(scratch);
+     free(workers);
+}
+
+#else
+
+void direct_open(const char *fname, const char *varname,
+		 int ndims_, const size_t *shape_, const size_t *chunks_,
+		 int shuffle, int compress, int threads)
+{
+     fprintf(stderr, "sprintars2nc was built without direct chunk "
+	     "writes; rebuild with HDF5 and zlib (see Makefile) to use "
+	     "--compress-threads\n");
+     exit(1);
+}
+
+void direct_write(const float *buf, int step, int nsteps)
+{
+}
+
+void direct_close()
+{
+}
+
+#endif
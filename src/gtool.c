@@ -0,0 +1,896 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Native reader for SPRINTARS (GTOOL3) output.  The input file is a
+ * sequence of FORTRAN unformatted sequential records, each framed by
+ * a 4-byte big-endian length marker before and after the payload.
+ * Every timestep consists of a 1024-byte header record followed by a
+ * data record of big-endian 4-byte floats in (i, j, k) order, which is
+ * exactly the layout of the conversion buffer.  We map the whole file
+ * and walk the record markers ourselves, so the data can be decoded
+ * (swap.c) straight from the mapped pages.
+ *
+ * To convert only some timesteps (--tstart, --tend, --stride), we
+ * first hop from marker to marker without touching the data and note
+ * where each timestep starts; reading then jumps straight to the
+ * selected ones.  The index can be kept next to the input as
+ * <infile>.idx (--save-index) and is reused while the input's size and
+ * modification time stay the same.
+ *
+ * Likewise, to convert only a box of each field (--lon-range,
+ * --lat-range, --levels), the reader copies just the rows of the box
+ * out of the mapping (cut_sprintars) instead of handing over the whole
+ * record, so only the pages holding them are ever read from disk.
+ *
+ * With --threads, several threads read at once, each claiming a
+ * timestep by number: pread_sprintars looks up where it starts in the
+ * index and reads its data (or the rows of its box) with pread into
+ * the thread's own buffer, leaving the mapping and the position of the
+ * sequential reader alone.
+ *
+ * With --read-ahead, the sequential reader does not touch the mapping
+ * either: aio.c keeps the next timesteps in flight in buffers of its
+ * own, using the index like pread_sprintars does.
+ *
+ * An input that cannot be mapped (stdin given as "-", a pipe or a
+ * FIFO) is read front to back instead, one record at a time into a
+ * buffer; the timesteps outside --tstart/--tend/--stride are read and
+ * dropped, since there is no jumping over them.
+ *
+ * The headers are otherwise skipped, except that head_sprintars parses
+ * those of the first two timesteps for the variable name, units, grid
+ * and dates, so that the command line can leave them out (main.c).
+ *
+ * Some files interleave the records of several items (ITEM in the
+ * header), e.g. one record each of PS, T and Q per timestep.  Every
+ * item then gets a reader of its own (item_sprintars) that takes
+ * only the records of that item, and indexes only those, so that the
+ * file is read once however many variables it holds.  Streams cannot
+ * be shared like that and must hold a single item. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sprintars2nc.h"
+
+/* first bytes of a saved index */
+#define INDEX_MAGIC "S2NCIDX1"
+
+/* big-endian 4-byte unsigned integer at p */
+static uint32_t be32 (const unsigned char *p)
+{
+     return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	  (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/* field i (counting from 1, as the GTOOL documentation does) of a
+ * header, without the blanks around it */
+static void head_field (const unsigned char *head, int i,
+			char out[GTOOL_FIELD_LEN + 1])
+{
+     const char *f = (const char *)head + (i - 1) * GTOOL_FIELD_LEN;
+     int a = 0, b = GTOOL_FIELD_LEN;
+
+     while (a < b && (f[a] == ' ' || f[a] == 0))
+	  a++;
+     while (b > a && (f[b - 1] == ' ' || f[b - 1] == 0))
+	  b--;
+     memcpy(out, f + a, b - a);
+     out[b - a] = 0;
+}
+
+/* integer field i, or 0 if it is blank or not a number */
+static long head_int (const unsigned char *head, int i)
+{
+     char f[GTOOL_FIELD_LEN + 1], *end;
+     long val;
+
+     head_field(head, i, f);
+     val = strtol(f, &end, 10);
+     return end != f && *end == 0 ? val : 0;
+}
+
+/* pick the fields we use out of a header record; return 0 if it is
+ * not a GTOOL3 header (IDFM 9010) */
+static int parse_head (const unsigned char *head, gtool_head_t *h)
+{
+     static const struct {
+	  const char *name;
+	  long sec;
+     } utim[] = {
+	  { "SEC", 1 }, { "MIN", 60 }, { "HOUR", 3600 }, { "DAY", 86400 }
+     };
+     char f[GTOOL_FIELD_LEN + 1];
+     int y, mo, d, hh, mi, ss;
+
+     if (head_int(head, 1) != 9010)
+	  return 0;
+     head_field(head, 3, h->item);
+     head_field(head, 16, h->unit);
+     head_field(head, 38, h->dfmt);
+     for (int a = 0; a < 3; ++a) {
+	  const long astr = head_int(head, 30 + 3 * a);
+	  const long aend = head_int(head, 31 + 3 * a);
+	  head_field(head, 29 + 3 * a, h->aitm[a]);
+	  h->size[a] = aend > 0 && aend >= astr ? aend - astr + 1 : 0;
+     }
+     /* DATE is YYYYMMDD HHMMSS */
+     h->date = -1;
+     head_field(head, 27, f);
+     if (sscanf(f, "%4d%2d%2d %2d%2d%2d", &y, &mo, &d, &hh, &mi, &ss)
+	 == 6) {
+	  char buf[64];
+	  snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d",
+		   y, mo, d, hh, mi, ss);
+	  h->date = strtotime(buf);
+     }
+     /* TDUR counts in units of UTIM */
+     h->tdur = 0;
+     head_field(head, 26, f);
+     for (size_t u = 0; u < sizeof(utim) / sizeof(utim[0]); ++u)
+	  if (strcmp(f, utim[u].name) == 0)
+	       h->tdur = head_int(head, 28) * utim[u].sec;
+     return 1;
+}
+
+/* is head the header of a record of the item g reads? */
+static int is_item (const gtool_t *g, const unsigned char *head)
+{
+     char item[GTOOL_FIELD_LEN + 1];
+
+     if (g->item[0] == 0)
+	  return 1;
+     head_field(head, 3, item);
+     return strcmp(item, g->item) == 0;
+}
+
+gtool_t *open_sprintars (const char *fname, int *err)
+{
+     struct stat st;
+     gtool_t *g = malloc(sizeof(gtool_t));
+
+     if (strcmp(fname, "-") == 0)
+	  g->fd = dup(STDIN_FILENO);
+     else
+	  g->fd = open(fname, O_RDONLY);
+     if (g->fd == -1 || fstat(g->fd, &st) == -1) {
+	  *err = errno;
+	  free(g);
+	  return 0;
+     }
+     g->size = st.st_size;
+     g->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+     g->pos = 0;
+     g->map = 0;
+     g->index = 0;
+     g->n_index = 0;
+     g->first = 0;
+     g->last = (size_t)-1;
+     g->stride = 1;
+     g->next = 0;
+     g->stream = !S_ISREG(st.st_mode);
+     g->buf = 0;
+     g->buf_len = 0;
+     g->peeked = 0;
+     g->t = 0;
+     g->boxed = 0;
+     g->aio = 0;
+     g->n_head = -1;
+     g->item[0] = 0;
+     /* an empty file has nothing to map, but is otherwise fine (it
+      * just ends right away) */
+     if (!g->stream && g->size > 0) {
+	  void *map = mmap(0, g->size, PROT_READ, MAP_PRIVATE, g->fd, 0);
+	  if (map == MAP_FAILED) {
+	       *err = errno;
+	       close(g->fd);
+	       free(g);
+	       return 0;
+	  }
+	  /* we only ever walk forward through the file */
+	  posix_madvise(map, g->size, POSIX_MADV_SEQUENTIAL);
+	  g->map = map;
+     }
+     *err = 0;
+     return g;
+}
+
+void close_sprintars (gtool_t *g)
+{
+     if (g == 0)
+	  return;
+     if (g->aio != 0)
+	  aio_close(g);
+     if (g->map != 0)
+	  munmap((void *)g->map, g->size);
+     close(g->fd);
+     free(g->index);
+     pool_free(g->buf);
+     free(g);
+}
+
+/* read len bytes at offset off, retrying short reads; return 0 or an
+ * error number */
+static int pread_full (int fd, void *buf, size_t len, size_t off)
+{
+     unsigned char *p = buf;
+
+     while (len > 0) {
+	  const ssize_t got = pread(fd, p, len, off);
+	  if (got == -1 && errno == EINTR)
+	       continue;
+	  if (got == -1)
+	       return errno;
+	  if (got == 0) {
+	       fprintf(stderr, "truncated record at offset %zu\n", off);
+	       return EIO;
+	  }
+	  p += got;
+	  off += got;
+	  len -= got;
+     }
+     return 0;
+}
+
+/* big-endian record marker at offset off */
+static int pread_marker (int fd, size_t off, size_t *len)
+{
+     unsigned char mark[4];
+     const int err = pread_full(fd, mark, 4, off);
+
+     *len = be32(mark);
+     return err;
+}
+
+/* read selected timestep k (counting the selected timesteps from 0) of
+ * n values, or the box of it, into buf; needs the index
+ * (select_sprintars), and any number of threads may call it at once,
+ * except for a stream, which has to be read one timestep after the
+ * other; return 0 or an error number */
+int pread_sprintars (gtool_t *g, size_t k, int n, void *buf, int *eof)
+{
+     const size_t t = g->first + k * g->stride;
+     size_t pos, len, trail;
+     int err;
+
+     /* a stream has no index; the caller has to ask for the timesteps
+      * in order */
+     if (g->stream) {
+	  const void *data = read_sprintars_tstep(g, n, eof, &err);
+	  if (data != 0 && cut_sprintars(g, data, buf) == data)
+	       memcpy(buf, data, sizeof(float) * n);
+	  return err;
+     }
+     *eof = 0;
+     if (t >= g->n_index || t > g->last) {
+	  *eof = 1;
+	  return 0;
+     }
+     pos = g->index[t];
+     if ((err = pread_marker(g->fd, pos, &len)) != 0)
+	  return err;
+     if (len != GTOOL_HEAD_LEN) {
+	  fprintf(stderr, "header record has %zu bytes, expected %d\n",
+		  len, GTOOL_HEAD_LEN);
+	  return EIO;
+     }
+     pos += 4 + GTOOL_HEAD_LEN + 4;
+     if ((err = pread_marker(g->fd, pos, &len)) != 0)
+	  return err;
+     if (g->boxed)
+	  n = g->n_lon * g->n_lat * g->n_lvl;
+     if (len != sizeof(float) * n) {
+	  fprintf(stderr, "data record has %zu bytes, expected %zu\n",
+		  len, sizeof(float) * n);
+	  return EIO;
+     }
+     if ((err = pread_marker(g->fd, pos + 4 + len, &trail)) != 0)
+	  return err;
+     if (trail != len) {
+	  fprintf(stderr, "record markers at offset %zu do not match "
+		  "(%zu vs. %zu)\n", pos, len, trail);
+	  return EIO;
+     }
+     pos += 4;
+     if (!g->boxed)
+	  return pread_full(g->fd, buf, len, pos);
+     /* the box, row by row, wrapping around the end of each row */
+     {
+	  const box_t *b = &g->box;
+	  const size_t n1 = b->i0 + b->ni <= g->n_lon ?
+	       b->ni : g->n_lon - b->i0;
+	  const size_t n2 = b->ni - n1;
+	  unsigned char *dst = buf;
+
+	  for (int l = b->k0; l < b->k0 + b->nk; ++l)
+	       for (int j = b->j0; j < b->j0 + b->nj; ++j) {
+		    const size_t row = pos + sizeof(float) *
+			 ((size_t)l * g->n_lat + j) * g->n_lon;
+		    err = pread_full(g->fd, dst, sizeof(float) * n1,
+				     row + sizeof(float) * b->i0);
+		    if (err == 0 && n2 > 0)
+			 err = pread_full(g->fd, dst + sizeof(float) * n1,
+					  sizeof(float) * n2, row);
+		    if (err != 0)
+			 return err;
+		    dst += sizeof(float) * b->ni;
+	       }
+     }
+     return 0;
+}
+
+/* locate the next record in the mapping; return its payload and
+ * length and advance past the trailing marker */
+static int next_record (gtool_t *g, const unsigned char **data,
+			size_t *len, int *eof)
+{
+     size_t lead, trail;
+
+     *eof = 0;
+     if (g->pos == g->size) {
+	  *eof = 1;
+	  return 0;
+     }
+     if (g->size - g->pos < 4) {
+	  fprintf(stderr, "truncated record marker at offset %zu\n", g->pos);
+	  return EIO;
+     }
+     lead = be32(g->map + g->pos);
+     if (g->size - g->pos - 4 < lead + 4) {
+	  fprintf(stderr, "truncated record at offset %zu "
+		  "(%zu bytes announced)\n", g->pos, lead);
+	  return EIO;
+     }
+     trail = be32(g->map + g->pos + 4 + lead);
+     if (trail != lead) {
+	  fprintf(stderr, "record markers at offset %zu do not match "
+		  "(%zu vs. %zu)\n", g->pos, lead, trail);
+	  return EIO;
+     }
+     *data = g->map + g->pos + 4;
+     *len = lead;
+     g->pos += lead + 8;
+     return 0;
+}
+
+/* the next (selected) timestep in the mapping: its data and length */
+static int map_tstep (gtool_t *g, const unsigned char **data, size_t *len,
+		      int *eof)
+{
+     const unsigned char *head;
+     size_t pos;
+     int err;
+
+     /* jump to the next selected timestep */
+     if (g->index != 0) {
+	  const size_t t = g->first + g->next * g->stride;
+	  if (t >= g->n_index || t > g->last) {
+	       *eof = 1;
+	       return 0;
+	  }
+	  g->pos = g->index[t];
+	  g->next++;
+     }
+     /* without an index, walk past the records of other items */
+     while (1) {
+	  pos = g->pos;
+	  err = next_record(g, &head, len, eof);
+	  if (err != 0 || *eof)
+	       return err;
+	  if (*len != GTOOL_HEAD_LEN) {
+	       fprintf(stderr, "header record has %zu bytes, expected %d\n",
+		       *len, GTOOL_HEAD_LEN);
+	       return EIO;
+	  }
+	  err = next_record(g, data, len, eof);
+	  if (err == 0 && *eof) {
+	       fprintf(stderr, "header without data at offset %zu\n", pos);
+	       *eof = 0;
+	       return EIO;
+	  }
+	  if (err != 0 || g->index != 0 || is_item(g, head))
+	       return err;
+     }
+}
+
+/* read len bytes from fd, fewer only at the end of the input; *got
+ * says how many; return 0 or an error number */
+static int read_full (int fd, void *buf, size_t len, size_t *got)
+{
+     unsigned char *p = buf;
+
+     *got = 0;
+     while (*got < len) {
+	  const ssize_t n = read(fd, p + *got, len - *got);
+	  if (n == -1 && errno == EINTR)
+	       continue;
+	  if (n == -1)
+	       return errno;
+	  if (n == 0)
+	       break;
+	  *got += n;
+     }
+     return 0;
+}
+
+/* read the next record of a stream into g->buf; return its length */
+static int stream_record (gtool_t *g, size_t *len, int *eof)
+{
+     unsigned char mark[4];
+     size_t got, trail;
+     int err;
+
+     *eof = 0;
+     if ((err = read_full(g->fd, mark, 4, &got)) != 0)
+	  return err;
+     if (got == 0) {
+	  *eof = 1;
+	  return 0;
+     }
+     if (got < 4) {
+	  fprintf(stderr, "truncated record marker at offset %zu\n", g->pos);
+	  return EIO;
+     }
+     *len = be32(mark);
+     /* room for the payload and the trailing marker */
+     if (*len + 4 > g->buf_len) {
+	  pool_free(g->buf);
+	  g->buf_len = *len + 4;
+	  g->buf = pool_alloc(g->buf_len, "the stream records");
+     }
+     if ((err = read_full(g->fd, g->buf, *len + 4, &got)) != 0)
+	  return err;
+     if (got < *len + 4) {
+	  fprintf(stderr, "truncated record at offset %zu "
+		  "(%zu bytes announced)\n", g->pos, *len);
+	  return EIO;
+     }
+     trail = be32(g->buf + *len);
+     if (trail != *len) {
+	  fprintf(stderr, "record markers at offset %zu do not match "
+		  "(%zu vs. %zu)\n", g->pos, *len, trail);
+	  return EIO;
+     }
+     g->pos += *len + 8;
+     return 0;
+}
+
+/* read the next timestep of a stream; its data ends up in g->buf */
+static int stream_next (gtool_t *g, size_t *len, int *eof)
+{
+     const size_t pos = g->pos;
+     int err = stream_record(g, len, eof);
+
+     if (err != 0 || *eof)
+	  return err;
+     if (*len != GTOOL_HEAD_LEN) {
+	  fprintf(stderr, "header record has %zu bytes, expected %d\n",
+		  *len, GTOOL_HEAD_LEN);
+	  return EIO;
+     }
+     /* the only header of a stream we ever get to see; the ones
+      * after it must be of the same item */
+     if (pos == 0) {
+	  g->n_head = parse_head(g->buf, &g->head[0]);
+     } else if (g->n_head == 1) {
+	  char item[GTOOL_FIELD_LEN + 1];
+	  head_field(g->buf, 3, item);
+	  if (strcmp(item, g->head[0].item) != 0) {
+	       fprintf(stderr, "the stream holds records of several items "
+		       "(%s, %s); convert it from a file, or split it "
+		       "first\n", g->head[0].item, item);
+	       return EIO;
+	  }
+     }
+     err = stream_record(g, len, eof);
+     if (err == 0 && *eof) {
+	  fprintf(stderr, "header without data at offset %zu\n", pos);
+	  *eof = 0;
+	  return EIO;
+     }
+     return err;
+}
+
+/* the next selected timestep of a stream, dropping the others */
+static int stream_tstep (gtool_t *g, size_t *len, int *eof)
+{
+     while (1) {
+	  size_t t;
+	  int err = 0;
+	  /* peek_sprintars may have read it already */
+	  if (g->peeked > 0) {
+	       *len = g->peeked;
+	       *eof = 0;
+	       g->peeked = 0;
+	  } else {
+	       err = stream_next(g, len, eof);
+	  }
+	  if (err != 0 || *eof)
+	       return err;
+	  t = g->t++;
+	  if (t > g->last) {
+	       *eof = 1;
+	       return 0;
+	  }
+	  if (t >= g->first && (t - g->first) % g->stride == 0)
+	       return 0;
+     }
+}
+
+/* read one timestep (header and data record) of n values, or of the
+ * full field if a box is set; return a pointer to the big-endian
+ * data, which stays valid until the next read (streams) or as long as
+ * the file is open */
+const void *read_sprintars_tstep (gtool_t *g, int n, int *eof, int *err)
+{
+     const unsigned char *data;
+     size_t len;
+
+     if (g->aio != 0)
+	  return aio_tstep(g, eof, err);
+     if (g->stream) {
+	  *err = stream_tstep(g, &len, eof);
+	  data = g->buf;
+     } else {
+	  *err = map_tstep(g, &data, &len, eof);
+     }
+     if (*err != 0 || *eof)
+	  return 0;
+     if (g->boxed)
+	  n = g->n_lon * g->n_lat * g->n_lvl;
+     if (len != sizeof(float) * n) {
+	  fprintf(stderr, "data record has %zu bytes, expected %zu\n",
+		  len, sizeof(float) * n);
+	  *err = EIO;
+	  return 0;
+     }
+     return data;
+}
+
+/* number of values in the first data record ahead, without consuming
+ * anything; 0 if there is no complete timestep */
+size_t peek_sprintars (gtool_t *g)
+{
+     const unsigned char *data;
+     const size_t pos = g->pos, next = g->next;
+     size_t len = 0;
+     int eof, err;
+
+     /* a stream keeps the timestep for the next read */
+     if (g->stream) {
+	  if (g->peeked == 0 && stream_next(g, &len, &eof) == 0 && !eof)
+	       g->peeked = len;
+	  return g->peeked / sizeof(float);
+     }
+     err = map_tstep(g, &data, &len, &eof);
+     g->pos = pos;
+     g->next = next;
+     if (err != 0 || eof)
+	  return 0;
+     return len / sizeof(float);
+}
+
+/* number of (selected) timesteps, from the index if there is one, or
+ * else guessed from the size of the file and of the first timestep */
+size_t count_sprintars (gtool_t *g)
+{
+     size_t n, last;
+
+     if (g->stream)
+	  return 0;
+     if (g->index != 0) {
+	  last = g->last < g->n_index ? g->last + 1 : g->n_index;
+	  return g->first < last ?
+	       (last - g->first + g->stride - 1) / g->stride : 0;
+     }
+     n = peek_sprintars(g);
+     if (n == 0)
+	  return 0;
+     return g->size / (4 + GTOOL_HEAD_LEN + 4 + 4 + sizeof(float) * n + 4);
+}
+
+/* number of (selected) timesteps if it is known exactly: from the
+ * index, or from the size of the file if that is a whole number of
+ * timesteps the size of the first one; else 0 */
+size_t records_sprintars (gtool_t *g)
+{
+     size_t n, step;
+
+     if (g->stream)
+	  return 0;
+     if (g->index != 0)
+	  return count_sprintars(g);
+     if (g->item[0] != 0)
+	  return 0;
+     n = peek_sprintars(g);
+     if (n == 0)
+	  return 0;
+     step = 4 + GTOOL_HEAD_LEN + 4 + 4 + sizeof(float) * n + 4;
+     return g->size % step == 0 ? g->size / step : 0;
+}
+
+/* header of timestep k (0 or 1) of the file, counting from its start
+ * whatever the selection, or 0 if the file has no such timestep or
+ * no GTOOL3 headers; of a stream, only the first one is known */
+const gtool_head_t *head_sprintars (gtool_t *g, int k)
+{
+     size_t pos = 0;
+
+     if (g->stream && g->n_head == -1)
+	  peek_sprintars(g);
+     if (g->n_head == -1) {
+	  g->n_head = 0;
+	  while (g->n_head < 2 && g->map != 0 &&
+		 g->size - pos >= 4 + GTOOL_HEAD_LEN + 4 &&
+		 be32(g->map + pos) == GTOOL_HEAD_LEN &&
+		 parse_head(g->map + pos + 4, &g->head[g->n_head])) {
+	       if (is_item(g, g->map + pos + 4))
+		    g->n_head++;
+	       /* on to the next header, past the data record */
+	       pos += 4 + GTOOL_HEAD_LEN + 4;
+	       if (g->size - pos < 4)
+		    break;
+	       pos += 4 + (size_t)be32(g->map + pos) + 4;
+	       if (pos > g->size)
+		    break;
+	  }
+     }
+     return k < g->n_head ? &g->head[k] : 0;
+}
+
+/* the items (ITEM) of the records at the start of the file, up to
+ * the first record of an item seen before, in the order they come
+ * in; return how many (at most max), or 0 if the file has no GTOOL3
+ * headers.  A stream is not looked at, since that would consume it */
+int items_sprintars (gtool_t *g, char items[][GTOOL_FIELD_LEN + 1], int max)
+{
+     gtool_head_t h;
+     size_t pos = 0;
+     int n = 0;
+
+     while (n < max && g->map != 0 &&
+	    g->size - pos >= 4 + GTOOL_HEAD_LEN + 4 &&
+	    be32(g->map + pos) == GTOOL_HEAD_LEN &&
+	    parse_head(g->map + pos + 4, &h)) {
+	  for (int i = 0; i < n; ++i)
+	       if (strcmp(items[i], h.item) == 0)
+		    return n;
+	  strcpy(items[n++], h.item);
+	  pos += 4 + GTOOL_HEAD_LEN + 4;
+	  if (g->size - pos < 4)
+	       break;
+	  pos += 4 + (size_t)be32(g->map + pos) + 4;
+	  if (pos > g->size)
+	       break;
+     }
+     return n;
+}
+
+/* read only the records of the given item from now on */
+void item_sprintars (gtool_t *g, const char *item)
+{
+     strncpy(g->item, item, GTOOL_FIELD_LEN);
+     g->item[GTOOL_FIELD_LEN] = 0;
+     g->n_head = -1;
+}
+
+/* go back to the first (selected) timestep */
+void rewind_sprintars (gtool_t *g)
+{
+     g->pos = 0;
+     g->next = 0;
+     if (g->aio != 0)
+	  aio_rewind(g);
+}
+
+/* load the index saved for fname, if it still describes the file */
+static int read_index (gtool_t *g, const char *fname)
+{
+     char magic[8];
+     uint64_t head[3];
+     FILE *f = fopen(fname, "rb");
+
+     if (f == 0)
+	  return 0;
+     if (fread(magic, 1, 8, f) != 8 || memcmp(magic, INDEX_MAGIC, 8) != 0 ||
+	 fread(head, sizeof(uint64_t), 3, f) != 3 ||
+	 head[0] != g->size || head[1] != (uint64_t)g->mtime) {
+	  fclose(f);
+	  return 0;
+     }
+     g->n_index = head[2];
+     g->index = malloc(sizeof(size_t) * (g->n_index + 1));
+     for (size_t t = 0; t < g->n_index; ++t) {
+	  uint64_t off;
+	  if (fread(&off, sizeof(off), 1, f) != 1 || off >= g->size) {
+	       free(g->index);
+	       g->index = 0;
+	       fclose(f);
+	       return 0;
+	  }
+	  g->index[t] = off;
+     }
+     fclose(f);
+     return 1;
+}
+
+/* save the index for fname; a failure only costs the next run a
+ * scan, so just say so */
+static void write_index (const gtool_t *g, const char *fname)
+{
+     char tmp[1024 + 1 + GTOOL_FIELD_LEN + 8];
+     const uint64_t head[3] = { g->size, (uint64_t)g->mtime, g->n_index };
+     FILE *f;
+     int ok;
+
+     snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+     f = fopen(tmp, "wb");
+     if (f == 0) {
+	  perror("Saving index");
+	  return;
+     }
+     ok = fwrite(INDEX_MAGIC, 1, 8, f) == 8 &&
+	  fwrite(head, sizeof(uint64_t), 3, f) == 3;
+     for (size_t t = 0; ok && t < g->n_index; ++t) {
+	  const uint64_t off = g->index[t];
+	  ok = fwrite(&off, sizeof(off), 1, f) == 1;
+     }
+     if (fclose(f) != 0 || !ok || rename(tmp, fname) != 0) {
+	  perror("Saving index");
+	  remove(tmp);
+     }
+}
+
+/* find where each timestep of g starts, from the index saved next to
+ * fname or by walking the record markers, and save the index if asked;
+ * return 0 or an error number */
+static int index_sprintars (gtool_t *g, const char *fname, int save)
+{
+     char idx_fname[1024 + 1 + GTOOL_FIELD_LEN + 4];
+     size_t cap = 0;
+
+     /* already done, e.g. before narrowing the selection to the
+      * part of an MPI rank */
+     if (g->index != 0)
+	  return 0;
+     /* each item of a file has an index of its own */
+     if (g->item[0] != 0)
+	  snprintf(idx_fname, sizeof(idx_fname), "%s.%s.idx", fname,
+		   g->item);
+     else
+	  snprintf(idx_fname, sizeof(idx_fname), "%s.idx", fname);
+     if (read_index(g, idx_fname)) {
+	  if (verbose())
+	       printf("%s: %zu timesteps (index %s)\n", fname, g->n_index,
+		      idx_fname);
+	  return 0;
+     }
+     g->pos = 0;
+     while (1) {
+	  const unsigned char *data, *head = 0;
+	  const size_t pos = g->pos;
+	  size_t len;
+	  int eof, err;
+
+	  err = next_record(g, &head, &len, &eof);
+	  if (err == 0 && !eof && len != GTOOL_HEAD_LEN) {
+	       fprintf(stderr, "header record has %zu bytes, expected %d\n",
+		       len, GTOOL_HEAD_LEN);
+	       err = EIO;
+	  }
+	  if (err == 0 && !eof)
+	       err = next_record(g, &data, &len, &eof);
+	  if (err == 0 && eof && g->pos != pos) {
+	       fprintf(stderr, "header without data at offset %zu\n", pos);
+	       err = EIO;
+	  }
+	  if (err != 0) {
+	       g->pos = 0;
+	       return err;
+	  }
+	  if (eof)
+	       break;
+	  if (!is_item(g, head))
+	       continue;
+	  if (g->n_index == cap) {
+	       cap = cap > 0 ? 2 * cap : 256;
+	       g->index = realloc(g->index, sizeof(size_t) * cap);
+	  }
+	  g->index[g->n_index++] = pos;
+     }
+     g->pos = 0;
+     if (verbose())
+	  printf("%s: %zu timesteps (scanned)\n", fname, g->n_index);
+     if (save)
+	  write_index(g, idx_fname);
+     return 0;
+}
+
+/* read only timesteps first, first + stride, ... up to last (counting
+ * from 0, inclusive); return 0 or an error number */
+int select_sprintars (gtool_t *g, const char *fname,
+		      size_t first, size_t last, size_t stride, int save)
+{
+     int err;
+
+     /* a stream is read front to back, dropping what we skip */
+     if (g->stream && save) {
+	  fprintf(stderr, "cannot index %s, which is not a file\n", fname);
+	  return ESPIPE;
+     }
+     err = g->stream ? 0 : index_sprintars(g, fname, save);
+     if (err != 0)
+	  return err;
+     g->first = first;
+     g->last = last;
+     g->stride = stride;
+     g->next = 0;
+     /* with gaps, do not read ahead into the records we skip */
+     if (stride > 1 && g->map != 0)
+	  posix_madvise((void *)g->map, g->size, POSIX_MADV_RANDOM);
+     return 0;
+}
+
+/* convert only the given box of each n_lon x n_lat x n_lvl field */
+void box_sprintars (gtool_t *g, int n_lon, int n_lat, int n_lvl,
+		    const box_t *box)
+{
+     g->boxed = 1;
+     g->n_lon = n_lon;
+     g->n_lat = n_lat;
+     g->n_lvl = n_lvl;
+     g->box = *box;
+     /* the kernel's read-ahead would fetch the whole record */
+     if (g->map != 0)
+	  posix_madvise((void *)g->map, g->size, POSIX_MADV_RANDOM);
+}
+
+/* copy the box of the record at data into buf (room for the box's
+ * values) and return buf; without a box, return data as it is */
+const void *cut_sprintars (gtool_t *g, const void *data, void *buf)
+{
+     const box_t *b = &g->box;
+     const unsigned char *src = data;
+     unsigned char *dst = buf;
+     size_t n1, n2;
+
+     if (!g->boxed)
+	  return data;
+     /* columns up to the end of the row; the rest wraps around */
+     n1 = b->i0 + b->ni <= g->n_lon ? b->ni : g->n_lon - b->i0;
+     n2 = b->ni - n1;
+     for (int k = b->k0; k < b->k0 + b->nk; ++k)
+	  for (int j = b->j0; j < b->j0 + b->nj; ++j) {
+	       const unsigned char *row =
+		    src + sizeof(float) * ((size_t)k * g->n_lat + j) * g->n_lon;
+	       memcpy(dst, row + sizeof(float) * b->i0, sizeof(float) * n1);
+	       dst += sizeof(float) * n1;
+	       memcpy(dst, row, sizeof(float) * n2);
+	       dst += sizeof(float) * n2;
+	  }
+     return buf;
+}
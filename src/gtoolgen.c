@@ -0,0 +1,244 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Generator for synthetic SPRINTARS (GTOOL3) files, used by the
+ * benchmark (bench.c).  Each timestep is a 1024-byte header record in
+ * the GTOOL layout followed by a data record of big-endian floats, the
+ * same framing the converter reads (gtool.c).  The field is smooth with
+ * a little deterministic noise, so that it compresses about as well as
+ * model output does.  Optionally writes matching lon/lat/lvl tables in
+ * the format read_table (dims.c) expects. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const double pi = 3.14159265358979323846;
+
+/* GTOOL header: 64 ASCII fields of 16 characters */
+#define GTOOL_FIELDS 64
+#define GTOOL_FIELD_LEN 16
+
+static void usage (int code)
+{
+     printf("Usage: gtoolgen [options] outfile\n\n"
+	    "-x <n>       (default: 640)   number of longitudes\n"
+	    "-y <n>       (default: 320)   number of latitudes\n"
+	    "-z <n>       (default: 1)     number of levels (1: 2D field)\n"
+	    "-t <n>       (default: 8)     number of timesteps\n"
+	    "-i <item>    (default: T)     GTOOL item name\n"
+	    "-T <prefix>                   also write the tables\n"
+	    "                              prefix.lon, prefix.lat and\n"
+	    "                              (for 3D fields) prefix.lvl\n"
+	    "-h                            print this message and exit\n");
+     exit(code);
+}
+
+/* set header field i (counting from 1, as the GTOOL documentation
+ * does) */
+static void set_field (char *head, int i, const char *val)
+{
+     char buf[GTOOL_FIELD_LEN + 1];
+
+     snprintf(buf, sizeof(buf), "%-16s", val);
+     memcpy(head + (i - 1) * GTOOL_FIELD_LEN, buf, GTOOL_FIELD_LEN);
+}
+
+static void set_int (char *head, int i, long val)
+{
+     char buf[32];
+
+     snprintf(buf, sizeof(buf), "%16ld", val);
+     set_field(head, i, buf);
+}
+
+/* header of 3-hourly timestep t */
+static void make_head (char *head, int t, const char *item,
+		       int n_lon, int n_lat, int n_lvl)
+{
+     char buf[32];
+     const int hours = 3 * t;
+
+     memset(head, ' ', GTOOL_FIELDS * GTOOL_FIELD_LEN);
+     set_int(head, 1, 9010);
+     set_field(head, 2, "SPRINTARS");
+     set_field(head, 3, item);
+     set_field(head, 16, "K");
+     set_int(head, 25, hours);
+     set_field(head, 26, "HOUR");
+     snprintf(buf, sizeof(buf), "2000%02d%02d %02d0000",
+	      1 + hours / 24 / 31 % 12, 1 + hours / 24 % 31, hours % 24);
+     set_field(head, 27, buf);
+     set_int(head, 28, 3);
+     snprintf(buf, sizeof(buf), "GLON%d", n_lon);
+     set_field(head, 29, buf);
+     set_int(head, 30, 1);
+     set_int(head, 31, n_lon);
+     snprintf(buf, sizeof(buf), "GGLA%d", n_lat);
+     set_field(head, 32, buf);
+     set_int(head, 33, 1);
+     set_int(head, 34, n_lat);
+     if (n_lvl == 1)
+	  snprintf(buf, sizeof(buf), "SFC1");
+     else
+	  snprintf(buf, sizeof(buf), "SIG%d", n_lvl);
+     set_field(head, 35, buf);
+     set_int(head, 36, 1);
+     set_int(head, 37, n_lvl);
+     set_field(head, 38, "UR4");
+     set_field(head, 39, "  -9.9900000E+02");
+}
+
+static void put_be32 (unsigned char *p, uint32_t v)
+{
+     p[0] = v >> 24;
+     p[1] = v >> 16;
+     p[2] = v >> 8;
+     p[3] = v;
+}
+
+/* one FORTRAN unformatted record */
+static void write_record (FILE *f, const void *data, uint32_t len)
+{
+     unsigned char mark[4];
+
+     put_be32(mark, len);
+     if (fwrite(mark, 4, 1, f) != 1 ||
+	 (len > 0 && fwrite(data, len, 1, f) != 1) ||
+	 fwrite(mark, 4, 1, f) != 1) {
+	  perror("Writing output file");
+	  exit(1);
+     }
+}
+
+static void write_table (const char *prefix, const char *ext,
+			 int n, double first, double step)
+{
+     char fname[1024];
+     FILE *f;
+
+     snprintf(fname, sizeof(fname), "%s.%s", prefix, ext);
+     f = fopen(fname, "w");
+     if (f == 0) {
+	  perror("Writing table");
+	  exit(1);
+     }
+     fprintf(f, "# %s, generated by gtoolgen\n", ext);
+     for (int i = 0; i < n; ++i)
+	  fprintf(f, "%d 1 1 %.6f\n", i + 1, first + i * step);
+     if (fclose(f) != 0) {
+	  perror("Writing table");
+	  exit(1);
+     }
+}
+
+int main (int argc, char *argv[])
+{
+     int n_lon = 640, n_lat = 320, n_lvl = 1, n_t = 8;
+     const char *item = "T", *prefix = 0;
+     char head[GTOOL_FIELDS * GTOOL_FIELD_LEN];
+     unsigned char *data;
+     size_t n;
+     uint32_t seed = 1;
+     FILE *f;
+     int c;
+
+     while ((c = getopt(argc, argv, "x:y:z:t:i:T:h")) != -1) {
+	  switch (c) {
+	  case 'x':
+	       n_lon = atoi(optarg);
+	       break;
+	  case 'y':
+	       n_lat = atoi(optarg);
+	       break;
+	  case 'z':
+	       n_lvl = atoi(optarg);
+	       break;
+	  case 't':
+	       n_t = atoi(optarg);
+	       break;
+	  case 'i':
+	       item = optarg;
+	       break;
+	  case 'T':
+	       prefix = optarg;
+	       break;
+	  case 'h':
+	       usage(0);
+	  default:
+	       usage(1);
+	  }
+     }
+     if (optind != argc - 1 || n_lon < 1 || n_lat < 1 || n_lvl < 1 ||
+	 n_t < 0)
+	  usage(1);
+     n = (size_t)n_lon * n_lat * n_lvl;
+     if (sizeof(float) * n > UINT32_MAX) {
+	  fprintf(stderr, "%zu values do not fit one record\n", n);
+	  exit(1);
+     }
+
+     f = fopen(argv[optind], "wb");
+     data = malloc(sizeof(float) * n);
+     if (f == 0 || data == 0) {
+	  perror("Opening output file");
+	  exit(1);
+     }
+     for (int t = 0; t < n_t; ++t) {
+	  unsigned char *p = data;
+	  make_head(head, t, item, n_lon, n_lat, n_lvl);
+	  write_record(f, head, sizeof(head));
+	  for (int k = 0; k < n_lvl; ++k)
+	       for (int j = 0; j < n_lat; ++j) {
+		    const double lat = pi * ((j + 0.5) / n_lat - 0.5);
+		    for (int i = 0; i < n_lon; ++i) {
+			 const double lon = 2 * pi * i / n_lon;
+			 union { float f; uint32_t u; } v;
+			 /* a temperature-like field with weather moving
+			  * east, and noise from an LCG */
+			 seed = seed * 1664525u + 1013904223u;
+			 v.f = 290 * cos(lat) - 2.5 * k +
+			      10 * sin(3 * lon - 0.1 * t) * cos(2 * lat) +
+			      (seed >> 8) / 16777216.0 * 0.1;
+			 put_be32(p, v.u);
+			 p += 4;
+		    }
+	       }
+	  write_record(f, data, sizeof(float) * n);
+     }
+     if (fclose(f) != 0) {
+	  perror("Writing output file");
+	  exit(1);
+     }
+     free(data);
+
+     if (prefix != 0) {
+	  write_table(prefix, "lon", n_lon, 0, 360.0 / n_lon);
+	  write_table(prefix, "lat", n_lat,
+		      -90 + 90.0 / n_lat, 180.0 / n_lat);
+	  if (n_lvl > 1)
+	       write_table(prefix, "lvl", n_lvl,
+			   1 - 0.5 / n_lvl, -1.0 / n_lvl);
+     }
+     return 0;
+}
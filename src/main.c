@@ -16,62 +16,575 @@
  
  *   Bug reports and feature requests are welcome.  Contact me at
  *   johannes.muelmenstaedt@uni-leipzig.de */
-
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "sprintars2nc.h"
 
 const int idim=640, jdim=320, kdim=57, tdim=1472;
 
-int main (int argc, char *argv[])
+/* settings shared by every conversion of this run */
+static char tfile[1024];
+static int tstep;
+static time_t t0;
+static nc_t out_format;
+static int compress;
+static int progress;
+static int clobber;
+
+/* dimensions, read once and shared by every conversion */
+static int n_lon = 0, n_lat = 0, n_p = 0, n_t_table = 0;
+static float *vals_lon = 0, *vals_lat = 0, *vals_p = 0;
+/* pressure levels to interpolate to (--to-pressure) */
+static float *vals_plev = 0;
+static int n_plev = 0;
+static int *vals_t_table = 0;
+static dim_t dimensions = DIM2;
+
+/* size of the fields in the input files, and the box of them we
+ * convert (--lon-range, --lat-range, --levels); the tables above
+ * hold the coordinates of the box only */
+static int full_lon, full_lat, full_p;
+static box_t box;
+static int boxed = 0;
+
+/* cut table vals of n values down to the contiguous run of values
+ * between range[0] and range[1]; return the index of its first value
+ * in the full table */
+static int select_range (const char *name, float **vals, int *n,
+			 const double *range)
 {
-     /* file names */
-     char in_fname[1024];
-     char out_fname[1024];
-     char lonfile[1024], latfile[1024],
-	  pfile[1024], tfile[1024];
-     char varname[1024], varunits[1024];
-     char strftime_buf[1024];
+     const double lo = range[0] < range[1] ? range[0] : range[1];
+     const double hi = range[0] < range[1] ? range[1] : range[0];
+     int first = -1, last = -1;
 
-     /* direct time dimension specifications */
-     int tstep;
-     time_t t0;
+     for (int i = 0; i < *n; ++i) {
+	  if ((*vals)[i] >= lo && (*vals)[i] <= hi) {
+	       if (first == -1)
+		    first = i;
+	       last = i;
+	  }
+     }
+     if (first == -1) {
+	  fprintf(stderr, "no %s values between %g and %g\n", name, lo, hi);
+	  exit(1);
+     }
+     *n = last - first + 1;
+     memmove(*vals, *vals + first, sizeof(float) * *n);
+     return first;
+}
 
-     /* options with their defaults */
-     nc_t out_format;
-     int compress;
-     int progress;
-     int clobber;
+/* like select_range for the longitudes; if range[0] > range[1], the
+ * range wraps around the end of the table, and the wrapped longitudes
+ * continue past 360 degrees */
+static int select_lon (float **vals, int *n, const double *range)
+{
+     float *wrapped;
+     const int n0 = *n;
+     int first, n_start = 0;
 
-     /* dimensions */
-     int n_lon = 0, n_lat = 0, n_p = 0, n_t = 0;
-     float *vals_lon = 0, *vals_lat = 0, *vals_p = 0;
-     float *vals_t_tmp = 0;
-     int *vals_t = 0;
-     dim_t dimensions = DIM2;
+     if (range[0] <= range[1])
+	  return select_range("lon", vals, n, range);
+     for (first = 0; first < *n && (*vals)[first] < range[0]; ++first)
+	  ;
+     while (n_start < first && (*vals)[n_start] <= range[1])
+	  n_start++;
+     if (first == *n && n_start == 0) {
+	  fprintf(stderr, "no lon values from %g around to %g\n",
+		  range[0], range[1]);
+	  exit(1);
+     }
+     *n = n0 - first + n_start;
+     wrapped = malloc(sizeof(float) * *n);
+     memcpy(wrapped, *vals + first, sizeof(float) * (n0 - first));
+     for (int i = 0; i < n_start; ++i)
+	  wrapped[n0 - first + i] = (*vals)[i] + 360;
+     free(*vals);
+     *vals = wrapped;
+     return first == n0 ? 0 : first;
+}
+
+/* time coordinate of the i-th timestep we convert */
+long time_of_step (size_t i)
+{
+     const size_t t = tstart() + i * tstride();
+
+     if (strlen(tfile) == 0)
+	  return (long)t * tstep + t0;
+     if (t >= (size_t)n_t_table) {
+	  fprintf(stderr, "t file %s has no entry for timestep %zu\n",
+		  tfile, t);
+	  exit(1);
+     }
+     return vals_t_table[t];
+}
+
+/* does time_of_step know timestep i, even if it is not converted? */
+int has_time_of_step (size_t i)
+{
+     return strlen(tfile) == 0 ||
+	  tstart() + i * tstride() < (size_t)n_t_table;
+}
+
+/* narrow the selected timesteps of in to the part this MPI rank
+ * converts; return where the part starts */
+static size_t select_part (gtool_t *in, const char *fname)
+{
+     size_t part_first, part_last, first, last;
+
+     if (in->stream) {
+	  fprintf(stderr, "MPI ranks cannot share the stream %s\n", fname);
+	  exit(1);
+     }
+     mpi_part(count_sprintars(in), &part_first, &part_last);
+     /* an empty part starts past the end of any file */
+     first = part_first < part_last ?
+	  tstart() + part_first * tstride() : (size_t)-1;
+     last = part_first < part_last ?
+	  tstart() + (part_last - 1) * tstride() : (size_t)-1;
+     select_sprintars(in, fname, first, last, tstride(), 0);
+     return part_first;
+}
+
+/* take the name and units of var from the GTOOL header of its input
+ * where the command line leaves them out, and check the grid the
+ * header gives against the tables, before converting anything */
+static void use_head (var_t *var)
+{
+     const gtool_head_t *h = head_sprintars(var->in, 0);
+     const int size[3] = { full_lon, full_lat,
+			   var->kdim == 1 ? 1 : full_p };
+     const char *axis[3] = { "lon", "lat", "lvl" };
+
+     if (h == 0) {
+	  if (strlen(var->name) == 0 || strlen(var->units) == 0) {
+	       fprintf(stderr, "%s has no GTOOL header to take the "
+		       "variable name and units from; give them as "
+		       "infile:varname:units\n", var->fname);
+	       exit(1);
+	  }
+	  return;
+     }
+     if (strlen(var->name) == 0)
+	  strncpy(var->name, h->item, 1023);
+     if (strlen(var->units) == 0)
+	  strncpy(var->units, h->unit, 1023);
+     if (strlen(var->name) == 0 || strlen(var->units) == 0) {
+	  fprintf(stderr, "the header of %s has no ITEM or UNIT; give "
+		  "them as infile:varname:units\n", var->fname);
+	  exit(1);
+     }
+     if (strlen(h->dfmt) > 0 && strcmp(h->dfmt, "UR4") != 0) {
+	  fprintf(stderr, "%s holds %s data; only UR4 (big-endian "
+		  "4-byte floats) can be converted\n", var->fname, h->dfmt);
+	  exit(1);
+     }
+     for (int a = 0; a < 3; ++a) {
+	  if (h->size[a] != 0 && h->size[a] != size[a]) {
+	       fprintf(stderr, "%s is on a %d x %d x %d grid (%s, %s, "
+		       "%s), but the %s file has %d values\n", var->fname,
+		       h->size[0], h->size[1], h->size[2], h->aitm[0],
+		       h->aitm[1], h->aitm[2], axis[a], size[a]);
+	       exit(1);
+	  }
+     }
+}
 
-     /* status flags for input file */
+/* without --t0/--tstep or --tfile, the time coordinate starts at the
+ * DATE of the first timestep of in and steps by the distance to the
+ * second one (or by TDUR, if that is all we know) */
+static void time_from_head (gtool_t *in, const char *fname)
+{
+     const gtool_head_t *h0 = head_sprintars(in, 0);
+     const gtool_head_t *h1 = head_sprintars(in, 1);
+     char buf[64];
+
+     if (h0 == 0 || h0->date == -1) {
+	  fprintf(stderr, "%s has no DATE in its header; give --t0 and "
+		  "--tstep, or --tfile\n", fname);
+	  exit(1);
+     }
+     t0 = h0->date;
+     if (h1 != 0 && h1->date != -1)
+	  tstep = h1->date - h0->date;
+     else
+	  tstep = h0->tdur;
+     if (tstep <= 0 && (h1 != 0 || in->stream)) {
+	  fprintf(stderr, "the headers of %s do not tell the time step; "
+		  "give --t0 and --tstep, or --tfile\n", fname);
+	  exit(1);
+     }
+     if (verbose()) {
+	  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S UTC", gmtime(&t0));
+	  printf("t0: %ld (%s)\ttstep: %d s (from %s)\n", (long)t0, buf,
+		 tstep, fname);
+     }
+}
+
+/* most items a multi-item file may hold */
+#define MAX_ITEMS 256
+
+/* split inputs that hold several items (one record each per timestep,
+ * see gtool.c) into one variable per item, or into the one item the
+ * variable name selects; return the number of variables, and the new
+ * ones in *vars */
+static int demux (int n_vars, var_t **vars)
+{
+     static char items[MAX_ITEMS][GTOOL_FIELD_LEN + 1];
+     var_t *out = 0;
+     int n_out = 0;
+
+     for (int v = 0; v < n_vars; ++v) {
+	  const var_t *var = &(*vars)[v];
+	  struct stat st;
+	  int err, n = 0;
+	  gtool_t *in;
+
+	  /* only files can be looked into ahead of the conversion;
+	   * opening a FIFO, or stdin, twice would lose what was
+	   * written to it in between */
+	  if (strcmp(var->fname, "-") != 0 && stat(var->fname, &st) == 0 &&
+	      S_ISREG(st.st_mode)) {
+	       in = open_sprintars(var->fname, &err);
+	       if (err != 0) {
+		    errno = err;
+		    perror("Opening input file");
+		    exit(1);
+	       }
+	       n = items_sprintars(in, items, MAX_ITEMS);
+	       close_sprintars(in);
+	  }
+	  out = realloc(out, sizeof(var_t) * (n_out + (n > 1 ? n : 1)));
+	  if (n < 2) {
+	       out[n_out++] = *var;
+	       continue;
+	  }
+	  if (verbose()) {
+	       printf("%s holds %d items:", var->fname, n);
+	       for (int i = 0; i < n; ++i)
+		    printf(" %s", items[i]);
+	       printf("\n");
+	  }
+	  /* a variable name picks one item out of the file */
+	  if (strlen(var->name) > 0) {
+	       int i;
+	       for (i = 0; i < n && strcmp(items[i], var->name) != 0; ++i)
+		    ;
+	       if (i == n) {
+		    fprintf(stderr, "%s has no item %s; it holds", var->fname,
+			    var->name);
+		    for (i = 0; i < n; ++i)
+			 fprintf(stderr, " %s", items[i]);
+		    fprintf(stderr, "\n");
+		    exit(1);
+	       }
+	       out[n_out] = *var;
+	       strcpy(out[n_out++].item, var->name);
+	       continue;
+	  }
+	  /* otherwise every item becomes a variable, named by its
+	   * header; the units given, if any, cannot be for all of them */
+	  for (int i = 0; i < n; ++i) {
+	       out[n_out] = *var;
+	       strcpy(out[n_out].item, items[i]);
+	       out[n_out++].units[0] = 0;
+	  }
+     }
+     *vars = out;
+     return n_out;
+}
+
+/* convert the given input files into out_fname */
+static void convert_file (int n_vars, var_t *vars, const char *out_fname)
+{
+     int n_t = 0;
+     int *vals_t = 0, *bnds_t = 0;
+     size_t expected = 0, records = 0;
+     gtool_t *ps = 0;
+     int subset;
+     /* with MPI, where the part this rank converts starts */
+     size_t part_first = 0;
+
+     /* status flag for opening input files */
      int err = 0;
 
      /* diagnostics */
      diag_t *diag = 0;
 
+     n_vars = demux(n_vars, &vars);
+     /* direct chunk writes fill a single dataset; Zarr output
+      * compresses all variables */
+     if (n_vars > 1 && compress_threads() > 0 && out_format != ZARR) {
+	  fprintf(stderr, "--compress-threads works with one variable "
+		  "only, but there are %d\n", n_vars);
+	  exit(1);
+     }
+     /* the parallel readers and the read-ahead need the index, too,
+      * and so does a reader of one item of many */
+     subset = tstart() > 0 || tend() != (size_t)-1 || tstride() > 1 ||
+	  save_index() || threads() > 1 || mpi_size() > 1 ||
+	  read_ahead() > 0;
+     for (int v = 0; v < n_vars; ++v)
+	  subset = subset || strlen(vars[v].item) > 0;
+
+     /* open input files; a file whose first timestep holds a single
+      * level is a 2D field even if a lvl file is given */
+     for (int v = 0; v < n_vars; ++v) {
+	  vars[v].in = open_sprintars(vars[v].fname, &err);
+	  if (err != 0) {
+	       errno = err;
+	       perror("Opening input file");
+	       exit(1);
+	  }
+	  if (strlen(vars[v].item) > 0)
+	       item_sprintars(vars[v].in, vars[v].item);
+	  if (dimensions == DIM2 ||
+	      peek_sprintars(vars[v].in) == (size_t)full_lon * full_lat)
+	       vars[v].kdim = 1;
+	  else
+	       vars[v].kdim = n_p;
+	  vars[v].out_kdim = vars[v].kdim == 1 ? 1 :
+	       plev_file() != 0 ? n_plev : n_p;
+	  use_head(&vars[v]);
+	  for (int w = 0; w < v; ++w) {
+	       if (strcmp(vars[v].name, vars[w].name) == 0) {
+		    fprintf(stderr, "variable %s is given twice\n",
+			    vars[v].name);
+		    exit(1);
+	       }
+	  }
+	  if (verbose())
+	       printf("in: %s (%s [%s])\n",
+		      vars[v].fname, vars[v].name, vars[v].units);
+	  /* read only the box out of every field */
+	  if (boxed) {
+	       box_t b = box;
+	       if (vars[v].kdim == 1) {
+		    b.k0 = 0;
+		    b.nk = 1;
+	       }
+	       box_sprintars(vars[v].in, full_lon, full_lat,
+			     vars[v].kdim == 1 ? 1 : full_p, &b);
+	  }
+	  /* jump over the timesteps we do not want */
+	  if (subset) {
+	       err = select_sprintars(vars[v].in, vars[v].fname,
+				      tstart(), tend(), tstride(),
+				      save_index());
+	       if (err != 0) {
+		    errno = err;
+		    perror("Indexing input file");
+		    exit(1);
+	       }
+	  }
+	  /* inputs that do not line up fail now, not at their end; all
+	   * ranks count the whole selection, which sizes the time
+	   * chunks they must agree on */
+	  if (v == 0) {
+	       records = records_sprintars(vars[v].in);
+	  } else if (records > 0 && records_sprintars(vars[v].in) > 0 &&
+		     records_sprintars(vars[v].in) != records) {
+	       fprintf(stderr, "%s has %zu timesteps to convert, but %s "
+		       "has %zu\n", vars[v].fname,
+		       records_sprintars(vars[v].in), vars[0].fname,
+		       records);
+	       exit(1);
+	  }
+	  if (mpi_size() > 1)
+	       part_first = select_part(vars[v].in, vars[v].fname);
+	  /* packing needs the range of the whole variable up front */
+	  if (pack() != PACK_NONE && vars[v].in->stream) {
+	       fprintf(stderr, "--pack reads %s twice, which a stream "
+		       "cannot do\n", vars[v].fname);
+	       exit(1);
+	  }
+	  if (pack() != PACK_NONE) {
+	       pack_params(vars[v].in, (size_t)n_lon * n_lat * vars[v].kdim,
+			   pack(), &vars[v].scale, &vars[v].offset);
+	       if (verbose())
+		    printf("%s: scale_factor %g, add_offset %g\n",
+			   vars[v].name, vars[v].scale, vars[v].offset);
+	  }
+	  /* from here on, the timesteps are read ahead */
+	  if (read_ahead() > 0 && vars[v].in->stream) {
+	       fprintf(stderr, "--read-ahead needs to know where the "
+		       "timesteps of %s are, which a stream does not "
+		       "tell\n", vars[v].fname);
+	       exit(1);
+	  }
+	  if (read_ahead() > 0) {
+	       err = aio_open(vars[v].in,
+			      (size_t)n_lon * n_lat * vars[v].kdim,
+			      read_ahead(), direct_io(), io_backend());
+	       if (err != 0) {
+		    errno = err;
+		    perror("Reading ahead");
+		    exit(1);
+	       }
+	  }
+     }
+
+     if (verbose())
+	  printf("out: %s\n", out_fname);
+     if (t0 == -1 && strlen(tfile) == 0)
+	  time_from_head(vars[0].in, vars[0].fname);
+
+     /* surface pressure for the interpolation, read by timestep
+      * number alongside the 3D fields */
+     if (plev_file() != 0) {
+	  ps = open_sprintars(ps_file(), &err);
+	  if (err == 0 && ps->stream)
+	       err = ESPIPE;
+	  if (err == 0) {
+	       if (boxed) {
+		    box_t b = box;
+		    b.k0 = 0;
+		    b.nk = 1;
+		    box_sprintars(ps, full_lon, full_lat, 1, &b);
+	       }
+	       err = select_sprintars(ps, ps_file(), tstart(), tend(),
+				      tstride(), save_index());
+	  }
+	  if (err == 0 && mpi_size() > 1)
+	       select_part(ps, ps_file());
+	  if (err != 0) {
+	       errno = err;
+	       perror("Opening surface pressure file");
+	       exit(1);
+	  }
+	  init_vinterp(ps, vals_p, n_p, vals_plev, n_plev,
+		       (size_t)n_lon * n_lat);
+     }
+
+     /* input we are going to read, for the progress line and --stats */
+     for (int v = 0; v < n_vars; ++v)
+	  expected += count_sprintars(vars[v].in) * sizeof(float) *
+	       n_lon * n_lat * vars[v].kdim;
+     init_stats(expected);
+
+     /* define output file; the number of records fixes the time
+      * dimension and helps choose time series chunks, and is unknown
+      * for streams, truncated files and reductions */
+     open_nc(out_fname, out_format, clobber, compress,
+	     plev_file() != 0 ? DIM3P : dimensions,
+	     n_lon, n_lat, plev_file() != 0 ? n_plev : n_p,
+	     reduce() == REDUCE_NONE ? records : 0,
+	     // vals_lon, vals_lat, vals_p,
+	     n_vars, vars);
+     part_nc(part_first);
+
+     /* allocate transfer buffers; the windows go first, as the
+      * batches size themselves from the memory left */
+     if (reduce() != REDUCE_NONE)
+	  init_reduce(n_vars, vars, (size_t)n_lon * n_lat);
+     init_convert(n_vars, vars, n_lon, n_lat);
+     
+     /* read from input file and write to output file until the input
+      * file ends */
+     diag = init_diag(malloc(sizeof(diag_t)));
+     while (1) {
+	  if (progress) {
+	       /* clear statistics */
+	       diag = init_diag(diag);
+	  }
+	  int res = convert_tstep(diag);
+	  if (res == EOF) /* EOF is expected at some point */
+	       break;
+	  else if (res != 0) { /* anything else is an error */
+	       perror("Error during conversion, aborting");
+	       exit(1);
+	  }
+	  /* keep track of time dimension */
+	  n_t++;
+	  if (progress)
+	       display_diag(diag);
+     }
+     if (progress)
+	  printf("\n");
+     /* the ranks together converted all timesteps */
+     if (mpi_size() > 1)
+	  n_t = mpi_sum(n_t);
+
+     /* time coordinate of the timesteps we converted, or of the
+      * windows they were reduced to */
+     if (reduce() != REDUCE_NONE) {
+	  n_t = finish_reduce(&vals_t, &bnds_t);
+     } else {
+	  vals_t = (int *)malloc(sizeof(int) * n_t);
+	  for (int i = 0; i < n_t; ++i)
+	       vals_t[i] = time_of_step(i);
+     }
+
+     /* close input and output files */
+     for (int v = 0; v < n_vars; ++v)
+	  close_sprintars(vars[v].in);
+     if (ps != 0)
+	  close_sprintars(ps);
+     if (plev_file() != 0)
+	  close_nc(DIM3P, n_lon, n_lat, n_plev, n_t,
+		   vals_lon, vals_lat, vals_plev, vals_t, bnds_t);
+     else
+	  close_nc(dimensions,
+		   n_lon, n_lat, n_p, n_t,
+		   vals_lon, vals_lat, vals_p, vals_t, bnds_t);
+     free(vals_t);
+     free(bnds_t);
+     free(vars);
+     if (verbose())
+	  pool_report();
+     if (stats_file() != 0)
+	  write_stats(stats_file(), out_fname);
+}
+
+int main (int argc, char *argv[])
+{
+     /* file names */
+     var_t *vars = 0;
+     int n_vars = 0;
+     char out_fname[1024];
+     char lonfile[1024], latfile[1024],
+	  pfile[1024];
+     char strftime_buf[1024];
+
+     float *vals_t_tmp = 0;
+
+     /* under mpirun, the ranks share each conversion */
+     init_mpi(&argc, &argv);
+
      /* process options */
-     opts(argc, argv, in_fname, out_fname,
+     opts(argc, argv, &vars, &n_vars, out_fname,
 	  lonfile, latfile, pfile, tfile,
 	  &t0, &tstep,
-	  varname, varunits,
 	  &dimensions,
 	  &out_format, &compress, &progress, &clobber);
+     init_pool(max_memory());
+     if (mpi_size() > 1) {
+	  const char *bad = manifest() != 0 ? "--manifest" :
+	       reduce() != REDUCE_NONE ? "--reduce" :
+	       transpose() ? "--transpose" :
+	       compress_threads() > 0 ? "--compress-threads" :
+	       out_format == ZARR ? "-f zarr" : 0;
+	  if (bad != 0) {
+	       fprintf(stderr, "%s does not work across MPI ranks\n", bad);
+	       exit(1);
+	  }
+	  /* parallel NetCDF writes NetCDF-4 only; one progress line */
+	  out_format = NC4;
+	  progress = progress && mpi_rank() == 0;
+     }
 
      if (verbose()) {
-	  printf("\nin: %s\nout: %s\nformat: %s\ncompress: %d\n"
+	  printf("\n");
+	  if (manifest() != 0)
+	       printf("manifest: %s\n", manifest());
+	  printf("format: %s\ncompress: %d\n"
 		 "clobber: %s\n",
-		 in_fname, out_fname,
+		 out_format == ZARR ? "Zarr" :
 		 (out_format == NC4 || compress > 0) ? "NetCDF4" : "NetCDF2",
 		 compress, 
 		 clobber ? "yes" : "no");
@@ -79,14 +592,15 @@ int main (int argc, char *argv[])
 	  printf("lon: %s\nlat: %s\nlev: %s\nt: %s\t",
 		 lonfile, latfile,
 		 strlen(pfile) > 0 ? pfile : "2D field",
-		 strlen(tfile) > 0 ? tfile : "");
+		 strlen(tfile) > 0 ? tfile :
+		 t0 == -1 ? "from the GTOOL headers" : "");
 	  if (t0 != -1 && tstep != -1) {
 	       strftime(strftime_buf, 1024, "%Y-%m-%d %H:%M:%S UTC",
 			gmtime(&t0));
 	       printf("t0: %ld (%s)\ttstep: %d s", t0, strftime_buf,
 		      tstep);
-	       printf("\n");
 	  }
+	  printf("\n");
      }
 
      /* read dimension files */
@@ -104,67 +618,70 @@ int main (int argc, char *argv[])
 	       printf("reading lvl file %s\n", pfile);
 	  read_table(pfile, &vals_p, &n_p);
      }
+     if (plev_file() != 0) {
+	  if (verbose()) 
+	       printf("reading pressure levels %s\n", plev_file());
+	  read_table(plev_file(), &vals_plev, &n_plev);
+     }
      if (strlen(tfile) != 0) {
 	  if (verbose()) 
 	       printf("reading t file %s\n", tfile);
-	  read_table(pfile, &vals_t_tmp, &n_t);
-	  vals_t = (int *)malloc(sizeof(int) * n_t);
-	  for (int i = 0; i < n_t; vals_t[i] = vals_t_tmp[i++]);
+	  read_table(tfile, &vals_t_tmp, &n_t_table);
+	  vals_t_table = (int *)malloc(sizeof(int) * n_t_table);
+	  for (int i = 0; i < n_t_table; ++i)
+	       vals_t_table[i] = vals_t_tmp[i];
 	  free(vals_t_tmp);
      } else {
 	  /* nothing: generate them on the fly while converting */
      }
-     
-     /* open input file */
-     open_sprintars(in_fname, &err);
-     if (err != 0) {
-	  perror("Opening input file");
-     }
-
-     /* define output file */
-     open_nc(out_fname, out_format, clobber, compress,
-	     dimensions,
-	     n_lon, n_lat, n_p, 
-	     // vals_lon, vals_lat, vals_p,
-	     varname, varunits);
 
-     /* allocate transfer buffer */
-     init_convert(n_lon, n_lat, dimensions == DIM2 ? 1 : n_p);
-     
-     /* read from input file and write to output file until the input
-      * file ends */
-     diag = init_diag(malloc(sizeof(diag_t)));
-     while (1) {
-	  if (progress) {
-	       /* clear statistics */
-	       diag = init_diag(diag);
-	  }
-	  int res = convert_tstep(diag);
-	  if (res == EOF) /* EOF is expected at some point */
-	       break;
-	  else if (res != 0) { /* anything else is an error */
-	       perror("Error during conversion, aborting");
+     /* cut the tables down to the box to convert */
+     full_lon = n_lon;
+     full_lat = n_lat;
+     full_p = n_p;
+     box.ni = n_lon;
+     box.nj = n_lat;
+     box.nk = n_p;
+     if (lon_range() != 0) {
+	  box.i0 = select_lon(&vals_lon, &n_lon, lon_range());
+	  box.ni = n_lon;
+	  boxed = 1;
+     }
+     if (lat_range() != 0) {
+	  box.j0 = select_range("lat", &vals_lat, &n_lat, lat_range());
+	  box.nj = n_lat;
+	  boxed = 1;
+     }
+     if (levels() != 0) {
+	  if (n_p == 0) {
+	       fprintf(stderr, "--levels needs a lvl file\n");
 	       exit(1);
 	  }
-	  if (strlen(tfile) == 0) {
-	       /* keep track of time dimension */
-	       n_t++;
-	  }
-	  if (progress)
-	       display_diag(diag);
+	  box.k0 = select_range("lvl", &vals_p, &n_p, levels());
+	  box.nk = n_p;
+	  boxed = 1;
      }
-     if (progress)
-	  printf("\n");
+     if (boxed && verbose())
+	  printf("box: lon %d+%d, lat %d+%d, lvl %d+%d\n",
+		 box.i0, box.ni, box.j0, box.nj, box.k0, box.nk);
 
-     if (strlen(tfile) == 0) {
-	  vals_t = (int *)malloc(sizeof(int) * n_t);
-	  for (int i = 0; i < n_t; vals_t[i] = i++ * tstep + t0);
+     /* every conversion appends its statistics to the file */
+     if (stats_file() != 0 && mpi_rank() == 0) {
+	  FILE *f = fopen(stats_file(), "w");
+	  if (f == 0) {
+	       perror("Opening statistics file");
+	       exit(1);
+	  }
+	  fclose(f);
      }
+     mpi_barrier();
 
-     /* close output file (system takes care of closing input file) */
-     close_nc(dimensions,
-	      n_lon, n_lat, n_p, n_t,
-	      vals_lon, vals_lat, vals_p, vals_t);
+     /* either run the jobs of the manifest, which all use the tables
+      * read above, or the one conversion given on the command line */
+     if (manifest() != 0)
+	  return run_manifest(manifest(), convert_file) == 0 ? 0 : 1;
+     convert_file(n_vars, vars, out_fname);
+     finish_mpi();
      
      return 0;
 }
@@ -0,0 +1,137 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* MPI support (build with make MPI=1, run under mpirun).  With more
+ * than one rank, the ranks split the selected timesteps of each
+ * conversion into contiguous parts, convert their part with the usual
+ * pipeline and write it collectively into one NetCDF-4 file opened
+ * with nc_create_par (nc.c).  Built without MPI, or run as a single
+ * rank, everything here reduces to the serial case. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sprintars2nc.h"
+
+#ifdef HAVE_MPI
+#include <mpi.h>
+
+static int rank = 0, size = 1;
+
+void init_mpi (int *argc, char ***argv)
+{
+     if (MPI_Init(argc, argv) != MPI_SUCCESS) {
+	  fprintf(stderr, "Initializing MPI failed\n");
+	  exit(1);
+     }
+     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+     MPI_Comm_size(MPI_COMM_WORLD, &size);
+}
+
+void finish_mpi ()
+{
+     MPI_Finalize();
+}
+
+int mpi_rank ()
+{
+     return rank;
+}
+
+int mpi_size ()
+{
+     return size;
+}
+
+void mpi_barrier ()
+{
+     MPI_Barrier(MPI_COMM_WORLD);
+}
+
+/* the sum and the maximum of x over all ranks */
+long mpi_sum (long x)
+{
+     long sum;
+     MPI_Allreduce(&x, &sum, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+     return sum;
+}
+
+long mpi_max (long x)
+{
+     long max;
+     MPI_Allreduce(&x, &max, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+     return max;
+}
+
+/* widen [*lo, *hi] to the range over all ranks */
+void mpi_range (double *lo, double *hi)
+{
+     double in[2] = { *lo, -*hi }, out[2];
+     MPI_Allreduce(in, out, 2, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+     *lo = out[0];
+     *hi = -out[1];
+}
+
+#else
+
+void init_mpi (int *argc, char ***argv)
+{
+}
+
+void finish_mpi ()
+{
+}
+
+int mpi_rank ()
+{
+     return 0;
+}
+
+int mpi_size ()
+{
+     return 1;
+}
+
+void mpi_barrier ()
+{
+}
+
+long mpi_sum (long x)
+{
+     return x;
+}
+
+long mpi_max (long x)
+{
+     return x;
+}
+
+void mpi_range (double *lo, double *hi)
+{
+}
+
+#endif
+
+/* the part [*first, *last) of n timesteps that this rank converts */
+void mpi_part (size_t n, size_t *first, size_t *last)
+{
+     *first = n * mpi_rank() / mpi_size();
+     *last = n * (mpi_rank() + 1) / mpi_size();
+}
@@ -28,27 +28,202 @@
 
 #include "sprintars2nc.h"
 
+#ifdef HAVE_MPI
+#include <mpi.h>
+#include <netcdf_par.h>
+#endif
+
 static int ncid = -1;
-static int lon_dimid, lat_dimid, lvl_dimid, rec_dimid;
-static int lat_varid, lon_varid, lvl_varid, rec_varid, out_varid;
-static int ndims;
-static int dimids[4];
+static int lon_dimid, lat_dimid, lvl_dimid, rec_dimid, bnds_dimid;
+static int lat_varid, lon_varid, lvl_varid, rec_varid, bnds_varid;
 static size_t start[4];
-static size_t count[4];
+
+/* output variables, one per input file; 2D fields have no level
+ * dimension */
+typedef struct {
+     int varid;
+     int ndims;
+     size_t count[4];
+     float scale, offset;	/* --pack */
+     void *packed;		/* packed batch */
+     size_t packed_len;
+     int writes;		/* write_nc calls, for collective writes */
+} out_var_t;
+static out_var_t *out_vars = 0;
+static int n_out_vars;
+
+/* chunk shape of the last output variable defined, and whether its
+ * chunks are compressed and written by direct.c (--compress-threads);
+ * direct.c fills a single dataset, so that is only allowed for one
+ * variable, counted after multi-item inputs are split (main.c) */
+static size_t var_chunks[4];
+static int direct = 0;
+static int zarr = 0;		/* -f zarr: everything goes to zarr.c */
+static char nc_fname[1024];
+
+/* timesteps the input holds, if known exactly (0 otherwise), for
+ * all MPI ranks together, so that they choose the same chunks; the
+ * time dimension is then defined with this fixed length, unless
+ * --unlimited, so that classic files store each variable in one
+ * piece and NetCDF4 needs no unlimited dimension */
+static size_t expected_t;
+static int fixed_t = 0;
+
+/* first record this process writes; with MPI, each rank writes its
+ * own part of the time axis */
+static int first_record = 0;
 
 static int retval;
 
 #define ERR(e) {printf("Error: %s\n", nc_strerror(e)); exit(2);}
 #define nc_check(expr) { if (retval = expr) ERR(retval) }
 
+/* size of one chunk the heuristic aims for, and memory it may assume
+ * for the chunk cache */
+#define CHUNK_TARGET (1 << 20)
+#define CHUNK_CACHE_MEMORY (256 << 20)
+
+static size_t min_size(size_t a, size_t b)
+{
+     return a < b ? a : b;
+}
+
+/* pick a chunk shape (time, lvl, lat, lon) for the given access
+ * pattern:
+ *   map:     one horizontal slice per chunk;
+ *   profile: all levels of a horizontal tile;
+ *   series:  as many timesteps as the chunk cache can hold a full
+ *            row of chunks for, or with --transpose all of them, over
+ *            a horizontal tile sized so that chunks stay near
+ *            CHUNK_TARGET */
+static void choose_chunks(access_t access, int n_lon, int n_lat, int n_p,
+			  size_t chunks[4])
+{
+     const size_t field = sizeof(float) * n_lon * n_lat * n_p;
+     size_t points = 0, side;
+
+     switch (access) {
+     case ACCESS_MAP:
+	  chunks[0] = 1;
+	  chunks[1] = 1;
+	  chunks[2] = n_lat;
+	  chunks[3] = n_lon;
+	  return;
+     case ACCESS_PROFILE:
+	  chunks[0] = 1;
+	  chunks[1] = n_p;
+	  points = CHUNK_TARGET / (sizeof(float) * n_p);
+	  break;
+     case ACCESS_SERIES:
+	  chunks[0] = min_size(256, CHUNK_CACHE_MEMORY / field);
+	  /* all of the time axis for the transpose, else no more */
+	  if (expected_t > 0 && (transpose() || chunks[0] > expected_t))
+	       chunks[0] = expected_t;
+	  if (chunks[0] < 1)
+	       chunks[0] = 1;
+	  chunks[1] = 1;
+	  points = CHUNK_TARGET / (sizeof(float) * chunks[0]);
+	  break;
+     }
+     /* square horizontal tile of about the given number of points */
+     for (side = 1; (side + 1) * (side + 1) <= points; ++side)
+	  ;
+     chunks[2] = min_size(side, n_lat);
+     chunks[3] = min_size(points / chunks[2], n_lon);
+}
+
+static size_t next_prime(size_t n)
+{
+     for (;; ++n) {
+	  size_t d;
+	  for (d = 2; d * d <= n && n % d != 0; ++d)
+	       ;
+	  if (d * d > n)
+	       return n;
+     }
+}
+
+/* chunk shape (time, lvl, lat, lon) of an output variable with kdim
+ * levels (1 for 2D fields), from --chunks or the access pattern; also
+ * used for Zarr output (zarr.c) */
+void chunk_shape(int kdim, int n_lon, int n_lat, int n_p, size_t chunks_[4])
+{
+     const size_t *shape = chunks();
+
+     if (kdim == 1)
+	  n_p = 1;
+     if (shape != 0) {
+	  memcpy(chunks_, shape, sizeof(size_t) * 4);
+	  if (expected_t > 0)
+	       chunks_[0] = min_size(chunks_[0], expected_t);
+	  chunks_[1] = min_size(chunks_[1], n_p);
+	  chunks_[2] = min_size(chunks_[2], n_lat);
+	  chunks_[3] = min_size(chunks_[3], n_lon);
+     } else {
+	  choose_chunks(access_pattern(), n_lon, n_lat, n_p, chunks_);
+     }
+}
+
+/* chunk an output variable (NetCDF4 only) and size its cache so
+ * that one row of chunks along the time axis fits; the transpose
+ * writes one chunk at a time */
+static void define_chunking(const out_var_t *var,
+			    int n_lon, int n_lat, int n_p)
+{
+     size_t chunks_[4], nchunks, cache;
+
+     chunk_shape(var->ndims == 3 ? 1 : n_p, n_lon, n_lat, n_p, chunks_);
+     if (var->ndims == 3)
+	  n_p = 1;
+     nchunks = (n_p + chunks_[1] - 1) / chunks_[1] *
+	  ((n_lat + chunks_[2] - 1) / chunks_[2]) *
+	  ((n_lon + chunks_[3] - 1) / chunks_[3]);
+     cache = chunk_cache();
+     if (cache == 0)
+	  cache = (transpose() ? 1 : nchunks) * chunks_[0] * chunks_[1] *
+	       chunks_[2] * chunks_[3] * sizeof(float);
+     if (transpose()) {
+	  const size_t shape_[3] = { n_p, n_lat, n_lon };
+	  transpose_var(var - out_vars, shape_, chunks_ + 1);
+     }
+     if (verbose())
+	  printf("chunks: %zu x %zu x %zu x %zu, cache %zu bytes\n",
+		 chunks_[0], chunks_[1], chunks_[2], chunks_[3], cache);
+     if (var->ndims == 3) {
+	  /* no level dimension */
+	  chunks_[1] = chunks_[2];
+	  chunks_[2] = chunks_[3];
+     }
+     memcpy(var_chunks, chunks_, sizeof(chunks_));
+     nc_check(nc_def_var_chunking(ncid, var->varid, NC_CHUNKED, chunks_));
+     nc_check(nc_set_var_chunk_cache(ncid, var->varid, cache,
+				     next_prime(100 * nchunks), 0.75));
+}
+
 void open_nc(const char *out_fname, nc_t format, int clobber,
 	     int compress,
 	     dim_t dim,
-	     int n_lon, int n_lat, int n_p, 
+	     int n_lon, int n_lat, int n_p, int n_t,
 	     // float *vals_lon, float *vals_lat, float *vals_p,
-	     const char *varname, const char *varunits)
+	     int n_vars, const var_t *vars)
 {
-     /* create file */
+     expected_t = n_t;
+     if (format == ZARR) {
+	  zarr_open(out_fname, clobber, compress, dim, n_lon, n_lat, n_p,
+		    n_vars, vars);
+	  zarr = 1;
+	  return;
+     }
+
+     /* create file; all MPI ranks share one NetCDF-4 file */
+#ifdef HAVE_MPI
+     if (mpi_size() > 1)
+	  nc_check(nc_create_par(out_fname,
+				 (clobber ? NC_CLOBBER : NC_NOCLOBBER) |
+				 NC_NETCDF4, MPI_COMM_WORLD, MPI_INFO_NULL,
+				 &ncid))
+     else
+#endif
      nc_check(nc_create(out_fname,
 			(clobber ? NC_CLOBBER : NC_NOCLOBBER) |
 			((format == NC4 || compress > 0) ? NC_NETCDF4 : 0),
@@ -64,7 +239,9 @@ void open_nc(const char *out_fname, nc_t format, int clobber,
      }
      nc_check(nc_def_dim(ncid, "lat", n_lat, &lat_dimid)); 
      nc_check(nc_def_dim(ncid, "lon", n_lon, &lon_dimid)); 
-     nc_check(nc_def_dim(ncid, "time", NC_UNLIMITED, &rec_dimid));
+     fixed_t = n_t > 0 && !unlimited() && mpi_size() == 1;
+     nc_check(nc_def_dim(ncid, "time", fixed_t ? (size_t)n_t : NC_UNLIMITED,
+			 &rec_dimid));
 
      /* Define the coordinate variables. */
      nc_check(nc_def_var(ncid, "lat", NC_FLOAT, 1, &lat_dimid, 
@@ -95,63 +272,280 @@ void open_nc(const char *out_fname, nc_t format, int clobber,
      nc_check(nc_put_att_text(ncid, rec_varid, "units", 
 			      strlen("seconds since 1970-01-01 00:00:00 UTC"),
 			      "seconds since 1970-01-01 00:00:00 UTC"));
+     /* the window each reduced record stands for (CF cell bounds) */
+     if (reduce() != REDUCE_NONE) {
+	  int dimids[2];
+	  nc_check(nc_def_dim(ncid, "bnds", 2, &bnds_dimid));
+	  dimids[0] = rec_dimid;
+	  dimids[1] = bnds_dimid;
+	  nc_check(nc_def_var(ncid, "time_bnds", NC_INT, 2, dimids,
+			      &bnds_varid));
+	  nc_check(nc_put_att_text(ncid, rec_varid, "bounds",
+				   strlen("time_bnds"), "time_bnds"));
+     }
 
-     /* define output variable */
-     if (dim == DIM2) {
-	  const int dimids_[3] = {
-	       rec_dimid, lat_dimid, lon_dimid
-	  };
-	  const size_t count_[3] = {
-	       1, n_lat, n_lon
-	  };
-	  const size_t start_[3] = {
-	       0, 0, 0
-	  };
- 	  ndims = 3;
-	  memcpy(dimids, dimids_, sizeof(dimids_));
-	  memcpy(count, count_, sizeof(count_));
-	  memcpy(start, start_, sizeof(start_));
-     } else {
-	  const int dimids_[4] = {
-	       rec_dimid, lvl_dimid, lat_dimid, lon_dimid
-	  };
-	  const size_t count_[4] = {
-	       1, n_p, n_lat, n_lon
-	  };
-	  const size_t start_[4] = {
-	       0, 0, 0, 0
-	  };
- 	  ndims = 4;
-	  memcpy(dimids, dimids_, sizeof(dimids_));
-	  memcpy(count, count_, sizeof(count_));
-	  memcpy(start, start_, sizeof(start_));
-     }
-     nc_check(nc_def_var(ncid, varname, NC_FLOAT, ndims, 
-			 dimids, &out_varid));
-     if (compress > 0) {
-	  nc_check(nc_def_var_deflate(ncid, out_varid, 1, 1, compress));
-     }
-
-     /* Assign units attributes to the netCDF variables. */
-     nc_check(nc_put_att_text(ncid, out_varid, "units", 
-			      strlen(varunits), varunits));
+     /* define output variables */
+     out_vars = calloc(n_vars, sizeof(out_var_t));
+     n_out_vars = n_vars;
+     for (int v = 0; v < n_vars; ++v) {
+	  out_var_t *var = &out_vars[v];
+	  const nc_type type = pack() == PACK_SHORT ? NC_SHORT :
+	       pack() == PACK_BYTE ? NC_BYTE : NC_FLOAT;
+	  if (vars[v].kdim == 1) {
+	       const int dimids[3] = {
+		    rec_dimid, lat_dimid, lon_dimid
+	       };
+	       const size_t count_[3] = {
+		    1, n_lat, n_lon
+	       };
+	       var->ndims = 3;
+	       memcpy(var->count, count_, sizeof(count_));
+	       nc_check(nc_def_var(ncid, vars[v].name, type, var->ndims,
+				   dimids, &var->varid));
+	  } else {
+	       const int dimids[4] = {
+		    rec_dimid, lvl_dimid, lat_dimid, lon_dimid
+	       };
+	       const size_t count_[4] = {
+		    1, n_p, n_lat, n_lon
+	       };
+	       var->ndims = 4;
+	       memcpy(var->count, count_, sizeof(count_));
+	       nc_check(nc_def_var(ncid, vars[v].name, type, var->ndims,
+				   dimids, &var->varid));
+	  }
+	  if (format == NC4 || compress > 0) {
+	       define_chunking(var, n_lon, n_lat, n_p);
+	  }
+	  if (compress > 0) {
+	       nc_check(nc_def_var_deflate(ncid, var->varid, shuffle(), 1,
+					   compress));
+	  }
+
+	  /* Assign units attributes to the netCDF variables. */
+	  nc_check(nc_put_att_text(ncid, var->varid, "units", 
+				   strlen(vars[v].units), vars[v].units));
+
+	  /* how to unpack, or how much precision is left */
+	  if (pack() != PACK_NONE) {
+	       var->scale = vars[v].scale;
+	       var->offset = vars[v].offset;
+	       nc_check(nc_put_att_float(ncid, var->varid, "scale_factor",
+					 NC_FLOAT, 1, &var->scale));
+	       nc_check(nc_put_att_float(ncid, var->varid, "add_offset",
+					 NC_FLOAT, 1, &var->offset));
+	       if (pack() == PACK_SHORT) {
+		    const short fill = -32768;
+		    nc_check(nc_put_att_short(ncid, var->varid, "_FillValue",
+					      NC_SHORT, 1, &fill));
+	       } else {
+		    const signed char fill = -128;
+		    nc_check(nc_put_att_schar(ncid, var->varid, "_FillValue",
+					      NC_BYTE, 1, &fill));
+	       }
+	  }
+	  if (reduce() != REDUCE_NONE) {
+	       const char *method = reduce() == REDUCE_MEAN ? "time: mean" :
+		    reduce() == REDUCE_SUM ? "time: sum" :
+		    reduce() == REDUCE_MIN ? "time: minimum" : "time: maximum";
+	       nc_check(nc_put_att_text(ncid, var->varid, "cell_methods",
+					strlen(method), method));
+	  }
+	  if (keep_bits() > 0) {
+	       const int bits = keep_bits();
+	       nc_check(nc_put_att_int(ncid, var->varid,
+				       "_QuantizeBitRoundNumberOfSignificantBits",
+				       NC_INT, 1, &bits));
+	  }
+     }
+     memset(start, 0, sizeof(start));
 
      /* End define mode. */
      nc_check(nc_enddef(ncid));
+
+     /* every rank takes part in every write, so that the record
+      * dimension can grow */
+     if (mpi_size() > 1) {
+	  const int coords[4] = { lat_varid, lon_varid, rec_varid,
+				  dim != DIM2 ? lvl_varid : lat_varid };
+	  for (int c = 0; c < 4; ++c)
+	       nc_check(nc_var_par_access(ncid, coords[c], NC_COLLECTIVE));
+	  for (int v = 0; v < n_vars; ++v)
+	       nc_check(nc_var_par_access(ncid, out_vars[v].varid,
+					  NC_COLLECTIVE));
+     }
+
+     /* hand the data variable over to the parallel compressor, which
+      * talks to the file through HDF5 until close_nc */
+     if (compress > 0 && compress_threads() > 0) {
+	  strncpy(nc_fname, out_fname, 1024);
+	  nc_check(nc_close(ncid));
+	  direct_open(nc_fname, vars[0].name, out_vars[0].ndims,
+		      out_vars[0].count, var_chunks,
+		      shuffle(), compress, compress_threads());
+	  direct = 1;
+     }
+}
+
+/* bytes of a packed value */
+static size_t packed_size()
+{
+     return pack() == PACK_SHORT ? sizeof(short) : sizeof(signed char);
+}
+
+/* with --pack, set aside the buffers that writes of up to nsteps
+ * timesteps are packed into, so that they count against --max-memory */
+void batch_nc(int nsteps)
+{
+     if (pack() == PACK_NONE || zarr)
+	  return;
+     for (int v = 0; v < n_out_vars; ++v) {
+	  out_var_t *var = &out_vars[v];
+	  size_t n = nsteps;
+	  for (int d = 1; d < var->ndims; ++d)
+	       n *= var->count[d];
+	  var->packed = pool_alloc(n * packed_size(), "the packed batches");
+	  var->packed_len = n;
+     }
+}
+
+/* pack the timesteps in buf and write them to var at start/count */
+static void write_packed(out_var_t *var, const float *buf)
+{
+     size_t n = 1;
+
+     for (int d = 0; d < var->ndims; ++d)
+	  n *= var->count[d];
+     /* the tiles of --transpose can be larger than a batch */
+     if (n > var->packed_len) {
+	  pool_free(var->packed);
+	  var->packed = pool_alloc(n * packed_size(), "the packed tiles");
+	  var->packed_len = n;
+     }
+     pack_field(var->packed, buf, n, pack(), var->scale, var->offset);
+     if (pack() == PACK_SHORT) {
+	  nc_check(nc_put_vara_short(ncid, var->varid, start, var->count,
+				     var->packed));
+     } else {
+	  nc_check(nc_put_vara_schar(ncid, var->varid, start, var->count,
+				     var->packed));
+     }
+}
+
+/* write the (time, lvl, lat, lon) box start/count of variable var
+ * from buf; this is how the transpose hands back its tiles */
+static void put_tile(int var, const size_t *start_, const size_t *count_,
+		     float *buf)
+{
+     const double t0 = stats_clock();
+     out_var_t *v = &out_vars[var];
+     size_t n = 1;
+
+     for (int d = 0, e = 0; d < 4; ++d) {
+	  /* 2D variables have no level dimension */
+	  if (d == 1 && v->ndims == 3)
+	       continue;
+	  start[e] = start_[d];
+	  v->count[e++] = count_[d];
+	  n *= count_[d];
+     }
+     if (pack() != PACK_NONE)
+	  write_packed(v, buf);
+     else
+	  nc_check(nc_put_vara_float(ncid, v->varid, start, v->count, buf));
+     stats_add(STAGE_WRITE, t0, sizeof(float) * n);
+}
+
+/* this process writes the records from first on (MPI) */
+void part_nc(int first)
+{
+     first_record = first;
+}
+
+/* close_nc for an MPI rank: match the collective writes of the ranks
+ * that had more batches to write, and let rank 0 write the
+ * coordinates */
+static void close_part(dim_t dimension,
+		       int n_lon, int n_lat, int n_p, int n_t,
+		       float *vals_lon, float *vals_lat, float *vals_p,
+		       int *vals_t)
+{
+     const int root = mpi_rank() == 0;
+     size_t zero = 0, n;
+
+     float dummy = 0;
+     long writes = 0;
+
+     /* every batch writes all variables, in order */
+     for (int v = 0; v < n_out_vars; ++v)
+	  if (out_vars[v].writes > writes)
+	       writes = out_vars[v].writes;
+     writes = mpi_max(writes);
+     for (long w = 0; w < writes; ++w)
+	  for (int v = 0; v < n_out_vars; ++v) {
+	       out_var_t *var = &out_vars[v];
+	       if (var->writes > w)
+		    continue;
+	       var->count[0] = 0;
+	       nc_check(nc_put_vara_float(ncid, var->varid, start,
+					  var->count, &dummy));
+	  }
+     n = root ? n_lat : 0;
+     nc_check(nc_put_vara_float(ncid, lat_varid, &zero, &n, vals_lat));
+     n = root ? n_lon : 0;
+     nc_check(nc_put_vara_float(ncid, lon_varid, &zero, &n, vals_lon));
+     if (dimension != DIM2) {
+	  n = root ? n_p : 0;
+	  nc_check(nc_put_vara_float(ncid, lvl_varid, &zero, &n, vals_p));
+     }
+     n = root ? n_t : 0;
+     nc_check(nc_put_vara_int(ncid, rec_varid, &zero, &n, vals_t));
+     nc_check(nc_close(ncid));
+     for (int v = 0; v < n_out_vars; ++v)
+	  pool_free(out_vars[v].packed);
+     free(out_vars);
+     out_vars = 0;
+     first_record = 0;
 }
 
 void close_nc(dim_t dimension, 
 	      int n_lon, int n_lat, int n_p, int n_t,
 	      float *vals_lon, float *vals_lat, float *vals_p,
-	      int *vals_t)
+	      int *vals_t, int *bnds_t)
 {
+     if (zarr) {
+	  zarr_close(n_lon, n_lat, n_p, n_t, vals_lon, vals_lat, vals_p,
+		     vals_t, bnds_t);
+	  zarr = 0;
+	  return;
+     }
      assert(ncid != -1);
+     /* the time coordinate below fills the whole dimension */
+     if (fixed_t && (size_t)n_t != expected_t) {
+	  fprintf(stderr, "Error: %d timesteps converted, but the time "
+		  "dimension was defined for %zu\n", n_t, expected_t);
+	  exit(2);
+     }
+     if (transpose())
+	  transpose_close(put_tile);
+     if (direct) {
+	  direct_close();
+	  nc_check(nc_open(nc_fname, NC_WRITE, &ncid));
+	  direct = 0;
+     }
+     if (mpi_size() > 1) {
+	  close_part(dimension, n_lon, n_lat, n_p, n_t,
+		     vals_lon, vals_lat, vals_p, vals_t);
+	  return;
+     }
      nc_check(nc_put_var_float(ncid, lat_varid, vals_lat));
      nc_check(nc_put_var_float(ncid, lon_varid, vals_lon));
      if (dimension != DIM2) {
 	  nc_check(nc_put_var_float(ncid, lvl_varid, vals_p));
      }
      nc_check(nc_put_var_int(ncid, rec_varid, vals_t));
+     if (bnds_t != 0)
+	  nc_check(nc_put_var_int(ncid, bnds_varid, bnds_t));
      /* } else { */
      /* 	  /\* /\\* do a quick conversion... *\\/ *\/ */
      /* 	  /\* int *tmp = (int *)malloc(sizeof(int) * n_t); *\/ */
@@ -159,14 +553,39 @@ void close_nc(dim_t dimension,
      /* } */
      
      nc_check(nc_close(ncid));
+     for (int v = 0; v < n_out_vars; ++v)
+	  pool_free(out_vars[v].packed);
+     free(out_vars);
+     out_vars = 0;
 }
 
-void write_nc(float *buf, int step)
+/* write nsteps consecutive timesteps of variable var, starting at
+ * step, in one go */
+void write_nc(int var, float *buf, int step, int nsteps)
 {
+     const double t0 = stats_clock();
+     size_t n = 1;
+
+     if (zarr) {
+	  zarr_write(var, buf, step, nsteps);
+	  stats_add(STAGE_WRITE, t0, zarr_bytes(var) * nsteps);
+	  return;
+     }
      assert(ncid != -1);
      assert(buf != 0);
-     start[0] = step;
-     nc_check(nc_put_vara_float(ncid, out_varid, start, count, 
-				buf));
-     
+     start[0] = first_record + step;
+     out_vars[var].count[0] = nsteps;
+     out_vars[var].writes++;
+     for (int d = 0; d < out_vars[var].ndims; ++d)
+	  n *= out_vars[var].count[d];
+     if (transpose())
+	  transpose_write(var, buf, step, nsteps);
+     else if (direct)
+	  direct_write(buf, step, nsteps);
+     else if (pack() != PACK_NONE)
+	  write_packed(&out_vars[var], buf);
+     else
+	  nc_check(nc_put_vara_float(ncid, out_vars[var].varid, start,
+				     out_vars[var].count, buf));
+     stats_add(STAGE_WRITE, t0, sizeof(float) * n);
 }
@@ -29,12 +29,225 @@
 #include "sprintars2nc.h"
 
 static int verbose_ = 0;
+static int threads_ = 1;
+static int write_batch_ = 1;
+static size_t chunks_[4] = { 0, 0, 0, 0 };
+static size_t chunk_cache_ = 0;
+static access_t access_ = ACCESS_MAP;
+static int transpose_ = 0;
+static size_t transpose_memory_ = 0;
+static size_t max_memory_ = 0;
+static int read_ahead_ = -1;
+static io_t io_ = IO_URING;
+static int direct_io_ = 0;
+/* read-ahead for --io or --direct-io without --read-ahead */
+#define DEFAULT_READ_AHEAD 8
+static int shuffle_ = 1;
+static int compress_threads_ = 0;
+static int zarr_ = 0;
+static size_t tstart_ = 0, tend_ = (size_t)-1, tstride_ = 1;
+static int save_index_ = 0;
+static int unlimited_ = 0;
+static double lon_range_[2], lat_range_[2], levels_[2];
+static int have_lon_range = 0, have_lat_range = 0, have_levels = 0;
+static pack_t pack_ = PACK_NONE;
+static int keep_bits_ = 0;
+static reduce_t reduce_ = REDUCE_NONE;
+static int window_ = 0;
+static char manifest_[1024] = "";
+static int jobs_ = 0;
+static char stats_file_[1024] = "";
+static char plev_file_[1024] = "", ps_file_[1024] = "";
+
+/* variable name and units for input files given without them */
+static char varname_[1024] = "", varunits_[1024] = "";
 
 int verbose ()
 {
      return verbose_;
 }
 
+int threads ()
+{
+     return threads_;
+}
+
+/* timesteps per NetCDF write; 0 means choose automatically */
+int write_batch ()
+{
+     return write_batch_;
+}
+
+/* chunk shape (time, lvl, lat, lon) of the output variable, or 0 to
+ * derive it from the access pattern */
+const size_t *chunks ()
+{
+     return chunks_[0] != 0 ? chunks_ : 0;
+}
+
+/* chunk cache size in bytes; 0 means choose automatically */
+size_t chunk_cache ()
+{
+     return chunk_cache_;
+}
+
+/* expected way the output will be read */
+access_t access_pattern ()
+{
+     return access_;
+}
+
+/* write the output in time series order through a transpose? */
+int transpose ()
+{
+     return transpose_;
+}
+
+/* memory for the transpose blocks and tiles, in bytes, or 0 to use
+ * the default (see transpose.c) */
+size_t transpose_memory ()
+{
+     return transpose_memory_;
+}
+
+/* limit for the buffers of a conversion, in bytes, or 0 for none */
+size_t max_memory ()
+{
+     return max_memory_;
+}
+
+/* timesteps to keep in flight ahead of the conversion, or 0 to read
+ * through the mapping */
+int read_ahead ()
+{
+     return read_ahead_ > 0 ? read_ahead_ : 0;
+}
+
+/* how to read ahead */
+io_t io_backend ()
+{
+     return io_;
+}
+
+/* read ahead with O_DIRECT? */
+int direct_io ()
+{
+     return direct_io_;
+}
+
+int shuffle ()
+{
+     return shuffle_;
+}
+
+/* threads compressing chunks for direct chunk writes (or Zarr
+ * output); 0 leaves compression to the NetCDF library */
+int compress_threads ()
+{
+     return compress_threads_;
+}
+
+/* first, last and every how many timesteps to convert, counting
+ * from 0 */
+size_t tstart ()
+{
+     return tstart_;
+}
+
+size_t tend ()
+{
+     return tend_;
+}
+
+size_t tstride ()
+{
+     return tstride_;
+}
+
+/* keep the record index of each input as <infile>.idx */
+int save_index ()
+{
+     return save_index_;
+}
+
+/* keep the time dimension unlimited even if the number of timesteps
+ * is known up front */
+int unlimited ()
+{
+     return unlimited_;
+}
+
+/* ranges of coordinate values to convert, or 0 for all */
+const double *lon_range ()
+{
+     return have_lon_range ? lon_range_ : 0;
+}
+
+const double *lat_range ()
+{
+     return have_lat_range ? lat_range_ : 0;
+}
+
+const double *levels ()
+{
+     return have_levels ? levels_ : 0;
+}
+
+/* integer type to pack the output into, if any */
+pack_t pack ()
+{
+     return pack_;
+}
+
+/* mantissa bits to keep when rounding the output; 0 keeps all */
+int keep_bits ()
+{
+     return keep_bits_;
+}
+
+/* how to combine the timesteps of each window, if at all */
+reduce_t reduce ()
+{
+     return reduce_;
+}
+
+/* timesteps per window for --reduce, or WINDOW_DAILY/WINDOW_MONTHLY */
+int window ()
+{
+     return window_;
+}
+
+/* job list for batch conversions, or 0 */
+const char *manifest ()
+{
+     return strlen(manifest_) != 0 ? manifest_ : 0;
+}
+
+/* conversions to run at the same time with --manifest; 0 means one
+ * per --threads worth of processors */
+int jobs ()
+{
+     return jobs_;
+}
+
+/* file to append per-stage statistics to (--stats), or 0 */
+const char *stats_file ()
+{
+     return strlen(stats_file_) != 0 ? stats_file_ : 0;
+}
+
+/* pressure levels to interpolate sigma levels to (--to-pressure), or 0 */
+const char *plev_file ()
+{
+     return strlen(plev_file_) != 0 ? plev_file_ : 0;
+}
+
+/* surface pressure for --to-pressure, or 0 */
+const char *ps_file ()
+{
+     return strlen(ps_file_) != 0 ? ps_file_ : 0;
+}
+
 const char *version ()
 {
      static char version_[1024] = "sprintars2nc 1.0";
@@ -48,12 +261,15 @@ void usage (int code)
 	  stdout = stderr;
      }
      
-     printf("\nUsage: sprintars2nc [options] infile outfile\n\n");
+     printf("\nUsage: sprintars2nc [options] infile[:varname:units] ... "
+	    "outfile\n\n");
      printf("options:\n");
      printf("-c | --compress            (default: off)   "
             "enable compression (implies -f nc4)\n");
-     printf("-f | --format nc2 | nc4    (default: nc2)   "
-            "create NetCDF v2 or v4 file?\n");
+     printf("-f | --format nc2 | nc4 | zarr             "
+            "create NetCDF v2 or v4 file, or a Zarr v2\n"
+	    "                           (default: nc2)   "
+	    " directory store?\n");
      printf("-h | --help                                 "
             "print this message and exit\n");
      printf("-p | --progress            (default: off)   "
@@ -64,6 +280,82 @@ void usage (int code)
             "print version and exit\n");
      printf("--clobber                  (default: off)   "
             "overwrite output file if it exists\n");
+     printf("--threads <n>              (default: 1)     "
+            "read and decode timesteps on n - 1\n"
+	    "                                            "
+	    " threads while writing on one\n");
+     printf("--write-batch <k> | auto   (default: 1)     "
+            "write k timesteps per NetCDF call\n");
+     printf("--read-ahead <n>           (default: off)   "
+            "keep n timesteps in flight ahead of the\n"
+	    "                                            "
+	    " conversion (without --threads)\n");
+     printf("--io uring | pread         (default: uring) "
+            "how to read ahead; uring falls back to\n"
+	    "                                            "
+	    " pread where the kernel lacks it\n");
+     printf("--direct-io                (default: off)   "
+            "read ahead with O_DIRECT, bypassing the\n"
+	    "                                            "
+	    " page cache\n");
+     printf("--chunks <t:lvl:lat:lon>                    "
+            "chunk shape of the output variable\n"
+	    "                                            "
+	    " (implies -f nc4 unless -f zarr)\n");
+     printf("--access map | profile | series            "
+            "expected access pattern, used to choose\n"
+	    "                           (default: map)   "
+	    " chunk shapes if --chunks is not given\n");
+     printf("--transpose                (default: off)   "
+            "write whole time series per chunk (implies\n"
+	    "                                            "
+	    " --access series), transposing out of core\n");
+     printf("--transpose-memory <bytes> (default: 1 GiB) "
+            "memory to transpose in; the rest is\n"
+	    "                                            "
+	    " spilled to $TMPDIR\n");
+     printf("--max-memory <bytes>       (default: none)  "
+            "limit for all buffers of a conversion;\n"
+	    "                                            "
+	    " batches, pipeline and transpose are\n"
+	    "                                            "
+	    " sized to fit (suffixes k, M, G)\n");
+     printf("--chunk-cache <bytes>                       "
+            "chunk cache size (default: automatic)\n");
+     printf("--no-shuffle                                "
+            "do not shuffle bytes before compressing\n");
+     printf("--compress-threads <n>     (default: off)   "
+            "compress chunks on n threads and write\n"
+	    "                                            "
+	    " them directly (implies -c)\n");
+     printf("--pack short | byte        (default: off)   "
+            "store packed integers with scale_factor\n"
+	    "                                            "
+	    " and add_offset (lossy)\n");
+     printf("--keep-bits <n>            (default: all)   "
+            "round values to n mantissa bits (lossy)\n");
+     printf("--reduce mean | min | max | sum             "
+            "write one record per --window with the\n"
+	    "                                            "
+	    " mean, minimum, maximum or sum of its\n"
+	    "                                            "
+	    " timesteps, and time bounds\n");
+     printf("--window <n> | daily | monthly              "
+            "n timesteps, or calendar days or months\n"
+	    "                                            "
+	    " of the time coordinate (UTC)\n");
+     printf("--manifest <file>                           "
+            "convert the jobs listed in file, one\n"
+	    "                                            "
+	    " 'infile[:varname:units] ... outfile'\n"
+	    "                                            "
+	    " per line, instead of infile/outfile\n");
+     printf("--jobs <n>                 (default: auto)  "
+            "number of --manifest jobs to run at once\n");
+     printf("--stats <file>                              "
+            "write per-stage timings, byte counts and\n"
+	    "                                            "
+	    " latency histograms to file as JSON\n");
      printf("--lonfile <file>           (mandatory)      "
             "file specifying the longitude dim\n");
      printf("--latfile <file>           (mandatory)      "
@@ -73,21 +365,63 @@ void usage (int code)
 	    "                                            "
 	    " (mandatory for 3D fields)\n");
      printf("--tfile <file> | --t0 <t0> --tstep <step>   "
-            "specification of the time dim\n"
+            "specification of the time dim (default:\n"
+	    "                                            "
+	    " DATE in the GTOOL headers)\n"
 	    "                                            "
 	    "<t0>:   start date (as \n"
 	    "                                            "
 	    "        'YYYY-mm-dd HH:MM:SS' UTC)\n"
 	    "                                            "
 	    "<step>: time step in seconds\n");
-     printf("--varname <name>           (mandatory)      "
+     printf("--tstart <n>               (default: 0)     "
+            "first timestep to convert, from 0\n");
+     printf("--tend <n>                 (default: last)  "
+            "last timestep to convert\n");
+     printf("--stride <n>               (default: 1)     "
+            "convert every n-th timestep\n");
+     printf("--lon-range <lo:hi>        (default: all)   "
+            "convert only longitudes lo to hi; lo > hi\n"
+	    "                                            "
+	    " wraps around\n");
+     printf("--lat-range <lo:hi>        (default: all)   "
+            "convert only latitudes lo to hi\n");
+     printf("--levels <lo:hi>           (default: all)   "
+            "convert only levels with lvl values lo\n"
+	    "                                            "
+	    " to hi\n");
+     printf("--to-pressure <file>                        "
+            "interpolate sigma levels to the pressure\n"
+	    "                                            "
+	    " levels (in Pa) in file, using --ps\n");
+     printf("--ps <file>                                 "
+            "surface pressure (in hPa) of the input,\n"
+	    "                                            "
+	    " a 2D SPRINTARS file\n");
+     printf("--save-index                                "
+            "keep the timestep index of each infile\n"
+	    "                                            "
+	    " as infile.idx (infile.ITEM.idx) for later\n"
+	    "                                            "
+	    " runs\n");
+     printf("--unlimited                (default: off)   "
+            "keep the time dimension unlimited, even\n"
+	    "                                            "
+	    " if the number of timesteps is known\n");
+     printf("--varname <name>           (default: ITEM)  "
             "variable name in NetCDF output file\n");
-     printf("--varunits <units>         (mandatory)      "
+     printf("--varunits <units>         (default: UNIT)  "
             "variable units in NetCDF output file\n");
      printf("\n"
-            "infile:    unformatted FORTRAN big-endian SPRINTARS output\n"
+            "infile:    unformatted FORTRAN big-endian SPRINTARS output;\n"
+            "           several infile:varname:units triples sharing the\n"
+            "           lon/lat/lvl/time dims go into one outfile\n"
+            "           (--varname and --varunits are then not needed);\n"
+            "           a file holding several items (ITEM) becomes\n"
+            "           one variable per item, or the item varname;\n"
+            "           - reads stdin (or give a pipe or FIFO)\n"
             "outfile:   NetCDF output file\n"
-          );
+	  );
      printf("\n\nExample:\n"
             "sprintars2nc -vvv -f nc4 -c -p --clobber \\\n"
 	    "  --lonfile GLON640.txt --latfile GGLA320.txt \\\n"
@@ -110,9 +444,9 @@ time_t strtotime (const char *time)
      }
      ret = strptime(time, "%Y-%m-%d %H:%M:%S", &tm);
      if (ret == 0) {
-     	  fprintf(stderr, "time '%s' is not in the required format "
+	  fprintf(stderr, "time '%s' is not in the required format "
      		  "(try YYYY-mm-dd HH:MM:SS)\n", time);
-     	  exit(1);
+	  exit(1);
      }
      return mktime(&tm);
      /* struct tm *tm, tm_copy; */
@@ -126,12 +460,120 @@ time_t strtotime (const char *time)
      /* return mktime(&tm_copy); */
 }
 
+/* parse lo:hi into range */
+static void parse_range (const char *name, const char *arg, double range[2])
+{
+     char *end, *end2 = 0;
+
+     range[0] = strtod(arg, &end);
+     if (end != arg && *end == ':')
+	  range[1] = strtod(end + 1, &end2);
+     if (end2 == 0 || end2 == end + 1 || *end2 != 0) {
+	  fprintf(stderr, "bad %s %s (expected lo:hi)\n", name, arg);
+	  usage(1);
+	  exit(1);
+     }
+}
+
+/* a number of bytes with an optional k, M or G suffix; 0 if arg is
+ * not one */
+static size_t parse_bytes (const char *arg)
+{
+     char *end;
+     size_t n = strtoull(arg, &end, 0);
+
+     switch (*end) {
+     case 'G': case 'g':
+	  n <<= 10;
+	  /* fall through */
+     case 'M': case 'm':
+	  n <<= 10;
+	  /* fall through */
+     case 'K': case 'k':
+	  n <<= 10;
+	  end++;
+     }
+     return end == arg || *end != 0 ? 0 : n;
+}
+
+/* split infile:varname:units into var; plain infile names take the
+ * --varname and --varunits values; return 0 if that leaves the name or
+ * units empty */
+static int parse_var (const char *arg, var_t *var)
+{
+     const char *units = strrchr(arg, ':');
+     const char *name = 0;
+
+     memset(var, 0, sizeof(var_t));
+     if (units != 0) {
+	  for (name = units - 1; name >= arg && *name != ':'; --name)
+	       ;
+	  if (name < arg)
+	       name = 0;
+     }
+     if (strlen(arg) >= 1024) {
+	  fprintf(stderr,
+		  "Sorry, input file path can only be %d characters long\n",
+		  1024 - 1);
+	  return 0;
+     }
+     if (name != 0) {
+	  strncpy(var->fname, arg, name - arg);
+	  strncpy(var->name, name + 1, units - name - 1);
+	  strncpy(var->units, units + 1, 1023);
+     } else {
+	  strncpy(var->fname, arg, 1023);
+	  strncpy(var->name, varname_, 1023);
+	  strncpy(var->units, varunits_, 1023);
+     }
+     /* a name or units not given come from the GTOOL header of the
+      * input (see convert_file) */
+     return 1;
+}
+
+/* turn the arguments infile[:varname:units] ... outfile into vars and
+ * out_fname; return nonzero (after saying why) if they do not make
+ * sense */
+int parse_files (int n_args, char *args[],
+		 var_t **vars, int *n_vars, char out_fname[1024])
+{
+     if (n_args < 2)
+	  return 1;
+     *n_vars = n_args - 1;
+     *vars = malloc(sizeof(var_t) * *n_vars);
+     for (int i = 0; i < *n_vars; ++i) {
+	  if (!parse_var(args[i], &(*vars)[i]))
+	       return 1;
+	  for (int j = 0; j < i; ++j) {
+	       if (strlen((*vars)[i].name) > 0 &&
+		   strcmp((*vars)[i].name, (*vars)[j].name) == 0) {
+		    fprintf(stderr, "variable %s is given twice\n",
+			    (*vars)[i].name);
+		    return 1;
+	       }
+	       if (strcmp((*vars)[i].fname, "-") == 0 &&
+		   strcmp((*vars)[j].fname, "-") == 0) {
+		    fprintf(stderr, "only one input can come from stdin\n");
+		    return 1;
+	       }
+	  }
+     }
+     if (strlen(args[n_args - 1]) < 1024 - 1) {
+	  strncpy(out_fname, args[n_args - 1], 1024);
+     } else {
+	  fprintf(stderr,
+		  "Sorry, output file path can only be %d characters long\n",
+		  1024 - 1);
+	  return 1;
+     }
+     return 0;
+}
+
 void opts (int argc, char *argv[],
-	   char in_fname[1024], char out_fname[1024],
+	   var_t **vars, int *n_vars, char out_fname[1024],
 	   char lonfile[1024], char latfile[1024],
 	   char pfile[1024], char tfile[1024],
 	   time_t *t0, int *tstep,
-	   char varname[1024], char varunits[1024],
 	   dim_t *dimension, 
 	   nc_t *format, int *compress, int *progress, int *clobber)
 {
@@ -145,8 +587,7 @@ void opts (int argc, char *argv[],
      strncpy(latfile, "", 1024);
      strncpy(pfile, "", 1024);
      strncpy(tfile, "", 1024);
-     strncpy(varname, "", 1024);
-     strncpy(varunits, "", 1024);
+     *t0 = -1;
      *tstep = -1;
 
      /* process options */
@@ -165,6 +606,36 @@ void opts (int argc, char *argv[],
 	       {"tfile",     required_argument, 0,  0 },
 	       {"t0",        required_argument, 0,  0 },
 	       {"tstep",     required_argument, 0,  0 },
+	       {"threads",   required_argument, 0,  0 },
+	       {"write-batch", required_argument, 0, 0 },
+	       {"read-ahead", required_argument, 0, 0 },
+	       {"io",        required_argument, 0,  0 },
+	       {"direct-io", no_argument,       0,  0 },
+	       {"chunks",    required_argument, 0,  0 },
+	       {"chunk-cache", required_argument, 0, 0 },
+	       {"transpose", no_argument,     0,  0 },
+	       {"transpose-memory", required_argument, 0, 0 },
+	       {"max-memory", required_argument, 0, 0 },
+	       {"access",    required_argument, 0,  0 },
+	       {"no-shuffle", no_argument,      0,  0 },
+	       {"compress-threads", required_argument, 0, 0 },
+	       {"tstart",    required_argument, 0,  0 },
+	       {"tend",      required_argument, 0,  0 },
+	       {"stride",    required_argument, 0,  0 },
+	       {"save-index", no_argument,      0,  0 },
+	       {"unlimited", no_argument,       0,  0 },
+	       {"lon-range", required_argument, 0,  0 },
+	       {"to-pressure", required_argument, 0, 0 },
+	       {"ps",        required_argument, 0,  0 },
+	       {"lat-range", required_argument, 0,  0 },
+	       {"levels",    required_argument, 0,  0 },
+	       {"pack",      required_argument, 0,  0 },
+	       {"reduce",    required_argument, 0,  0 },
+	       {"window",    required_argument, 0,  0 },
+	       {"keep-bits", required_argument, 0,  0 },
+	       {"manifest",  required_argument, 0,  0 },
+	       {"stats",     required_argument, 0,  0 },
+	       {"jobs",      required_argument, 0,  0 },
 	       {"varname",   required_argument, 0,  0 },
 	       {"varunits",  required_argument, 0,  0 },
 	       {"verbose",   no_argument,       0,  'v' },
@@ -225,12 +696,247 @@ void opts (int argc, char *argv[],
 				 strerror(errno));
 			 exit(1);
 		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "threads") == 0) {
+		    threads_ = strtol(optarg, 0, 0);
+		    if (threads_ < 1) {
+			 fprintf(stderr, "need at least one thread\n");
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "read-ahead") == 0) {
+		    read_ahead_ = strtol(optarg, 0, 0);
+		    if (read_ahead_ < 1 || read_ahead_ > 4096) {
+			 fprintf(stderr, "read-ahead must be 1 to 4096 "
+				 "timesteps\n");
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "io") == 0) {
+		    if (strcmp(optarg, "uring") == 0) {
+			 io_ = IO_URING;
+		    } else if (strcmp(optarg, "pread") == 0) {
+			 io_ = IO_PREAD;
+		    } else {
+			 fprintf(stderr, "unknown I/O backend %s\n", optarg);
+			 usage(1);
+			 exit(1);
+		    }
+		    if (read_ahead_ == -1)
+			 read_ahead_ = 0;
+	       } else if (strcmp(long_options[option_index].name,
+				 "direct-io") == 0) {
+		    direct_io_ = 1;
+		    if (read_ahead_ == -1)
+			 read_ahead_ = 0;
+	       } else if (strcmp(long_options[option_index].name,
+				 "write-batch") == 0) {
+		    if (strcmp(optarg, "auto") == 0) {
+			 write_batch_ = 0;
+		    } else {
+			 write_batch_ = strtol(optarg, 0, 0);
+			 if (write_batch_ < 1) {
+			      fprintf(stderr, "write batch must be at least "
+				      "one timestep\n");
+			      usage(1);
+			      exit(1);
+			 }
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "chunks") == 0) {
+		    /* t:lvl:lat:lon, or t:lat:lon for 2D fields */
+		    size_t vals[4];
+		    int n = 0, zero = 0;
+		    char *p = optarg, *end = optarg;
+		    while (n < 4) {
+			 vals[n] = strtoul(p, &end, 0);
+			 zero |= vals[n++] == 0;
+			 if (end == p || *end != ':')
+			      break;
+			 p = end + 1;
+		    }
+		    if (*end != 0 || zero || n < 3) {
+			 fprintf(stderr, "cannot parse chunk shape %s "
+				 "(try t:lvl:lat:lon)\n", optarg);
+			 usage(1);
+			 exit(1);
+		    }
+		    if (n == 3) {
+			 chunks_[0] = vals[0];
+			 chunks_[1] = 1;
+			 chunks_[2] = vals[1];
+			 chunks_[3] = vals[2];
+		    } else {
+			 memcpy(chunks_, vals, sizeof(vals));
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "chunk-cache") == 0) {
+		    chunk_cache_ = strtoul(optarg, 0, 0);
+	       } else if (strcmp(long_options[option_index].name,
+				 "access") == 0) {
+		    if (strcmp(optarg, "map") == 0) {
+			 access_ = ACCESS_MAP;
+		    } else if (strcmp(optarg, "profile") == 0) {
+			 access_ = ACCESS_PROFILE;
+		    } else if (strcmp(optarg, "series") == 0) {
+			 access_ = ACCESS_SERIES;
+		    } else {
+			 fprintf(stderr, "unknown access pattern %s\n",
+				 optarg);
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "transpose") == 0) {
+		    transpose_ = 1;
+	       } else if (strcmp(long_options[option_index].name,
+				 "transpose-memory") == 0) {
+		    transpose_memory_ = parse_bytes(optarg);
+		    if (transpose_memory_ == 0) {
+			 fprintf(stderr, "bad transpose memory %s\n", optarg);
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "max-memory") == 0) {
+		    max_memory_ = parse_bytes(optarg);
+		    if (max_memory_ == 0) {
+			 fprintf(stderr, "bad memory limit %s\n", optarg);
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "no-shuffle") == 0) {
+		    shuffle_ = 0;
+	       } else if (strcmp(long_options[option_index].name,
+				 "compress-threads") == 0) {
+		    compress_threads_ = strtol(optarg, 0, 0);
+		    if (compress_threads_ < 1) {
+			 fprintf(stderr, "need at least one compression "
+				 "thread\n");
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "tstart") == 0 ||
+			  strcmp(long_options[option_index].name,
+				 "tend") == 0 ||
+			  strcmp(long_options[option_index].name,
+				 "stride") == 0) {
+		    const char *name = long_options[option_index].name;
+		    char *end;
+		    const long n = strtol(optarg, &end, 0);
+		    if (*end != 0 || n < 0 ||
+			(n == 0 && strcmp(name, "stride") == 0)) {
+			 fprintf(stderr, "bad %s %s\n", name, optarg);
+			 usage(1);
+			 exit(1);
+		    }
+		    if (strcmp(name, "tstart") == 0)
+			 tstart_ = n;
+		    else if (strcmp(name, "tend") == 0)
+			 tend_ = n;
+		    else
+			 tstride_ = n;
+	       } else if (strcmp(long_options[option_index].name,
+				 "save-index") == 0) {
+		    save_index_ = 1;
+	       } else if (strcmp(long_options[option_index].name,
+				 "unlimited") == 0) {
+		    unlimited_ = 1;
+	       } else if (strcmp(long_options[option_index].name,
+				 "lon-range") == 0) {
+		    parse_range("lon-range", optarg, lon_range_);
+		    have_lon_range = 1;
+	       } else if (strcmp(long_options[option_index].name,
+				 "lat-range") == 0) {
+		    parse_range("lat-range", optarg, lat_range_);
+		    have_lat_range = 1;
+	       } else if (strcmp(long_options[option_index].name,
+				 "levels") == 0) {
+		    parse_range("levels", optarg, levels_);
+		    have_levels = 1;
+	       } else if (strcmp(long_options[option_index].name,
+				 "to-pressure") == 0) {
+		    strncpy(plev_file_, optarg, 1024 - 1);
+	       } else if (strcmp(long_options[option_index].name,
+				 "ps") == 0) {
+		    strncpy(ps_file_, optarg, 1024 - 1);
+	       } else if (strcmp(long_options[option_index].name,
+				 "pack") == 0) {
+		    if (strcmp(optarg, "short") == 0) {
+			 pack_ = PACK_SHORT;
+		    } else if (strcmp(optarg, "byte") == 0) {
+			 pack_ = PACK_BYTE;
+		    } else {
+			 fprintf(stderr, "can only pack into short or "
+				 "byte, not %s\n", optarg);
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "reduce") == 0) {
+		    if (strcmp(optarg, "mean") == 0) {
+			 reduce_ = REDUCE_MEAN;
+		    } else if (strcmp(optarg, "min") == 0) {
+			 reduce_ = REDUCE_MIN;
+		    } else if (strcmp(optarg, "max") == 0) {
+			 reduce_ = REDUCE_MAX;
+		    } else if (strcmp(optarg, "sum") == 0) {
+			 reduce_ = REDUCE_SUM;
+		    } else {
+			 fprintf(stderr, "can only reduce to mean, min, max "
+				 "or sum, not %s\n", optarg);
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "window") == 0) {
+		    if (strcmp(optarg, "daily") == 0) {
+			 window_ = WINDOW_DAILY;
+		    } else if (strcmp(optarg, "monthly") == 0) {
+			 window_ = WINDOW_MONTHLY;
+		    } else {
+			 window_ = strtol(optarg, 0, 0);
+			 if (window_ < 1) {
+			      fprintf(stderr, "bad window %s (expected a "
+				      "number of timesteps, daily or "
+				      "monthly)\n", optarg);
+			      usage(1);
+			      exit(1);
+			 }
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "keep-bits") == 0) {
+		    keep_bits_ = strtol(optarg, 0, 0);
+		    if (keep_bits_ < 1 || keep_bits_ > 23) {
+			 fprintf(stderr, "can keep between 1 and 23 "
+				 "mantissa bits\n");
+			 usage(1);
+			 exit(1);
+		    }
+	       } else if (strcmp(long_options[option_index].name,
+				 "manifest") == 0) {
+		    strncpy(manifest_, optarg, 1024 - 1);
+	       } else if (strcmp(long_options[option_index].name,
+				 "stats") == 0) {
+		    strncpy(stats_file_, optarg, 1024 - 1);
+	       } else if (strcmp(long_options[option_index].name,
+				 "jobs") == 0) {
+		    jobs_ = strtol(optarg, 0, 0);
+		    if (jobs_ < 1) {
+			 fprintf(stderr, "need at least one job\n");
+			 usage(1);
+			 exit(1);
+		    }
 	       } else if (strcmp(long_options[option_index].name,
 				 "varname") == 0) {
-		    strncpy(varname, optarg, 1024);
+		    strncpy(varname_, optarg, 1024 - 1);
 	       } else if (strcmp(long_options[option_index].name,
 				 "varunits") == 0) {
-		    strncpy(varunits, optarg, 1024);
+		    strncpy(varunits_, optarg, 1024 - 1);
 	       } else if (strcmp(long_options[option_index].name,
 				 "version") == 0) {
 		    printf("%s\n", version());
@@ -250,6 +956,10 @@ void opts (int argc, char *argv[],
 	       } else if (strcmp(optarg, "nc4") == 0) {
 		    *format = NC4;
 		    break;
+	       } else if (strcmp(optarg, "zarr") == 0) {
+		    *format = ZARR;
+		    zarr_ = 1;
+		    break;
 	       } else {
 		    fprintf(stderr, "unknown format %s\n", optarg);
 		    usage(1);
@@ -275,30 +985,90 @@ void opts (int argc, char *argv[],
 	  }
      }
      
-     /* lonfile is a mandatory argument */
-     if (strlen(lonfile) == 0) {
-	  fprintf(stderr,
-		  "lonfile is a mandatory argument\n");
+     /* chunking only exists in NetCDF4 files; the transpose writes
+      * time series chunks */
+     if (transpose_)
+	  access_ = ACCESS_SERIES;
+     if ((chunks_[0] != 0 || transpose_) && *format != ZARR)
+	  *format = NC4;
+     /* compressing in parallel means compressing */
+     if (compress_threads_ > 0 && *compress == 0)
+	  *compress = 9;
+
+     /* --io and --direct-io alone read ahead by a default depth */
+     if (read_ahead_ == 0)
+	  read_ahead_ = DEFAULT_READ_AHEAD;
+     if (read_ahead_ > 0 && threads_ > 1) {
+	  fprintf(stderr, "--read-ahead is for the single-threaded reader; "
+		  "the --threads pipeline reads ahead on its workers\n");
 	  usage(1);
 	  exit(1);
      }
-     if (strlen(latfile) == 0) {
-	  fprintf(stderr,
-		  "latfile is a mandatory argument\n");
+
+     if (tend_ < tstart_) {
+	  fprintf(stderr, "tend comes before tstart\n");
+	  usage(1);
+	  exit(1);
+     }
+
+     /* packed values are already rounded, and are not floats */
+     if (pack_ != PACK_NONE && keep_bits_ > 0) {
+	  fprintf(stderr, "--pack and --keep-bits exclude each other\n");
+	  usage(1);
+	  exit(1);
+     }
+     /* a window needs a way to combine it, and vice versa */
+     if ((reduce_ != REDUCE_NONE) != (window_ != 0)) {
+	  fprintf(stderr, "--reduce and --window must be given together\n");
+	  usage(1);
+	  exit(1);
+     }
+     /* sums can leave the range that --pack measures */
+     if (pack_ != PACK_NONE && reduce_ == REDUCE_SUM) {
+	  fprintf(stderr, "--pack does not work with --reduce sum\n");
+	  usage(1);
+	  exit(1);
+     }
+     if (transpose_ && zarr_) {
+	  fprintf(stderr, "--transpose writes NetCDF4 files only\n");
+	  usage(1);
+	  exit(1);
+     }
+     if (transpose_ && compress_threads_ > 0) {
+	  fprintf(stderr, "--compress-threads writes rows of chunks, "
+		  "which --transpose does not\n");
+	  usage(1);
+	  exit(1);
+     }
+     if (pack_ != PACK_NONE && compress_threads_ > 0 && !zarr_) {
+	  fprintf(stderr, "--compress-threads only writes floats, "
+		  "not --pack'ed data\n");
+	  usage(1);
+	  exit(1);
+     }
+
+     /* interpolation needs the sigma levels and the surface pressure */
+     if ((strlen(plev_file_) != 0) != (strlen(ps_file_) != 0)) {
+	  fprintf(stderr, "--to-pressure and --ps must be given together\n");
+	  usage(1);
+	  exit(1);
+     }
+     if (strlen(plev_file_) != 0 && *dimension != DIM3SIGMA) {
+	  fprintf(stderr, "--to-pressure needs a sigmafile\n");
 	  usage(1);
 	  exit(1);
      }
 
-     /* variable name and units must be given */
-     if (strlen(varname) == 0) {
+     /* lonfile is a mandatory argument */
+     if (strlen(lonfile) == 0) {
 	  fprintf(stderr,
-		  "varname is a mandatory argument\n");
+		  "lonfile is a mandatory argument\n");
 	  usage(1);
 	  exit(1);
      }
-     if (strlen(varunits) == 0) {
+     if (strlen(latfile) == 0) {
 	  fprintf(stderr,
-		  "varunits is a mandatory argument\n");
+		  "latfile is a mandatory argument\n");
 	  usage(1);
 	  exit(1);
      }
@@ -311,33 +1081,31 @@ void opts (int argc, char *argv[],
 	  exit(1);
      }
      
-     /* if t0 and tstep are given, tfile must not be */
-     if ((*t0 != -1) == (strlen(tfile) != 0)) {
+     /* if t0 and tstep are given, tfile must not be; without
+      * either, the time coordinate comes from the GTOOL headers */
+     if (*t0 != -1 && strlen(tfile) != 0) {
 	  fprintf(stderr,
-		  "either tfile or tstep/t0 must be given\n");
+		  "either tfile or tstep/t0 may be given\n");
 	  usage(1);
 	  exit(1);
      }
      
-     /* process input and output file name */
-     if (optind != argc - 2) {
-	  usage(1);
-	  exit(1);
-     }
-     if (strlen(argv[optind]) < 1024 - 1) {
-	  strncpy(in_fname, argv[optind++], 1024);
-     } else {
-	  fprintf(stderr,
-		  "Sorry, input file path can only be %d characters long\n",
-		  1024 - 1);
-	  exit(1);
+     /* process input and output file names; with a manifest, they
+      * come from there instead */
+     if (manifest() != 0) {
+	  if (optind != argc) {
+	       fprintf(stderr, "no infile or outfile may be given with "
+		       "--manifest\n");
+	       usage(1);
+	       exit(1);
+	  }
+	  *vars = 0;
+	  *n_vars = 0;
+	  return;
      }
-     if (strlen(argv[optind]) < 1024 - 1) {
-	  strncpy(out_fname, argv[optind++], 1024);
-     } else {
-	  fprintf(stderr,
-		  "Sorry, output file path can only be %d characters long\n",
-		  1024 - 1);
+     if (parse_files(argc - optind, argv + optind,
+		     vars, n_vars, out_fname) != 0) {
+	  usage(1);
 	  exit(1);
      }
 }
@@ -0,0 +1,148 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Buffer pool.  All buffers that scale with the field size (the
+ * conversion slots and batches, the --pack scan and packed batches,
+ * the reduction windows, the transpose blocks, the direct chunk rows
+ * and compression buffers, and the stream records)
+ * are mapped here once, when the conversion is set up, instead of
+ * coming from malloc.  Buffers of 2 MiB or more are aligned to 2 MiB
+ * and advised for transparent huge pages, which saves TLB misses when
+ * the decoders sweep over them.  The pool keeps count of what it has
+ * handed out; with --max-memory, that is a hard limit, and the features
+ * that can trade memory for speed (--write-batch auto, the pipeline
+ * slots, --transpose) size themselves from what is left (pool_left). */
+
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "sprintars2nc.h"
+
+#define HUGE_PAGE ((size_t)2 << 20)
+#define MiB(n) ((double)(n) / (1 << 20))
+
+typedef struct {
+     void *ptr;			/* what the caller got */
+     void *map;			/* the mapping it lies in */
+     size_t map_len;
+     size_t bytes;		/* what the caller asked for */
+} buffer_t;
+
+static buffer_t *buffers = 0;
+static int n_buffers = 0, max_buffers = 0;
+static size_t budget = 0, used = 0, peak = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* limit the buffers to the given number of bytes, or 0 for no limit */
+void init_pool (size_t bytes)
+{
+     budget = bytes;
+}
+
+/* bytes that can still be allocated */
+size_t pool_left ()
+{
+     size_t left;
+
+     if (budget == 0)
+	  return SIZE_MAX;
+     pthread_mutex_lock(&lock);
+     left = used < budget ? budget - used : 0;
+     pthread_mutex_unlock(&lock);
+     return left;
+}
+
+/* map a buffer of the given size; what names it if it does not fit
+ * --max-memory */
+void *pool_alloc (size_t bytes, const char *what)
+{
+     const size_t align = bytes >= HUGE_PAGE ? HUGE_PAGE : 0;
+     size_t len = bytes + align;
+     unsigned char *map, *ptr;
+
+     pthread_mutex_lock(&lock);
+     if (budget != 0 && used + bytes > budget) {
+	  fprintf(stderr, "--max-memory of %.0f MiB is too small: %s "
+		  "need %.1f MiB more, %.1f MiB are in use\n",
+		  MiB(budget), what, MiB(bytes), MiB(used));
+	  exit(1);
+     }
+     if (len == 0)
+	  len = 1;
+     map = mmap(0, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     if (map == MAP_FAILED) {
+	  fprintf(stderr, "Allocating %.1f MiB for %s: ", MiB(bytes), what);
+	  perror(0);
+	  exit(1);
+     }
+     ptr = map;
+     if (align != 0) {
+	  ptr = (unsigned char *)(((uintptr_t)map + align - 1) &
+				  ~(uintptr_t)(align - 1));
+#ifdef MADV_HUGEPAGE
+	  /* only advice: without transparent huge pages, or with none
+	   * to spare, the kernel falls back to small pages */
+	  madvise(ptr, bytes / HUGE_PAGE * HUGE_PAGE, MADV_HUGEPAGE);
+#endif
+     }
+     if (n_buffers == max_buffers) {
+	  max_buffers = max_buffers > 0 ? 2 * max_buffers : 16;
+	  buffers = realloc(buffers, sizeof(buffer_t) * max_buffers);
+     }
+     buffers[n_buffers].ptr = ptr;
+     buffers[n_buffers].map = map;
+     buffers[n_buffers].map_len = len;
+     buffers[n_buffers].bytes = bytes;
+     n_buffers++;
+     used += bytes;
+     if (used > peak)
+	  peak = used;
+     pthread_mutex_unlock(&lock);
+     return ptr;
+}
+
+/* give a buffer from pool_alloc back */
+void pool_free (void *ptr)
+{
+     if (ptr == 0)
+	  return;
+     pthread_mutex_lock(&lock);
+     for (int b = n_buffers - 1; b >= 0; --b) {
+	  if (buffers[b].ptr == ptr) {
+	       munmap(buffers[b].map, buffers[b].map_len);
+	       used -= buffers[b].bytes;
+	       buffers[b] = buffers[--n_buffers];
+	       break;
+	  }
+     }
+     pthread_mutex_unlock(&lock);
+}
+
+void pool_report ()
+{
+     printf("memory: %.1f MiB of buffers at most", MiB(peak));
+     if (budget != 0)
+	  printf(" (--max-memory %.0f MiB)", MiB(budget));
+     printf("\n");
+}
@@ -0,0 +1,169 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Lossy output.  Most mantissa bits of a model field are noise, and
+ * noise does not compress, so we can throw them away before the data
+ * reach deflate:
+ *   --keep-bits N  rounds every value to N explicit mantissa bits
+ *                  (round to nearest, ties to even), still as floats;
+ *   --pack T       stores short or byte integers with a per-variable
+ *                  scale_factor and add_offset (CF conventions); the
+ *                  range is taken from a first pass over the input.
+ * Both report the largest absolute error they make in the
+ * diagnostics. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sprintars2nc.h"
+
+/* largest packed magnitude; the most negative value is the fill
+ * value for missing (NaN) data */
+static int pack_max(pack_t pack)
+{
+     return pack == PACK_SHORT ? 32767 : 127;
+}
+
+/* round n floats at buf to keep mantissa bits; return the largest
+ * absolute change */
+float round_bits(float *buf, size_t n, int keep)
+{
+     const int drop = 23 - keep;
+     const uint32_t half = ((uint32_t)1 << drop) >> 1;
+     const uint32_t mask = ~(((uint32_t)1 << drop) - 1);
+     float err = 0;
+
+     if (drop <= 0)
+	  return 0;
+     for (size_t i = 0; i < n; ++i) {
+	  union { uint32_t u; float f; } v, r;
+	  v.f = buf[i];
+	  /* leave infinities and NaNs alone */
+	  if ((v.u & 0x7f800000) == 0x7f800000)
+	       continue;
+	  r.u = (v.u + half - 1 + ((v.u >> drop) & 1)) & mask;
+	  /* rounding the largest floats up would give infinity */
+	  if ((r.u & 0x7f800000) == 0x7f800000)
+	       r.u = v.u & mask;
+	  if (fabsf(r.f - v.f) > err)
+	       err = fabsf(r.f - v.f);
+	  buf[i] = r.f;
+     }
+     return err;
+}
+
+/* scale_factor and add_offset that map the range of all n-value
+ * timesteps in g onto the packed type; g is rewound afterwards */
+void pack_params(gtool_t *g, size_t n, pack_t pack,
+		 float *scale, float *offset)
+{
+     float *buf = pool_alloc(sizeof(float) * n, "the --pack scan");
+     void *cut = g->boxed ? pool_alloc(sizeof(float) * n,
+				       "the --pack scan") : 0;
+     double lo = HUGE_VAL, hi = -HUGE_VAL;
+
+     init_decode();
+     while (1) {
+	  int eof, err;
+	  const void *raw = read_sprintars_tstep(g, n, &eof, &err);
+	  if (eof)
+	       break;
+	  if (err != 0) {
+	       errno = err;
+	       perror("Scanning input for packing");
+	       exit(err);
+	  }
+	  decode_be_float(buf, cut_sprintars(g, raw, cut), n);
+	  for (size_t i = 0; i < n; ++i) {
+	       if (!isfinite(buf[i]))
+		    continue;
+	       if (buf[i] < lo)
+		    lo = buf[i];
+	       if (buf[i] > hi)
+		    hi = buf[i];
+	  }
+     }
+     rewind_sprintars(g);
+     pool_free(buf);
+     pool_free(cut);
+     /* with MPI, each rank has seen its own part of the input */
+     mpi_range(&lo, &hi);
+
+     if (lo > hi) {
+	  /* nothing but missing data */
+	  *scale = 1;
+	  *offset = 0;
+     } else {
+	  *scale = hi > lo ? (hi - lo) / (2 * pack_max(pack)) : 1;
+	  *offset = (hi + lo) / 2;
+     }
+}
+
+/* packed value of x */
+static long pack_value(float x, pack_t pack, double inv_scale,
+		       double offset)
+{
+     const long max = pack_max(pack);
+     long v;
+
+     if (isnan(x))
+	  return -max - 1;
+     v = lrint((x - offset) * inv_scale);
+     return v < -max ? -max : v > max ? max : v;
+}
+
+/* pack n floats at src into shorts or signed chars at dst */
+void pack_field(void *dst, const float *src, size_t n, pack_t pack,
+		float scale, float offset)
+{
+     const double inv_scale = 1.0 / scale;
+
+     if (pack == PACK_SHORT) {
+	  short *d = dst;
+	  for (size_t i = 0; i < n; ++i)
+	       d[i] = pack_value(src[i], pack, inv_scale, offset);
+     } else {
+	  signed char *d = dst;
+	  for (size_t i = 0; i < n; ++i)
+	       d[i] = pack_value(src[i], pack, inv_scale, offset);
+     }
+}
+
+/* largest absolute error pack_field would make on n floats at buf */
+float pack_error(const float *buf, size_t n, pack_t pack,
+		 float scale, float offset)
+{
+     const double inv_scale = 1.0 / scale;
+     double err = 0;
+
+     for (size_t i = 0; i < n; ++i) {
+	  double e;
+	  if (isnan(buf[i]))
+	       continue;
+	  e = fabs(buf[i] - (pack_value(buf[i], pack, inv_scale, offset) *
+			     (double)scale + offset));
+	  if (e > err)
+	       err = e;
+     }
+     return err;
+}
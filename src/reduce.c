@@ -0,0 +1,223 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Temporal reduction (--reduce, --window).  Instead of every timestep,
+ * write one record per window: a fixed number of timesteps, or the
+ * timesteps that fall into the same calendar day or month (UTC) of the
+ * time coordinate.  Fields are accumulated in double precision as
+ * they come out of the conversion, so nothing but one accumulator per
+ * variable is held in memory; missing (NaN) values are left out of the
+ * window, and a cell missing in all of it stays NaN.  The last window
+ * is written even if the input ends before it is complete.  The time
+ * coordinate of a record is the middle of its window, and the window
+ * itself goes into time_bnds (see nc.c). */
+
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sprintars2nc.h"
+
+typedef struct {
+     size_t n;			/* values per timestep */
+     double *acc;		/* sum, minimum or maximum so far */
+     int *count;		/* valid values per cell */
+     float *out;
+     long key;			/* window we are in */
+     int first, last;		/* its timesteps */
+     int records;		/* records written */
+} window_t;
+
+static window_t *windows = 0;
+static int n_windows;
+
+/* time coordinate and bounds of each record, from the first variable */
+static int *rec_t = 0, *rec_bnds = 0;
+static int n_rec, max_rec;
+
+/* days since 1970-01-01 of the first day of the given month (proleptic
+ * Gregorian calendar); timegm is not POSIX */
+static long days_from_civil (long y, int m)
+{
+     long era, yoe, doy, doe;
+
+     y -= m <= 2;
+     era = (y >= 0 ? y : y - 399) / 400;
+     yoe = y - era * 400;
+     doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5;
+     doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+     return era * 146097 + doe - 719468;
+}
+
+static long floor_div (long a, long b)
+{
+     return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/* start of month key (year * 12 + month from 0), in seconds */
+static long month_start (long key)
+{
+     const long y = floor_div(key, 12);
+     return 86400 * days_from_civil(y, key - 12 * y + 1);
+}
+
+/* the window timestep step belongs to */
+static long window_key (int step)
+{
+     const long t = time_of_step(step);
+     time_t tt = t;
+     struct tm tm;
+
+     switch (window()) {
+     case WINDOW_DAILY:
+	  return floor_div(t, 86400);
+     case WINDOW_MONTHLY:
+	  gmtime_r(&tt, &tm);
+	  return (tm.tm_year + 1900L) * 12 + tm.tm_mon;
+     default:
+	  return step / window();
+     }
+}
+
+/* bounds of the window w currently holds: the calendar day or month,
+ * or from its first timestep to one time increment past its last; the
+ * increment past step 0 is the one to step 1, and is only left out if
+ * the t file ends there */
+static void window_bounds (const window_t *w, long *lo, long *hi)
+{
+     switch (window()) {
+     case WINDOW_DAILY:
+	  *lo = w->key * 86400;
+	  *hi = *lo + 86400;
+	  break;
+     case WINDOW_MONTHLY:
+	  *lo = month_start(w->key);
+	  *hi = month_start(w->key + 1);
+	  break;
+     default:
+	  *lo = time_of_step(w->first);
+	  *hi = time_of_step(w->last);
+	  if (w->last > 0)
+	       *hi += *hi - time_of_step(w->last - 1);
+	  else if (has_time_of_step(1))
+	       *hi += time_of_step(1) - time_of_step(0);
+     }
+}
+
+void init_reduce (int n_vars, const var_t *vars, size_t n_field)
+{
+     n_windows = n_vars;
+     windows = calloc(n_windows, sizeof(window_t));
+     for (int v = 0; v < n_windows; ++v) {
+	  window_t *w = &windows[v];
+	  w->n = n_field * vars[v].out_kdim;
+	  w->acc = pool_alloc(sizeof(double) * w->n, "the reductions");
+	  w->count = pool_alloc(sizeof(int) * w->n, "the reductions");
+	  w->out = pool_alloc(sizeof(float) * w->n, "the reductions");
+	  w->first = -1;
+     }
+     n_rec = max_rec = 0;
+}
+
+/* write out the window variable var has collected and start over */
+static void emit (int var)
+{
+     window_t *w = &windows[var];
+     long lo, hi;
+
+     for (size_t i = 0; i < w->n; ++i) {
+	  if (w->count[i] == 0)
+	       w->out[i] = NAN;
+	  else if (reduce() == REDUCE_MEAN)
+	       w->out[i] = w->acc[i] / w->count[i];
+	  else
+	       w->out[i] = w->acc[i];
+     }
+     if (keep_bits() > 0)
+	  round_bits(w->out, w->n, keep_bits());
+     write_nc(var, w->out, w->records++, 1);
+
+     if (var == 0) {
+	  if (n_rec == max_rec) {
+	       max_rec = max_rec > 0 ? 2 * max_rec : 64;
+	       rec_t = realloc(rec_t, sizeof(int) * max_rec);
+	       rec_bnds = realloc(rec_bnds, 2 * sizeof(int) * max_rec);
+	  }
+	  window_bounds(w, &lo, &hi);
+	  rec_bnds[2 * n_rec] = lo;
+	  rec_bnds[2 * n_rec + 1] = hi;
+	  rec_t[n_rec++] = lo + (hi - lo) / 2;
+     }
+     w->first = -1;
+}
+
+/* add nsteps consecutive timesteps of variable var, starting at step,
+ * to their windows, writing each window out when the next begins */
+void reduce_nc (int var, const float *buf, int step, int nsteps)
+{
+     window_t *w = &windows[var];
+
+     for (int s = 0; s < nsteps; ++s, buf += w->n) {
+	  const long key = window_key(step + s);
+	  if (w->first >= 0 && key != w->key)
+	       emit(var);
+	  if (w->first < 0) {
+	       w->key = key;
+	       w->first = step + s;
+	       for (size_t i = 0; i < w->n; ++i) {
+		    w->acc[i] = 0;
+		    w->count[i] = 0;
+	       }
+	  }
+	  w->last = step + s;
+	  for (size_t i = 0; i < w->n; ++i) {
+	       const double x = buf[i];
+	       if (isnan(x))
+		    continue;
+	       if (w->count[i] == 0 || reduce() == REDUCE_MEAN ||
+		   reduce() == REDUCE_SUM)
+		    w->acc[i] = w->count[i] == 0 ? x : w->acc[i] + x;
+	       else if (reduce() == REDUCE_MIN ? x < w->acc[i] :
+			x > w->acc[i])
+		    w->acc[i] = x;
+	       ++w->count[i];
+	  }
+     }
+}
+
+/* write the windows still open; return the number of records, with
+ * their time coordinate and bounds in *vals_t and *bnds_t */
+int finish_reduce (int **vals_t, int **bnds_t)
+{
+     for (int v = 0; v < n_windows; ++v) {
+	  if (windows[v].first >= 0)
+	       emit(v);
+	  pool_free(windows[v].acc);
+	  pool_free(windows[v].count);
+	  pool_free(windows[v].out);
+     }
+     free(windows);
+     windows = 0;
+     *vals_t = rec_t;
+     *bnds_t = rec_bnds;
+     rec_t = rec_bnds = 0;
+     return n_rec;
+}
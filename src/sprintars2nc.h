@@ -20,59 +20,257 @@
 #ifndef sprintars2nc_include
 #define sprintars2nc_include
 
+#include <stddef.h>
 #include <time.h>
 
-typedef enum { NC2, NC4 } nc_t;
+typedef enum { NC2, NC4, ZARR } nc_t;
 typedef enum { DIM2, DIM3P, DIM3SIGMA } dim_t;
+typedef enum { ACCESS_MAP, ACCESS_PROFILE, ACCESS_SERIES } access_t;
+typedef enum { PACK_NONE, PACK_SHORT, PACK_BYTE } pack_t;
+typedef enum { IO_URING, IO_PREAD } io_t;
+typedef enum { REDUCE_NONE, REDUCE_MEAN, REDUCE_MIN, REDUCE_MAX,
+	       REDUCE_SUM } reduce_t;
+enum { WINDOW_DAILY = -1, WINDOW_MONTHLY = -2 };
+
+/* one input file and the output variable it becomes */
+struct gtool;
+typedef struct {
+     char fname[1024];
+     char name[1024];
+     char units[1024];
+     int kdim;			/* 1 for 2D fields, else number of levels */
+     int out_kdim;		/* levels written (see --to-pressure) */
+     float scale, offset;	/* --pack parameters, see quant.c */
+     char item[1024];		/* ITEM it is in a multi-item file, or "" */
+     struct gtool *in;
+} var_t;
 
 /* prototype for processing arguments, opts.c */
 void opts (int argc, char *argv[],
-	   char *in_fname, char *out_fname,
+	   var_t **vars, int *n_vars, char *out_fname,
 	   char lonfile[1024], char latfile[1024],
 	   char pfile[1024], char tfile[1024],
 	   time_t *t0, int *tstep,
-	   char varname[1024], char varunits[1024],
 	   dim_t *,
 	   nc_t *format, int *compress, int *progress, int *clobber);
 int verbose();
+int threads();
+int write_batch();
+const size_t *chunks();
+size_t chunk_cache();
+access_t access_pattern();
+int shuffle();
+int compress_threads();
+size_t tstart();
+size_t tend();
+size_t tstride();
+int save_index();
+int unlimited();
+time_t strtotime(const char *);
+const char *stats_file();
+const char *plev_file();
+int transpose();
+size_t transpose_memory();
+size_t max_memory();
+int read_ahead();
+io_t io_backend();
+int direct_io();
+const char *ps_file();
+const double *lon_range();
+const double *lat_range();
+const double *levels();
+pack_t pack();
+int keep_bits();
+reduce_t reduce();
+int window();
+const char *manifest();
+int jobs();
+int parse_files (int n_args, char *args[],
+		 var_t **vars, int *n_vars, char *out_fname);
 
 /* prototype functions for generating dimensions/dimvars, dims.c */
 void read_table (const char *fname, float **vals, int *n);
 
-/* prototypes for fortran subroutines that read the fortran data,
- * read_gtool.f90 */
-void open_sprintars (const char *, int *err); 
-void read_sprintars_tstep_3d (float *,
-			      const int *idim, const int *jdim, const int *kdim,
-			      int *eof, int *err);
-void read_sprintars_tstep_2d (float *,
-			      const int *idim, const int *jdim,
-			      int *eof, int *err);
+/* native reader for the SPRINTARS (GTOOL) input, gtool.c */
+#define GTOOL_HEAD_LEN 1024	/* length of the header record */
+#define GTOOL_FIELD_LEN 16	/* of its 64 ASCII fields */
+/* what a GTOOL header says about its timestep (see head_sprintars) */
+typedef struct {
+     char item[GTOOL_FIELD_LEN + 1];	/* ITEM: variable name */
+     char unit[GTOOL_FIELD_LEN + 1];	/* UNIT */
+     char dfmt[GTOOL_FIELD_LEN + 1];	/* DFMT: data format, e.g. UR4 */
+     char aitm[3][GTOOL_FIELD_LEN + 1];	/* AITM1-3: axis names */
+     int size[3];		/* AEND - ASTR + 1 of each axis, or 0 */
+     time_t date;		/* DATE (UTC), or -1 */
+     long tdur;			/* TDUR in seconds, or 0 */
+} gtool_head_t;
+typedef struct {
+     int i0, ni;		/* columns, wrapping around past the last */
+     int j0, nj;		/* rows */
+     int k0, nk;		/* levels */
+} box_t;
+typedef struct gtool {
+     int fd;
+     const unsigned char *map;	/* read-only mapping of the input file */
+     size_t size;		/* size of the input file */
+     long long mtime;		/* and its modification time, in ns */
+     size_t pos;		/* offset of the next record */
+     size_t *index;		/* offset of each timestep, or 0 */
+     size_t n_index;
+     size_t first, last, stride;	/* selected timesteps */
+     size_t next;		/* selected timesteps read so far */
+     int stream;		/* pipe or stdin, read front to back */
+     unsigned char *buf;	/* last record read from a stream */
+     size_t buf_len;
+     size_t peeked;		/* length of a timestep in buf not yet
+				 * read, or 0 */
+     size_t t;			/* timesteps taken from the stream */
+     int boxed;			/* cut out box of the full field? */
+     int n_lon, n_lat, n_lvl;
+     box_t box;
+     struct aio *aio;		/* reads in flight (aio.c), or 0 */
+     gtool_head_t head[2];	/* headers of the first two timesteps */
+     int n_head;		/* how many of them there are, or -1 */
+     char item[GTOOL_FIELD_LEN + 1];	/* only records of this ITEM, or
+					 * all if "" */
+} gtool_t;
+gtool_t *open_sprintars (const char *, int *err);
+const void *read_sprintars_tstep (gtool_t *, int n, int *eof, int *err);
+size_t peek_sprintars (gtool_t *);
+size_t count_sprintars (gtool_t *);
+size_t records_sprintars (gtool_t *);
+const gtool_head_t *head_sprintars (gtool_t *, int k);
+int items_sprintars (gtool_t *, char items[][GTOOL_FIELD_LEN + 1], int max);
+void item_sprintars (gtool_t *, const char *item);
+void rewind_sprintars (gtool_t *);
+int select_sprintars (gtool_t *, const char *fname,
+		      size_t first, size_t last, size_t stride, int save);
+void box_sprintars (gtool_t *, int n_lon, int n_lat, int n_lvl,
+		    const box_t *);
+const void *cut_sprintars (gtool_t *, const void *data, void *buf);
+int pread_sprintars (gtool_t *, size_t k, int n, void *buf, int *eof);
+void close_sprintars (gtool_t *);
+
+/* asynchronous read-ahead (--read-ahead), aio.c */
+int aio_open (gtool_t *, size_t n, int depth, int direct, io_t);
+const void *aio_tstep (gtool_t *, int *eof, int *err);
+void aio_rewind (gtool_t *);
+void aio_close (gtool_t *);
+
+/* big-endian to native float decoding, swap.c */
+void init_decode ();
+void decode_be_float (float *, const void *, size_t n);
+
+/* lossy rounding and packing of the output, quant.c */
+float round_bits(float *, size_t n, int keep);
+void pack_params(gtool_t *, size_t n, pack_t, float *scale, float *offset);
+void pack_field(void *dst, const float *src, size_t n, pack_t,
+		float scale, float offset);
+float pack_error(const float *, size_t n, pack_t, float scale, float offset);
 
 /* prototypes for NetCDF output functions, nc.c */
 void open_nc(const char *, nc_t format, int clobber,
 	     int compress,
 	     dim_t dimension,
-	     int n_lon, int n_lat, int n_p, 
+	     int n_lon, int n_lat, int n_p, int n_t,
 	     // float *vals_lon, float *vals_lat, float *vals_p,
-	     const char *varname, const char *varunits);
+	     int n_vars, const var_t *vars);
 void close_nc(dim_t dimension,
 	      int n_lon, int n_lat, int n_p, int n_t,
 	      float *vals_lon, float *vals_lat, float *vals_p,
-	      int *vals_t);
-void write_nc(float *, int step);
+	      int *vals_t, int *bnds_t);
+void write_nc(int var, float *, int step, int nsteps);
+void part_nc(int first);
+void batch_nc(int nsteps);
+void chunk_shape(int kdim, int n_lon, int n_lat, int n_p, size_t chunks[4]);
+
+/* parallel chunk compression with direct chunk writes, direct.c */
+void direct_open(const char *fname, const char *varname,
+		 int ndims, const size_t *shape, const size_t *chunks,
+		 int shuffle, int compress, int threads);
+void direct_write(const float *, int step, int nsteps);
+void direct_close();
+
+/* Zarr v2 directory store output (-f zarr), zarr.c */
+void zarr_open(const char *store, int clobber, int compress,
+	       dim_t dimension, int n_lon, int n_lat, int n_p,
+	       int n_vars, const var_t *vars);
+void zarr_write(int var, const float *, int step, int nsteps);
+size_t zarr_bytes(int var);
+void zarr_close(int n_lon, int n_lat, int n_p, int n_t,
+		float *vals_lon, float *vals_lat, float *vals_p,
+		int *vals_t, int *bnds_t);
 
 /* simple diagnostics while we wait for the conversion to complete,
  * diag.c */
 typedef struct {
      int tstep;
-     float val_min, val_max, val_mean;
+     float val_min, val_max, val_mean, val_std;
+     size_t n_nan;
+     float err_max;		/* largest error of --keep-bits/--pack */
 } diag_t;
 diag_t *init_diag (diag_t *);
 void display_diag (const diag_t *);
 
+/* decoding with the diagnostics computed on the way, swap.c */
+void decode_be_float_diag (float *, const void *, size_t n, diag_t *);
+
+/* per-stage timers and byte counters (--stats), stats.c */
+typedef enum { STAGE_READ, STAGE_DECODE, STAGE_INTERP, STAGE_QUANTIZE,
+	       STAGE_WAIT, STAGE_WRITE, STAGE_COMPRESS, STAGE_CHUNK_WRITE,
+	       N_STAGES } stage_t;
+double stats_clock ();
+void init_stats (size_t bytes_expected);
+void stats_add (stage_t, double start, size_t bytes);
+void stats_progress (double *rate, double *eta);
+void write_stats (const char *fname, const char *out_fname);
+
+/* time coordinate of converted timestep i, main.c */
+long time_of_step (size_t i);
+int has_time_of_step (size_t i);
+
+/* out-of-core transpose to time series chunks (--transpose),
+ * transpose.c */
+void transpose_var (int var, const size_t *shape, const size_t *tile);
+void transpose_write (int var, const float *buf, int step, int nsteps);
+void transpose_close (void (*put)(int var, const size_t *start,
+				  const size_t *count, float *buf));
+
+/* buffers under the --max-memory limit, pool.c */
+void init_pool (size_t bytes);
+size_t pool_left ();
+void *pool_alloc (size_t bytes, const char *what);
+void pool_free (void *);
+void pool_report ();
+
+/* splitting a conversion across MPI ranks, mpi.c */
+void init_mpi (int *argc, char ***argv);
+void finish_mpi ();
+int mpi_rank ();
+int mpi_size ();
+void mpi_barrier ();
+long mpi_sum (long);
+long mpi_max (long);
+void mpi_range (double *lo, double *hi);
+void mpi_part (size_t n, size_t *first, size_t *last);
+
+/* sigma to pressure interpolation (--to-pressure), vinterp.c */
+void init_vinterp (gtool_t *ps, const float *sigma, int n_sigma,
+		   const float *plev, int n_plev, size_t n_field);
+void vinterp (float *dst, const float *src, size_t t, float *ps);
+
+/* temporal reduction of the output (--reduce, --window), reduce.c */
+void init_reduce (int n_vars, const var_t *vars, size_t n_field);
+void reduce_nc (int var, const float *buf, int step, int nsteps);
+int finish_reduce (int **vals_t, int **bnds_t);
+
 /* functions to perform conversion, convert.c */
-int init_convert(int, int, int);
+int init_convert(int n_vars, const var_t *, int, int);
 int convert_tstep(diag_t *);
 
+/* batch conversion of the jobs listed in a manifest, batch.c */
+int run_manifest (const char *fname,
+		  void (*convert)(int n_vars, var_t *vars,
+				  const char *out_fname));
+
 #endif 
@@ -0,0 +1,162 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Per-stage timers and byte counters (--stats).  Every stage of the
+ * conversion notes how long each call took and how many bytes it
+ * handled; the counters are updated with atomic adds, so the reader
+ * and decoder threads can share them without a lock, and a call costs
+ * two clock reads.  Latencies also go into a histogram with one bucket
+ * per power of two microseconds.  Without --threads the input is
+ * decoded straight from the mapping, so "read" is only the walk over
+ * the record markers and the disk time shows up in "decode". */
+
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sprintars2nc.h"
+
+/* latency buckets: bucket b counts calls that took less than 2^b
+ * microseconds (and at least 2^(b-1)), except that the last one is
+ * open-ended and counts all calls of 2^(N_BUCKETS-2) or more */
+#define N_BUCKETS 32
+
+typedef struct {
+     unsigned long long calls, bytes, ns, max_ns;
+     unsigned long long hist[N_BUCKETS];
+} counter_t;
+
+static const char *stage_names[N_STAGES] = {
+     "read", "decode", "interp", "quantize", "wait", "write",
+     "compress", "chunk_write"
+};
+static counter_t counters[N_STAGES];
+static double t_start;
+static size_t expected;
+
+/* monotonic time in seconds */
+double stats_clock ()
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* clear the counters; the conversion is going to read bytes_expected
+ * bytes of input */
+void init_stats (size_t bytes_expected)
+{
+     memset(counters, 0, sizeof(counters));
+     expected = bytes_expected;
+     t_start = stats_clock();
+}
+
+/* note a call to stage that started at start and handled bytes */
+void stats_add (stage_t stage, double start, size_t bytes)
+{
+     counter_t *c = &counters[stage];
+     const double dt = stats_clock() - start;
+     const unsigned long long ns = dt > 0 ? dt * 1e9 : 0;
+     unsigned long long max;
+     int b = 0;
+
+     while (b < N_BUCKETS - 1 && ns >= 1000ULL << b)
+	  b++;
+     __sync_fetch_and_add(&c->calls, 1);
+     __sync_fetch_and_add(&c->bytes, bytes);
+     __sync_fetch_and_add(&c->ns, ns);
+     __sync_fetch_and_add(&c->hist[b], 1);
+     while ((max = c->max_ns) < ns &&
+	    !__sync_bool_compare_and_swap(&c->max_ns, max, ns))
+	  ;
+}
+
+/* input read so far in MB/s, and seconds until all of it is read (-1
+ * if there is no telling yet) */
+void stats_progress (double *rate, double *eta)
+{
+     const double dt = stats_clock() - t_start;
+     const double done = counters[STAGE_READ].bytes;
+
+     *rate = dt > 0 ? done / 1e6 / dt : 0;
+     *eta = -1;
+     if (expected == 0 || done == 0)
+	  return;
+     *eta = expected > done ? (expected - done) / (done / dt) : 0;
+}
+
+/* append the counters of the conversion into out_fname to fname as one
+ * line of JSON */
+void write_stats (const char *fname, const char *out_fname)
+{
+     char *buf = 0;
+     size_t len = 0;
+     FILE *mem = open_memstream(&buf, &len);
+     int fd;
+
+     if (mem == 0) {
+	  perror("Writing statistics");
+	  return;
+     }
+     fprintf(mem, "{\"output\":\"");
+     for (const char *p = out_fname; *p != 0; ++p)
+	  fprintf(mem, *p == '"' || *p == '\\' ? "\\%c" : "%c", *p);
+     fprintf(mem, "\",\"seconds\":%.6f,\"bytes_expected\":%zu,"
+	     "\"stages\":[", stats_clock() - t_start, expected);
+     for (int s = 0; s < N_STAGES; ++s) {
+	  const counter_t *c = &counters[s];
+	  const double secs = c->ns * 1e-9;
+	  int first = 1;
+	  fprintf(mem, "%s{\"stage\":\"%s\",\"calls\":%llu,\"bytes\":%llu,"
+		  "\"seconds\":%.6f,\"mb_s\":%.3f,\"mean_us\":%.3f,"
+		  "\"max_us\":%.3f,\"histogram_us\":[",
+		  s > 0 ? "," : "", stage_names[s], c->calls, c->bytes, secs,
+		  secs > 0 ? c->bytes / 1e6 / secs : 0,
+		  c->calls > 0 ? c->ns * 1e-3 / c->calls : 0,
+		  c->max_ns * 1e-3);
+	  for (int b = 0; b < N_BUCKETS; ++b) {
+	       if (c->hist[b] == 0)
+		    continue;
+	       if (b == N_BUCKETS - 1)
+		    fprintf(mem, "%s{\"ge\":%llu,\"n\":%llu}",
+			    first ? "" : ",", 1ULL << (b - 1), c->hist[b]);
+	       else
+		    fprintf(mem, "%s{\"lt\":%llu,\"n\":%llu}",
+			    first ? "" : ",", 1ULL << b, c->hist[b]);
+	       first = 0;
+	  }
+	  fprintf(mem, "]}");
+     }
+     fprintf(mem, "]}\n");
+     fclose(mem);
+
+     /* with --manifest, several processes append to the same file, so
+      * write each line in one go */
+     fd = open(fname, O_WRONLY | O_APPEND | O_CREAT, 0666);
+     if (fd == -1 || write(fd, buf, len) != (ssize_t)len)
+	  perror("Writing statistics");
+     if (fd != -1)
+	  close(fd);
+     free(buf);
+}
@@ -0,0 +1,356 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Decoding of big-endian SPRINTARS floats into native floats.  This is
+ * where every byte of the input passes through the CPU, so besides the
+ * portable scalar version there are SSE2, AVX2 and AVX-512 kernels;
+ * init_decode picks the best one the CPU supports.
+ *
+ * The diagnostics come out of the same kernels: while a vector of
+ * decoded values is still in registers, we fold it into running
+ * minimum, maximum and NaN count, and into sums of x - shift and its
+ * square in double precision.  The shift is the first value of the
+ * field, which keeps the variance from cancelling away when the mean
+ * is large compared to the spread. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sprintars2nc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/* running statistics of one field */
+typedef struct {
+     float min, max;
+     double sum, sum2;		/* of x - shift */
+     size_t n_nan;
+} acc_t;
+
+/* the big-endian float at p */
+static float decode_one (const unsigned char *p)
+{
+     union { uint32_t u; float f; } v;
+     v.u = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	  (uint32_t)p[2] << 8 | (uint32_t)p[3];
+     return v.f;
+}
+
+/* portable version; correct regardless of host byte order */
+static void decode_scalar (float *dst, const void *src, size_t n)
+{
+     const unsigned char *p = src;
+     for (size_t i = 0; i < n; ++i, p += 4)
+	  dst[i] = decode_one(p);
+}
+
+static void stats_scalar (float *dst, const void *src, size_t n,
+			  double shift, acc_t *a)
+{
+     const unsigned char *p = src;
+     for (size_t i = 0; i < n; ++i, p += 4) {
+	  const float x = dst[i] = decode_one(p);
+	  double d;
+	  if (x != x) {
+	       a->n_nan++;
+	       continue;
+	  }
+	  if (x < a->min)
+	       a->min = x;
+	  if (x > a->max)
+	       a->max = x;
+	  d = x - shift;
+	  a->sum += d;
+	  a->sum2 += d * d;
+     }
+}
+
+#ifdef HAVE_X86_KERNELS
+/* SSE2 has no byte shuffle: swap the bytes within each 16-bit word
+ * with shifts, then swap the words of each 32-bit lane */
+__attribute__((target("sse2")))
+static void decode_sse2 (float *dst, const void *src, size_t n)
+{
+     const unsigned char *p = src;
+     size_t i = 0;
+     for (; i + 4 <= n; i += 4) {
+	  __m128i v = _mm_loadu_si128((const __m128i *)(p + 4 * i));
+	  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	  _mm_storeu_si128((__m128i *)(dst + i), v);
+     }
+     decode_scalar(dst + i, p + 4 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void stats_sse2 (float *dst, const void *src, size_t n,
+			double shift, acc_t *a)
+{
+     const unsigned char *p = src;
+     const __m128 shift_f = _mm_set1_ps(shift);
+     const __m128d shift_d = _mm_set1_pd(shift);
+     __m128 lo = _mm_set1_ps(a->min), hi = _mm_set1_ps(a->max);
+     __m128d sum = _mm_setzero_pd(), sum2 = _mm_setzero_pd();
+     float lo_[4], hi_[4];
+     double sum_[2], sum2_[2];
+     size_t i = 0;
+     for (; i + 4 <= n; i += 4) {
+	  __m128i v = _mm_loadu_si128((const __m128i *)(p + 4 * i));
+	  __m128 x, ord;
+	  __m128d d0, d1;
+	  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+	  x = _mm_castsi128_ps(v);
+	  _mm_storeu_ps(dst + i, x);
+	  /* min and max return their second operand for NaNs */
+	  lo = _mm_min_ps(x, lo);
+	  hi = _mm_max_ps(x, hi);
+	  ord = _mm_cmpord_ps(x, x);
+	  a->n_nan += 4 - __builtin_popcount(_mm_movemask_ps(ord));
+	  /* NaNs count as the shift, i.e. as zero */
+	  x = _mm_or_ps(_mm_and_ps(ord, x), _mm_andnot_ps(ord, shift_f));
+	  d0 = _mm_sub_pd(_mm_cvtps_pd(x), shift_d);
+	  d1 = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), shift_d);
+	  sum = _mm_add_pd(sum, _mm_add_pd(d0, d1));
+	  sum2 = _mm_add_pd(sum2, _mm_add_pd(_mm_mul_pd(d0, d0),
+					     _mm_mul_pd(d1, d1)));
+     }
+     _mm_storeu_ps(lo_, lo);
+     _mm_storeu_ps(hi_, hi);
+     _mm_storeu_pd(sum_, sum);
+     _mm_storeu_pd(sum2_, sum2);
+     for (int j = 0; j < 4; ++j) {
+	  if (lo_[j] < a->min)
+	       a->min = lo_[j];
+	  if (hi_[j] > a->max)
+	       a->max = hi_[j];
+     }
+     a->sum += sum_[0] + sum_[1];
+     a->sum2 += sum2_[0] + sum2_[1];
+     stats_scalar(dst + i, p + 4 * i, n - i, shift, a);
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2 (float *dst, const void *src, size_t n)
+{
+     const unsigned char *p = src;
+     const __m256i mask = _mm256_setr_epi8(
+	  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+	  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+     size_t i = 0;
+     for (; i + 16 <= n; i += 16) {
+	  __m256i a = _mm256_loadu_si256((const __m256i *)(p + 4 * i));
+	  __m256i b = _mm256_loadu_si256((const __m256i *)(p + 4 * i + 32));
+	  _mm256_storeu_si256((__m256i *)(dst + i),
+			      _mm256_shuffle_epi8(a, mask));
+	  _mm256_storeu_si256((__m256i *)(dst + i + 8),
+			      _mm256_shuffle_epi8(b, mask));
+     }
+     decode_scalar(dst + i, p + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void stats_avx2 (float *dst, const void *src, size_t n,
+			double shift, acc_t *a)
+{
+     const unsigned char *p = src;
+     const __m256i mask = _mm256_setr_epi8(
+	  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+	  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+     const __m256 shift_f = _mm256_set1_ps(shift);
+     const __m256d shift_d = _mm256_set1_pd(shift);
+     __m256 lo = _mm256_set1_ps(a->min), hi = _mm256_set1_ps(a->max);
+     __m256d sum = _mm256_setzero_pd(), sum2 = _mm256_setzero_pd();
+     float lo_[8], hi_[8];
+     double sum_[4], sum2_[4];
+     size_t i = 0;
+     for (; i + 8 <= n; i += 8) {
+	  __m256i v = _mm256_loadu_si256((const __m256i *)(p + 4 * i));
+	  __m256 x, ord;
+	  __m256d d0, d1;
+	  x = _mm256_castsi256_ps(_mm256_shuffle_epi8(v, mask));
+	  _mm256_storeu_ps(dst + i, x);
+	  /* min and max return their second operand for NaNs */
+	  lo = _mm256_min_ps(x, lo);
+	  hi = _mm256_max_ps(x, hi);
+	  ord = _mm256_cmp_ps(x, x, _CMP_ORD_Q);
+	  a->n_nan += 8 - __builtin_popcount(_mm256_movemask_ps(ord));
+	  /* NaNs count as the shift, i.e. as zero */
+	  x = _mm256_blendv_ps(shift_f, x, ord);
+	  d0 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)),
+			     shift_d);
+	  d1 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)),
+			     shift_d);
+	  sum = _mm256_add_pd(sum, _mm256_add_pd(d0, d1));
+	  sum2 = _mm256_add_pd(sum2, _mm256_add_pd(_mm256_mul_pd(d0, d0),
+						   _mm256_mul_pd(d1, d1)));
+     }
+     _mm256_storeu_ps(lo_, lo);
+     _mm256_storeu_ps(hi_, hi);
+     _mm256_storeu_pd(sum_, sum);
+     _mm256_storeu_pd(sum2_, sum2);
+     for (int j = 0; j < 8; ++j) {
+	  if (lo_[j] < a->min)
+	       a->min = lo_[j];
+	  if (hi_[j] > a->max)
+	       a->max = hi_[j];
+     }
+     a->sum += sum_[0] + sum_[1] + sum_[2] + sum_[3];
+     a->sum2 += sum2_[0] + sum2_[1] + sum2_[2] + sum2_[3];
+     stats_scalar(dst + i, p + 4 * i, n - i, shift, a);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void decode_avx512 (float *dst, const void *src, size_t n)
+{
+     const unsigned char *p = src;
+     const __m512i mask = _mm512_broadcast_i32x4(
+	  _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+			11, 10, 9, 8, 15, 14, 13, 12));
+     size_t i = 0;
+     for (; i + 16 <= n; i += 16) {
+	  __m512i v = _mm512_loadu_si512((const void *)(p + 4 * i));
+	  _mm512_storeu_si512((void *)(dst + i),
+			      _mm512_shuffle_epi8(v, mask));
+     }
+     decode_scalar(dst + i, p + 4 * i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void stats_avx512 (float *dst, const void *src, size_t n,
+			  double shift, acc_t *a)
+{
+     const unsigned char *p = src;
+     const __m512i mask = _mm512_broadcast_i32x4(
+	  _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+			11, 10, 9, 8, 15, 14, 13, 12));
+     const __m512 shift_f = _mm512_set1_ps(shift);
+     const __m512d shift_d = _mm512_set1_pd(shift);
+     __m512 lo = _mm512_set1_ps(a->min), hi = _mm512_set1_ps(a->max);
+     __m512d sum = _mm512_setzero_pd(), sum2 = _mm512_setzero_pd();
+     size_t i = 0;
+     for (; i + 16 <= n; i += 16) {
+	  __m512i v = _mm512_loadu_si512((const void *)(p + 4 * i));
+	  __m512 x;
+	  __m512d d0, d1;
+	  __mmask16 ord;
+	  x = _mm512_castsi512_ps(_mm512_shuffle_epi8(v, mask));
+	  _mm512_storeu_ps(dst + i, x);
+	  /* min and max return their second operand for NaNs */
+	  lo = _mm512_min_ps(x, lo);
+	  hi = _mm512_max_ps(x, hi);
+	  ord = _mm512_cmp_ps_mask(x, x, _CMP_ORD_Q);
+	  a->n_nan += 16 - __builtin_popcount(ord);
+	  /* NaNs count as the shift, i.e. as zero */
+	  x = _mm512_mask_blend_ps(ord, shift_f, x);
+	  d0 = _mm512_sub_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(x)),
+			     shift_d);
+	  d1 = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_castpd_ps(
+				   _mm512_extractf64x4_pd(
+					_mm512_castps_pd(x), 1))),
+			     shift_d);
+	  sum = _mm512_add_pd(sum, _mm512_add_pd(d0, d1));
+	  sum2 = _mm512_add_pd(sum2, _mm512_add_pd(_mm512_mul_pd(d0, d0),
+						   _mm512_mul_pd(d1, d1)));
+     }
+     if (_mm512_reduce_min_ps(lo) < a->min)
+	  a->min = _mm512_reduce_min_ps(lo);
+     if (_mm512_reduce_max_ps(hi) > a->max)
+	  a->max = _mm512_reduce_max_ps(hi);
+     a->sum += _mm512_reduce_add_pd(sum);
+     a->sum2 += _mm512_reduce_add_pd(sum2);
+     stats_scalar(dst + i, p + 4 * i, n - i, shift, a);
+}
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+/* nothing to swap on big-endian hosts */
+static void decode_copy (float *dst, const void *src, size_t n)
+{
+     memcpy(dst, src, sizeof(float) * n);
+}
+#endif
+
+static void (*decode)(float *, const void *, size_t) = decode_scalar;
+static void (*stats)(float *, const void *, size_t, double, acc_t *) =
+     stats_scalar;
+static const char *decode_name = "scalar";
+
+/* pick the fastest kernel this CPU can run; call before the first
+ * decode_be_float */
+void init_decode ()
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+     decode = decode_copy;
+     decode_name = "copy";
+#elif defined(HAVE_X86_KERNELS)
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx512bw")) {
+	  decode = decode_avx512;
+	  stats = stats_avx512;
+	  decode_name = "avx512";
+     } else if (__builtin_cpu_supports("avx2")) {
+	  decode = decode_avx2;
+	  stats = stats_avx2;
+	  decode_name = "avx2";
+     } else if (__builtin_cpu_supports("sse2")) {
+	  decode = decode_sse2;
+	  stats = stats_sse2;
+	  decode_name = "sse2";
+     }
+#endif
+     if (verbose() > 1)
+	  printf("byte-swap kernel: %s\n", decode_name);
+}
+
+/* decode n big-endian 4-byte floats at src into native floats at dst */
+void decode_be_float (float *dst, const void *src, size_t n)
+{
+     decode(dst, src, n);
+}
+
+/* decode like decode_be_float and put the minimum, maximum, mean and
+ * standard deviation of the values that are not NaN, and the number
+ * of NaNs, into diag */
+void decode_be_float_diag (float *dst, const void *src, size_t n,
+			   diag_t *diag)
+{
+     acc_t a = { INFINITY, -INFINITY, 0, 0, 0 };
+     const float first = n > 0 ? decode_one(src) : 0;
+     const double shift = isfinite(first) ? first : 0;
+     size_t m;
+     double mean, var;
+
+     stats(dst, src, n, shift, &a);
+     m = n - a.n_nan;
+     mean = m > 0 ? a.sum / m : NAN;
+     var = m > 0 ? a.sum2 / m - mean * mean : NAN;
+     diag->val_min = m > 0 ? a.min : NAN;
+     diag->val_max = m > 0 ? a.max : NAN;
+     diag->val_mean = shift + mean;
+     diag->val_std = var > 0 ? sqrt(var) : 0;
+     diag->n_nan = a.n_nan;
+}
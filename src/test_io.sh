@@ -0,0 +1,62 @@
+#!/bin/sh
+##   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+##   Copyright (C) 2016 Johannes Muelmenstaedt 
+##
+##   This program is free software: you can redistribute it and/or modify 
+##   it under the terms of the GNU General Public License as published by 
+##   the Free Software Foundation, either version 3 of the License, or 
+##   (at your option) any later version. 
+##
+##   This program is distributed in the hope that it will be useful, 
+##   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+##   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+##   GNU General Public License for more details. 
+##
+##   You should have received a copy of the GNU General Public License 
+##   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+##
+##   Bug reports and feature requests are welcome.  Contact me at
+##   johannes.muelmenstaedt@uni-leipzig.de
+
+# Tests for the inputs other than plain files (make check): a file
+# read from stdin and written into a FIFO must convert to the same
+# output as the file itself.  The time dimension is kept unlimited,
+# since a stream does not tell the number of timesteps up front.
+
+dir=${TMPDIR:-/tmp}/s2nc-check.$$
+failed=0
+trap 'rm -rf "$dir"' EXIT
+mkdir -p "$dir" || exit 1
+
+./gtoolgen -x 64 -y 32 -z 5 -t 6 -T "$dir/g" "$dir/in.gt" > /dev/null ||
+    exit 1
+convert () {
+    ./sprintars2nc --clobber --unlimited --lonfile "$dir/g.lon" \
+	--latfile "$dir/g.lat" --sigmafile "$dir/g.lvl" "$@"
+}
+convert "$dir/in.gt" "$dir/file.nc" || exit 1
+
+convert - "$dir/stdin.nc" < "$dir/in.gt"
+if cmp -s "$dir/file.nc" "$dir/stdin.nc"; then
+    echo "stdin    ok"
+else
+    echo "stdin    FAILED"
+    failed=1
+fi
+
+# the writer blocks until the converter opens the FIFO; a converter
+# that opens it twice hangs, so give up after a while
+mkfifo "$dir/fifo" || exit 1
+cat "$dir/in.gt" > "$dir/fifo" &
+timeout 60 ./sprintars2nc --clobber --unlimited --lonfile "$dir/g.lon" \
+    --latfile "$dir/g.lat" --sigmafile "$dir/g.lvl" "$dir/fifo" \
+    "$dir/fifo.nc"
+status=$?
+kill $! 2> /dev/null
+if [ $status -eq 0 ] && cmp -s "$dir/file.nc" "$dir/fifo.nc"; then
+    echo "fifo     ok"
+else
+    echo "fifo     FAILED"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,199 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Tests for swap.c (make check).  Every decode kernel the CPU can run
+ * must give exactly the bytes decode_scalar gives, for lengths around
+ * the vector widths, unaligned sources and destinations, and NaN, Inf,
+ * denormal and -0 bit patterns; nothing past the end of the output may
+ * be touched.  The fused diagnostics must give the same values, the
+ * same minimum, maximum and NaN count, and sums that differ only by
+ * the rounding of a different summation order.  swap.c is included so
+ * that its static kernels can be called one by one. */
+
+#include <float.h>
+#include <stdlib.h>
+
+#include "swap.c"
+
+/* swap.c asks opts.c how much to say */
+int verbose ()
+{
+     return 0;
+}
+
+typedef struct {
+     const char *name;
+     int supported;
+     void (*decode)(float *, const void *, size_t);
+     void (*stats)(float *, const void *, size_t, double, acc_t *);
+} kernel_t;
+
+/* longest field tested; fields go up to it in odd steps */
+#define N_MAX 1031
+/* room for the misaligned starts and the guard after the output */
+#define PAD 64
+
+static const uint32_t special[] = {
+     0x00000000, 0x80000000,	/* +0, -0 */
+     0x7f800000, 0xff800000,	/* +Inf, -Inf */
+     0x7fc00000, 0xffc00000,	/* quiet NaNs */
+     0x7f800001, 0xffbfffff,	/* signalling NaNs */
+     0x7fc12345,		/* NaN with a payload */
+     0x00000001, 0x807fffff,	/* denormals */
+     0x00800000, 0x7f7fffff,	/* smallest and largest normal */
+     0x3f800000, 0xbf800000,	/* 1, -1 */
+     0x447a0000,		/* 1000 */
+};
+#define N_SPECIAL (sizeof(special) / sizeof(special[0]))
+
+static uint32_t rnd_state = 2463534242u;
+
+static uint32_t rnd ()
+{
+     rnd_state ^= rnd_state << 13;
+     rnd_state ^= rnd_state >> 17;
+     rnd_state ^= rnd_state << 5;
+     return rnd_state;
+}
+
+/* n big-endian values at p: random bit patterns (wild) or values
+ * around 1000 like real fields, with the special ones mixed in */
+static void fill (unsigned char *p, size_t n, int wild)
+{
+     for (size_t i = 0; i < n; ++i, p += 4) {
+	  union { uint32_t u; float f; } v;
+	  const uint32_t r = rnd();
+	  if (r % 7 == 0) {
+	       v.u = special[r / 7 % N_SPECIAL];
+	  } else if (wild) {
+	       v.u = rnd();
+	  } else {
+	       v.f = 1000 + (float)(r % 100000) / 1000;
+	  }
+	  p[0] = v.u >> 24;
+	  p[1] = v.u >> 16;
+	  p[2] = v.u >> 8;
+	  p[3] = v.u;
+     }
+}
+
+/* do two sums of the same terms agree up to the rounding of the
+ * order they were added in? */
+static int same_sum (double a, double b, double bound)
+{
+     if (isnan(a) || isnan(b))
+	  return isnan(a) && isnan(b);
+     if (isinf(a) || isinf(b))
+	  return a == b;
+     return fabs(a - b) <= bound;
+}
+
+/* compare kernel k with the scalar kernels on n values at src; return
+ * the number of failures */
+static int check (const kernel_t *k, const unsigned char *src, size_t n,
+		  int dst_off)
+{
+     static float ref[N_MAX + PAD], out[N_MAX + PAD];
+     const float first = n > 0 ? decode_one(src) : 0;
+     const double shift = isfinite(first) ? first : 0;
+     acc_t a = { INFINITY, -INFINITY, 0, 0, 0 }, b = a;
+     double abs_sum = 0, abs_sum2 = 0, bound, bound2;
+     int failed = 0;
+
+     memset(ref, 0xa5, sizeof(ref));
+     memset(out, 0xa5, sizeof(out));
+     decode_scalar(ref + dst_off, src, n);
+     k->decode(out + dst_off, src, n);
+     if (memcmp(ref, out, sizeof(ref)) != 0) {
+	  fprintf(stderr, "%s: decode of %zu values differs\n", k->name, n);
+	  failed++;
+     }
+
+     memset(ref, 0xa5, sizeof(ref));
+     memset(out, 0xa5, sizeof(out));
+     stats_scalar(ref + dst_off, src, n, shift, &a);
+     k->stats(out + dst_off, src, n, shift, &b);
+     if (memcmp(ref, out, sizeof(ref)) != 0) {
+	  fprintf(stderr, "%s: decode with diagnostics of %zu values "
+		  "differs\n", k->name, n);
+	  failed++;
+     }
+     for (size_t i = 0; i < n; ++i) {
+	  const double d = ref[dst_off + i] - shift;
+	  if (d == d) {
+	       abs_sum += fabs(d);
+	       abs_sum2 += d * d;
+	  }
+     }
+     bound = 2 * n * DBL_EPSILON * abs_sum;
+     bound2 = 2 * n * DBL_EPSILON * abs_sum2;
+     /* -0 and +0 are equally good minima, so compare values */
+     if (a.min != b.min || a.max != b.max || a.n_nan != b.n_nan ||
+	 !same_sum(a.sum, b.sum, bound) ||
+	 !same_sum(a.sum2, b.sum2, bound2)) {
+	  fprintf(stderr, "%s: diagnostics of %zu values differ: min %g "
+		  "vs %g, max %g vs %g, %zu vs %zu NaN, sum %.17g vs "
+		  "%.17g, sum2 %.17g vs %.17g\n", k->name, n, a.min, b.min,
+		  a.max, b.max, a.n_nan, b.n_nan, a.sum, b.sum, a.sum2,
+		  b.sum2);
+	  failed++;
+     }
+     return failed;
+}
+
+int main ()
+{
+     static unsigned char src[4 * (N_MAX + PAD)];
+     kernel_t kernels[4];
+     int n_kernels = 0, failed = 0;
+
+#ifdef HAVE_X86_KERNELS
+     __builtin_cpu_init();
+     kernels[n_kernels++] = (kernel_t){ "sse2",
+	  __builtin_cpu_supports("sse2"), decode_sse2, stats_sse2 };
+     kernels[n_kernels++] = (kernel_t){ "avx2",
+	  __builtin_cpu_supports("avx2"), decode_avx2, stats_avx2 };
+     kernels[n_kernels++] = (kernel_t){ "avx512",
+	  __builtin_cpu_supports("avx512bw"), decode_avx512,
+	  stats_avx512 };
+#endif
+     for (int i = 0; i < n_kernels; ++i) {
+	  const kernel_t *k = &kernels[i];
+	  int cases = 0, failed_k = 0;
+	  if (!k->supported) {
+	       printf("%-8s skipped (not supported by this CPU)\n", k->name);
+	       continue;
+	  }
+	  for (int wild = 0; wild < 2; ++wild) {
+	       for (size_t n = 0; n <= N_MAX; n += n < 80 ? 1 : 37) {
+		    for (int src_off = 0; src_off < 8; ++src_off) {
+			 fill(src + src_off, n, wild);
+			 failed_k += check(k, src + src_off, n, src_off % 4);
+			 cases++;
+		    }
+	       }
+	  }
+	  printf("%-8s %s (%d cases)\n", k->name,
+		 failed_k == 0 ? "ok" : "FAILED", cases);
+	  failed += failed_k;
+     }
+     if (n_kernels == 0)
+	  printf("no vector kernels on this architecture\n");
+     return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,279 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Out-of-core transpose for time series output (--transpose).  With
+ * chunks that span many timesteps over a small horizontal tile, a point
+ * time series is one chunk read, but writing such a file one timestep
+ * at a time touches every chunk for every timestep.  So instead of
+ * writing the timesteps as they come, we collect them in blocks of as
+ * many timesteps as fit half of --transpose-memory, sorted tile by
+ * tile, and spill each full block to an unlinked temporary file in
+ * $TMPDIR.  Once the input has ended, each tile's timesteps are
+ * contiguous within every block, so one pread per block brings back a
+ * tile's whole time series (in spans that fit the other half of the
+ * memory), and each chunk is written exactly once.  If the input fits
+ * in one block, nothing is spilled. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sprintars2nc.h"
+
+typedef struct {
+     size_t shape[3], tile[3];	/* (lvl, lat, lon) */
+     size_t n_tiles[3];
+     size_t *prefix;		/* values in the tiles before each tile */
+     size_t field;		/* values per timestep */
+     float *block;		/* current block, tile by tile */
+     int fill;			/* timesteps in it */
+     int blocks;		/* blocks spilled before it */
+     int fd;			/* spill file, or -1 */
+} tvar_t;
+
+static tvar_t *tvars = 0;
+static int n_tvars = 0;
+
+/* timesteps per block, the same for every variable */
+static int block_len = 0;
+
+/* --transpose-memory, or by default 1 GiB or whatever --max-memory
+ * leaves */
+static size_t memory = 0;
+#define TRANSPOSE_MEMORY ((size_t)1 << 30)
+
+static size_t tiles (const tvar_t *tv)
+{
+     return tv->n_tiles[0] * tv->n_tiles[1] * tv->n_tiles[2];
+}
+
+/* origin and extent of tile c */
+static void tile_box (const tvar_t *tv, size_t c, size_t o[3], size_t e[3])
+{
+     const size_t i[3] = {
+	  c / (tv->n_tiles[1] * tv->n_tiles[2]),
+	  c / tv->n_tiles[2] % tv->n_tiles[1],
+	  c % tv->n_tiles[2]
+     };
+     for (int d = 0; d < 3; ++d) {
+	  o[d] = i[d] * tv->tile[d];
+	  e[d] = o[d] + tv->tile[d] <= tv->shape[d] ?
+	       tv->tile[d] : tv->shape[d] - o[d];
+     }
+}
+
+/* variable var has the given shape and is chunked in the given tiles,
+ * both as (lvl, lat, lon) */
+void transpose_var (int var, const size_t *shape, const size_t *tile)
+{
+     tvar_t *tv;
+     size_t o[3], e[3];
+
+     if (var >= n_tvars) {
+	  tvars = realloc(tvars, sizeof(tvar_t) * (var + 1));
+	  n_tvars = var + 1;
+     }
+     tv = &tvars[var];
+     memset(tv, 0, sizeof(tvar_t));
+     memcpy(tv->shape, shape, sizeof(tv->shape));
+     memcpy(tv->tile, tile, sizeof(tv->tile));
+     for (int d = 0; d < 3; ++d)
+	  tv->n_tiles[d] = (shape[d] + tile[d] - 1) / tile[d];
+     tv->field = shape[0] * shape[1] * shape[2];
+     tv->prefix = malloc(sizeof(size_t) * (tiles(tv) + 1));
+     tv->prefix[0] = 0;
+     for (size_t c = 0; c < tiles(tv); ++c) {
+	  tile_box(tv, c, o, e);
+	  tv->prefix[c + 1] = tv->prefix[c] + e[0] * e[1] * e[2];
+     }
+     tv->fd = -1;
+     block_len = 0;
+}
+
+/* split the memory between the blocks of all variables */
+static void init_blocks ()
+{
+     size_t bytes = 0;
+
+     memory = transpose_memory();
+     if (memory == 0)
+	  memory = max_memory() > 0 ? pool_left() : TRANSPOSE_MEMORY;
+     for (int v = 0; v < n_tvars; ++v)
+	  bytes += sizeof(float) * tvars[v].field;
+     block_len = memory / 2 / bytes;
+     if (block_len < 1)
+	  block_len = 1;
+     for (int v = 0; v < n_tvars; ++v)
+	  tvars[v].block = pool_alloc(sizeof(float) * tvars[v].field *
+				      block_len, "the transpose blocks");
+     if (verbose())
+	  printf("transpose: %d timestep(s) per block\n", block_len);
+}
+
+/* write the full block of tv to its spill file */
+static void spill (tvar_t *tv)
+{
+     const size_t len = sizeof(float) * tv->field * block_len;
+     const off_t pos = (off_t)len * tv->blocks;
+     size_t done = 0;
+
+     if (tv->fd == -1) {
+	  const char *dir = getenv("TMPDIR");
+	  char fname[1024];
+	  snprintf(fname, sizeof(fname), "%s/sprintars2nc-XXXXXX",
+		   dir != 0 && strlen(dir) > 0 ? dir : "/tmp");
+	  tv->fd = mkstemp(fname);
+	  if (tv->fd == -1) {
+	       perror("Creating transpose spill file");
+	       exit(1);
+	  }
+	  unlink(fname);
+     }
+     while (done < len) {
+	  ssize_t w = pwrite(tv->fd, (char *)tv->block + done, len - done,
+			     pos + done);
+	  if (w < 0 && errno == EINTR)
+	       continue;
+	  if (w <= 0) {
+	       perror("Writing transpose spill file");
+	       exit(1);
+	  }
+	  done += w;
+     }
+     tv->blocks++;
+     tv->fill = 0;
+}
+
+/* collect nsteps consecutive timesteps of variable var; the steps
+ * arrive in order */
+void transpose_write (int var, const float *buf, int step, int nsteps)
+{
+     tvar_t *tv = &tvars[var];
+     size_t o[3], e[3];
+
+     if (block_len == 0)
+	  init_blocks();
+     if (step != tv->blocks * block_len + tv->fill) {
+	  fprintf(stderr, "transposed writes must be in order "
+		  "(got step %d)\n", step);
+	  exit(2);
+     }
+     for (int s = 0; s < nsteps; ++s, buf += tv->field) {
+	  /* spill a full block only once more timesteps come, so that
+	   * the last one always stays in memory */
+	  if (tv->fill == block_len)
+	       spill(tv);
+	  for (size_t c = 0; c < tiles(tv); ++c) {
+	       const size_t pts = tv->prefix[c + 1] - tv->prefix[c];
+	       float *dst = tv->block + block_len * tv->prefix[c] +
+		    tv->fill * pts;
+	       tile_box(tv, c, o, e);
+	       for (size_t k = 0; k < e[0]; ++k)
+		    for (size_t y = 0; y < e[1]; ++y, dst += e[2])
+			 memcpy(dst, buf + ((o[0] + k) * tv->shape[1] +
+					    o[1] + y) * tv->shape[2] + o[2],
+				sizeof(float) * e[2]);
+	  }
+	  tv->fill++;
+     }
+}
+
+/* read len bytes at pos of the spill file of tv into buf */
+static void unspill (const tvar_t *tv, void *buf, size_t len, off_t pos)
+{
+     size_t done = 0;
+
+     while (done < len) {
+	  ssize_t r = pread(tv->fd, (char *)buf + done, len - done,
+			    pos + done);
+	  if (r < 0 && errno == EINTR)
+	       continue;
+	  if (r <= 0) {
+	       perror("Reading transpose spill file");
+	       exit(1);
+	  }
+	  done += r;
+     }
+}
+
+/* hand every tile of every variable to put, as (time, lvl, lat, lon)
+ * start and count, with as many timesteps at once as fit half of the
+ * memory, and free everything */
+void transpose_close (void (*put)(int var, const size_t *start,
+				  const size_t *count, float *buf))
+{
+     for (int v = 0; v < n_tvars; ++v) {
+	  tvar_t *tv = &tvars[v];
+	  const int n_t = tv->blocks * block_len + tv->fill;
+	  size_t o[3], e[3], max_pts = 0;
+	  float *buf;
+	  int span;
+
+	  for (size_t c = 0; block_len > 0 && c < tiles(tv); ++c)
+	       if (tv->prefix[c + 1] - tv->prefix[c] > max_pts)
+		    max_pts = tv->prefix[c + 1] - tv->prefix[c];
+	  span = max_pts > 0 ? memory / 2 / (sizeof(float) * max_pts) : 1;
+	  if (span < 1)
+	       span = 1;
+	  if (span > n_t)
+	       span = n_t > 0 ? n_t : 1;
+	  buf = pool_alloc(sizeof(float) * max_pts * span,
+			   "the transpose tiles");
+	  for (size_t c = 0; c < tiles(tv); ++c) {
+	       const size_t pts = tv->prefix[c + 1] - tv->prefix[c];
+	       tile_box(tv, c, o, e);
+	       for (int t0 = 0; t0 < n_t; t0 += span) {
+		    const int len = t0 + span <= n_t ? span : n_t - t0;
+		    const size_t start[4] = { t0, o[0], o[1], o[2] };
+		    const size_t count[4] = { len, e[0], e[1], e[2] };
+		    /* the timesteps of the tile are contiguous within
+		     * each block */
+		    for (int t = t0; t < t0 + len; ) {
+			 const int b = t / block_len, s = t % block_len;
+			 const int run = block_len - s < t0 + len - t ?
+			      block_len - s : t0 + len - t;
+			 const size_t at = block_len * tv->prefix[c] +
+			      s * pts;
+			 if (b < tv->blocks)
+			      unspill(tv, buf + (t - t0) * pts,
+				      sizeof(float) * pts * run,
+				      ((off_t)b * block_len * tv->field + at) *
+				      sizeof(float));
+			 else
+			      memcpy(buf + (t - t0) * pts, tv->block + at,
+				     sizeof(float) * pts * run);
+			 t += run;
+		    }
+		    put(v, start, count, buf);
+	       }
+	  }
+	  pool_free(buf);
+	  if (tv->fd != -1)
+	       close(tv->fd);
+	  pool_free(tv->block);
+	  free(tv->prefix);
+     }
+     free(tvars);
+     tvars = 0;
+     n_tvars = 0;
+     block_len = 0;
+}
@@ -0,0 +1,210 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Interpolation from sigma to pressure levels (--to-pressure, --ps).
+ * Sigma levels sit at p = sigma * ps, so with the surface pressure of a
+ * timestep at hand every column can be interpolated to fixed pressure
+ * levels as it streams through the conversion, instead of in a second
+ * pass over the output.  We interpolate linearly in ln p, which, for a
+ * target level P, means finding ln(P / ps) among the ln sigma of the
+ * column.  Those are the same for every column, so the search is a
+ * branchless bisection over one small table, which the AVX2 kernel
+ * does for eight columns at a time with gathers.  Target levels below
+ * the lowest or above the highest sigma level of a column are missing
+ * (NaN); we do not extrapolate. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sprintars2nc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static gtool_t *ps_in = 0;
+static size_t n_field;
+
+/* s * ln sigma, ascending, and the reciprocal of the steps between;
+ * s is -1 if the sigma table runs from the surface up */
+static int n_sig, top_bit;
+static float *key, *inv_step;
+static float sign;
+
+/* ln of the target levels, relative to 1000 hPa so that the
+ * differences we take keep their precision in single precision */
+static int n_plev;
+static float *ln_plev;
+static const double p_ref = 100000;
+
+/* use the AVX2 kernel? */
+static int avx2 = 0;
+
+
+void init_vinterp (gtool_t *ps, const float *sigma, int n_sigma,
+		   const float *plev, int n_plev_, size_t n_field_)
+{
+     ps_in = ps;
+     n_field = n_field_;
+     n_sig = n_sigma;
+     n_plev = n_plev_;
+     if (n_sig < 2) {
+	  fprintf(stderr, "--to-pressure needs at least two sigma levels\n");
+	  exit(1);
+     }
+     sign = sigma[n_sig - 1] > sigma[0] ? 1 : -1;
+     key = malloc(sizeof(float) * n_sig);
+     inv_step = malloc(sizeof(float) * n_sig);
+     ln_plev = malloc(sizeof(float) * n_plev);
+     for (int k = 0; k < n_sig; ++k) {
+	  if (!(sigma[k] > 0)) {
+	       fprintf(stderr, "sigma level %d is %g, expected > 0\n",
+		       k, sigma[k]);
+	       exit(1);
+	  }
+	  key[k] = sign * logf(sigma[k]);
+	  if (k > 0 && !(key[k] > key[k - 1])) {
+	       fprintf(stderr, "sigma levels must be strictly monotonic "
+		       "for --to-pressure\n");
+	       exit(1);
+	  }
+     }
+     for (int k = 0; k + 1 < n_sig; ++k)
+	  inv_step[k] = 1 / (key[k + 1] - key[k]);
+     for (top_bit = 1; 2 * top_bit <= n_sig - 2; top_bit *= 2)
+	  ;
+     for (int j = 0; j < n_plev; ++j) {
+	  if (!(plev[j] > 0)) {
+	       fprintf(stderr, "pressure level %d is %g, expected > 0\n",
+		       j, plev[j]);
+	       exit(1);
+	  }
+	  ln_plev[j] = log(plev[j] / p_ref);
+     }
+#ifdef HAVE_X86_KERNELS
+     /* the gathers index the field with 32-bit offsets */
+     __builtin_cpu_init();
+     avx2 = __builtin_cpu_supports("avx2") &&
+	  (double)n_field * n_sig < INT32_MAX;
+#endif
+     if (verbose() > 1)
+	  printf("vertical interpolation kernel: %s\n",
+		 avx2 ? "avx2" : "scalar");
+}
+
+/* interpolate columns i0 to n of src (n_sig levels) to target level j
+ * in dst; lnps holds ln of the surface pressure, relative to p_ref */
+static void interp_scalar (float *dst, const float *src, const float *lnps,
+			   int j, size_t i0, size_t n)
+{
+     for (size_t i = i0; i < n; ++i) {
+	  const float x = sign * (ln_plev[j] - lnps[i]);
+	  float w;
+	  int k = 0;
+	  for (int b = top_bit; b > 0; b /= 2)
+	       if (k + b <= n_sig - 2 && key[k + b] <= x)
+		    k += b;
+	  w = (x - key[k]) * inv_step[k];
+	  if (x >= key[0] && x <= key[n_sig - 1])
+	       dst[i] = src[k * n_field + i] +
+		    w * (src[(k + 1) * n_field + i] - src[k * n_field + i]);
+	  else
+	       dst[i] = NAN;
+     }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static void interp_avx2 (float *dst, const float *src, const float *lnps,
+			 int j, size_t n)
+{
+     const __m256 s = _mm256_set1_ps(sign);
+     const __m256 lnp = _mm256_set1_ps(ln_plev[j]);
+     const __m256 lo = _mm256_set1_ps(key[0]);
+     const __m256 hi = _mm256_set1_ps(key[n_sig - 1]);
+     const __m256 nan = _mm256_set1_ps(NAN);
+     const __m256i last = _mm256_set1_epi32(n_sig - 2);
+     const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+     const __m256i stride = _mm256_set1_epi32((int)n_field);
+     size_t i = 0;
+
+     for (; i + 8 <= n; i += 8) {
+	  const __m256 x = _mm256_mul_ps(s, _mm256_sub_ps(
+						 lnp, _mm256_loadu_ps(lnps + i)));
+	  __m256i k = _mm256_setzero_si256(), at;
+	  __m256 w, a, b;
+	  for (int bit = top_bit; bit > 0; bit /= 2) {
+	       /* step up where k + bit is a level and still below x */
+	       const __m256i kb = _mm256_add_epi32(k, _mm256_set1_epi32(bit));
+	       const __m256i ok = _mm256_andnot_si256(
+		    _mm256_cmpgt_epi32(kb, last),
+		    _mm256_castps_si256(_mm256_cmp_ps(
+			 _mm256_i32gather_ps(key, _mm256_min_epi32(kb, last),
+					     4), x, _CMP_LE_OQ)));
+	       k = _mm256_blendv_epi8(k, kb, ok);
+	  }
+	  w = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_i32gather_ps(key, k, 4)),
+			    _mm256_i32gather_ps(inv_step, k, 4));
+	  at = _mm256_add_epi32(_mm256_mullo_epi32(k, stride), lane);
+	  a = _mm256_i32gather_ps(src + i, at, 4);
+	  b = _mm256_i32gather_ps(src + i + n_field, at, 4);
+	  a = _mm256_add_ps(a, _mm256_mul_ps(w, _mm256_sub_ps(b, a)));
+	  /* outside the column, or no surface pressure: missing */
+	  a = _mm256_blendv_ps(nan, a, _mm256_and_ps(
+				    _mm256_cmp_ps(x, lo, _CMP_GE_OQ),
+				    _mm256_cmp_ps(x, hi, _CMP_LE_OQ)));
+	  _mm256_storeu_ps(dst + i, a);
+     }
+     interp_scalar(dst, src, lnps, j, i, n);
+}
+#endif
+
+/* interpolate the field src of timestep t (n_sig levels) to the target
+ * levels in dst; ps is scratch space for 2 * n_field floats */
+void vinterp (float *dst, const float *src, size_t t, float *ps)
+{
+     const double t0 = stats_clock();
+     int eof, err;
+
+     err = pread_sprintars(ps_in, t, n_field, ps + n_field, &eof);
+     if (err != 0 || eof) {
+	  fprintf(stderr, "Reading surface pressure of timestep %zu: %s\n",
+		  t, err != 0 ? strerror(err) : "file ends too early");
+	  exit(1);
+     }
+     decode_be_float(ps, ps + n_field, n_field);
+     /* the surface pressure is in hPa */
+     for (size_t i = 0; i < n_field; ++i)
+	  ps[i] = log(ps[i] * (100 / p_ref));
+     for (int j = 0; j < n_plev; ++j) {
+#ifdef HAVE_X86_KERNELS
+	  if (avx2) {
+	       interp_avx2(dst + j * n_field, src, ps, j, n_field);
+	       continue;
+	  }
+#endif
+	  interp_scalar(dst + j * n_field, src, ps, j, 0, n_field);
+     }
+     stats_add(STAGE_INTERP, t0, sizeof(float) * n_field * n_sig);
+}
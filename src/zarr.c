@@ -0,0 +1,719 @@
+/*   sprintars2nc converts SPRINTARS unformatted FORTRAN data to NetCDF 
+ *   Copyright (C) 2016 Johannes Muelmenstaedt 
+ 
+ *   This program is free software: you can redistribute it and/or modify 
+ *   it under the terms of the GNU General Public License as published by 
+ *   the Free Software Foundation, either version 3 of the License, or 
+ *   (at your option) any later version. 
+ 
+ *   This program is distributed in the hope that it will be useful, 
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of 
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the 
+ *   GNU General Public License for more details. 
+ 
+ *   You should have received a copy of the GNU General Public License 
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ 
+ *   Bug reports and feature requests are welcome.  Contact me at
+ *   johannes.muelmenstaedt@uni-leipzig.de */
+
+/* Zarr (v2) output (-f zarr).  Instead of one NetCDF file behind one
+ * handle, the output is a directory store: one directory per array,
+ * holding its metadata (.zarray, .zattrs) and one file per chunk, so
+ * every chunk can be compressed and written on its own.  The arrays
+ * and attributes are those open_nc/close_nc define (nc.c), with the
+ * dimension names in _ARRAY_DIMENSIONS as xarray expects them, and
+ * .zmetadata consolidates all metadata for readers on object
+ * storage.
+ *
+ * As in direct.c, the timesteps of each variable are collected in
+ * rows of chunk[0] timesteps.  A full row is handed to a pool of
+ * worker threads chunk by chunk, and the writer goes on filling the
+ * next row; each variable has a few rows, so that the workers can
+ * still be busy with earlier ones.  A worker cuts its chunk out of
+ * the row (padding where it sticks out of the array), shuffles and
+ * deflates it like the numcodecs shuffle and zlib codecs do, and
+ * writes it to <store>/<var>/<t>.<k>.<j>.<i>.  The metadata is
+ * written once all records are in. */
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sprintars2nc.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* memory for the rows of chunks, unless --max-memory leaves less */
+#define ROW_MEMORY ((size_t)1 << 30)
+
+/* timesteps of one variable, chunk[0] of them, waiting for their
+ * chunks to be written */
+typedef struct {
+     unsigned char *data;
+     int first;			/* record of the first timestep */
+     int fill;			/* timesteps in the row */
+     int pending;		/* chunks not written yet */
+} row_t;
+
+/* one output variable; 2D fields have a single level */
+typedef struct {
+     const char *name, *units;
+     int ndims;			/* 3 for 2D fields, else 4 */
+     size_t shape[4], chunk[4];	/* (time, lvl, lat, lon) */
+     size_t field;		/* values per timestep */
+     size_t n_chunks;		/* chunks per row */
+     size_t esize;		/* bytes per value */
+     row_t *rows;
+     int cur;			/* row being filled */
+     int records;		/* timesteps written so far */
+     float scale, offset;	/* --pack */
+} zvar_t;
+
+/* one chunk for the workers */
+typedef struct {
+     int var, row;
+     size_t chunk;
+} job_t;
+
+static char store[1024];
+static zvar_t *zvars = 0;
+static int n_zvars;
+static int n_rows;
+static int level, shuffle_;
+static dim_t dimension;
+static size_t max_chunk_bytes;
+
+/* queue of chunks; never longer than all rows' chunks together */
+static job_t *queue;
+static size_t n_jobs_max, job_head, job_tail;
+
+static pthread_t *workers;
+static int n_workers;
+static unsigned char **scratch;	/* per worker: chunk, shuffled, deflated */
+static int quit;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* consolidated metadata, built up as the documents are written */
+static char *consolidated = 0;
+static size_t cons_len = 0, cons_cap = 0;
+
+/* byte order of the values we write */
+static char endian ()
+{
+     const int one = 1;
+     return *(const char *)&one ? '<' : '>';
+}
+
+/* a growing string for the JSON documents */
+typedef struct {
+     char *s;
+     size_t len, cap;
+} json_t;
+
+static void jprintf (json_t *j, const char *fmt, ...)
+{
+     va_list ap;
+     int n;
+
+     while (1) {
+	  va_start(ap, fmt);
+	  n = vsnprintf(j->s + j->len, j->cap - j->len, fmt, ap);
+	  va_end(ap);
+	  if (j->len + n < j->cap)
+	       break;
+	  j->cap = 2 * (j->len + n + 256);
+	  j->s = realloc(j->s, j->cap);
+     }
+     j->len += n;
+}
+
+/* s as a JSON string */
+static void jstring (json_t *j, const char *s)
+{
+     jprintf(j, "\"");
+     for (; *s != 0; ++s) {
+	  if (*s == '"' || *s == '\\')
+	       jprintf(j, "\\%c", *s);
+	  else if ((unsigned char)*s < 0x20)
+	       jprintf(j, "\\u%04x", (unsigned char)*s);
+	  else
+	       jprintf(j, "%c", *s);
+     }
+     jprintf(j, "\"");
+}
+
+static void write_file (const char *path, const void *data, size_t len)
+{
+     const unsigned char *p = data;
+     int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+     if (fd == -1) {
+	  fprintf(stderr, "Error: cannot create %s: %s\n", path,
+		  strerror(errno));
+	  exit(2);
+     }
+     while (len > 0) {
+	  const ssize_t n = write(fd, p, len);
+	  if (n == -1 && errno == EINTR)
+	       continue;
+	  if (n == -1) {
+	       fprintf(stderr, "Error: writing %s: %s\n", path,
+		       strerror(errno));
+	       exit(2);
+	  }
+	  p += n;
+	  len -= n;
+     }
+     if (close(fd) != 0) {
+	  fprintf(stderr, "Error: writing %s: %s\n", path, strerror(errno));
+	  exit(2);
+     }
+}
+
+/* write the metadata document key (e.g. "lat/.zarray") into the store
+ * and note it for .zmetadata */
+static void put_meta (const char *key, json_t *doc)
+{
+     char path[2048];
+     json_t cons = { consolidated, cons_len, cons_cap };
+
+     snprintf(path, sizeof(path), "%s/%s", store, key);
+     write_file(path, doc->s, doc->len);
+     jprintf(&cons, "%s\n    ", cons_len > 0 ? "," : "");
+     jstring(&cons, key);
+     jprintf(&cons, ": %s", doc->s);
+     consolidated = cons.s;
+     cons_len = cons.len;
+     cons_cap = cons.cap;
+     free(doc->s);
+     memset(doc, 0, sizeof(json_t));
+}
+
+static void make_dir (const char *path)
+{
+     if (mkdir(path, 0755) != 0) {
+	  fprintf(stderr, "Error: cannot create %s: %s\n", path,
+		  strerror(errno));
+	  exit(2);
+     }
+}
+
+static int remove_entry (const char *path, const struct stat *st,
+			 int flag, struct FTW *ftw)
+{
+     return remove(path);
+}
+
+/* make room for the store; only ever remove what looks like an
+ * earlier Zarr store (or a file) */
+static void clear_store (int clobber)
+{
+     char zgroup[2048];
+     struct stat st;
+
+     if (lstat(store, &st) != 0)
+	  return;
+     if (!clobber) {
+	  fprintf(stderr, "Error: %s exists (use --clobber)\n", store);
+	  exit(2);
+     }
+     snprintf(zgroup, sizeof(zgroup), "%s/.zgroup", store);
+     if (S_ISDIR(st.st_mode) && access(zgroup, F_OK) != 0) {
+	  fprintf(stderr, "Error: %s is a directory, but not a Zarr "
+		  "store; not overwriting it\n", store);
+	  exit(2);
+     }
+     if (nftw(store, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+	  fprintf(stderr, "Error: cannot remove %s: %s\n", store,
+		  strerror(errno));
+	  exit(2);
+     }
+}
+
+/* copy chunk c of the given row into dst, zero-padding where the
+ * chunk sticks out of the variable */
+static void gather_chunk (const zvar_t *zv, const row_t *row, size_t c,
+			  unsigned char *dst)
+{
+     const size_t *shape = zv->shape, *chunk = zv->chunk;
+     const size_t n_lon = (shape[3] + chunk[3] - 1) / chunk[3];
+     const size_t n_lat = (shape[2] + chunk[2] - 1) / chunk[2];
+     const size_t x0 = c % n_lon * chunk[3];
+     const size_t y0 = c / n_lon % n_lat * chunk[2];
+     const size_t l0 = c / n_lon / n_lat * chunk[1];
+     const size_t nx = x0 + chunk[3] <= shape[3] ? chunk[3] : shape[3] - x0;
+     const size_t es = zv->esize;
+
+     memset(dst, 0, es * chunk[0] * chunk[1] * chunk[2] * chunk[3]);
+     for (size_t t = 0; t < (size_t)row->fill; ++t)
+	  for (size_t l = 0; l < chunk[1] && l0 + l < shape[1]; ++l)
+	       for (size_t y = 0; y < chunk[2] && y0 + y < shape[2]; ++y)
+		    memcpy(dst + es * (((t * chunk[1] + l) * chunk[2] + y) *
+				       chunk[3]),
+			   row->data + es * (((t * shape[1] + l0 + l) *
+					      shape[2] + y0 + y) *
+					     shape[3] + x0),
+			   es * nx);
+}
+
+/* cut out, shuffle, compress and write one chunk */
+static void write_chunk (const job_t *job, unsigned char *raw,
+			 unsigned char *tmp, unsigned char *zbuf)
+{
+     const zvar_t *zv = &zvars[job->var];
+     const row_t *row = &zv->rows[job->row];
+     const size_t *shape = zv->shape, *chunk = zv->chunk;
+     const size_t n_lon = (shape[3] + chunk[3] - 1) / chunk[3];
+     const size_t n_lat = (shape[2] + chunk[2] - 1) / chunk[2];
+     const size_t n = chunk[0] * chunk[1] * chunk[2] * chunk[3];
+     const size_t c = job->chunk;
+     const unsigned char *out = raw;
+     size_t len = n * zv->esize;
+     char path[2048];
+     double t0 = stats_clock();
+
+     gather_chunk(zv, row, c, raw);
+     if (level > 0) {
+#ifdef HAVE_ZLIB
+	  uLongf zlen = compressBound(len);
+	  if (shuffle_ && zv->esize > 1) {
+	       /* all first bytes, then all second bytes, ... */
+	       for (size_t b = 0; b < zv->esize; ++b)
+		    for (size_t i = 0; i < n; ++i)
+			 tmp[b * n + i] = raw[i * zv->esize + b];
+	       out = tmp;
+	  }
+	  if (compress2(zbuf, &zlen, out, len, level) != Z_OK) {
+	       fprintf(stderr, "Compressing chunk %zu of %s failed\n", c,
+		       zv->name);
+	       exit(2);
+	  }
+	  out = zbuf;
+	  len = zlen;
+#endif
+     }
+     stats_add(STAGE_COMPRESS, t0, n * zv->esize);
+
+     t0 = stats_clock();
+     if (zv->ndims == 3)
+	  snprintf(path, sizeof(path), "%s/%s/%d.%zu.%zu", store, zv->name,
+		   row->first / (int)chunk[0], c / n_lon % n_lat,
+		   c % n_lon);
+     else
+	  snprintf(path, sizeof(path), "%s/%s/%d.%zu.%zu.%zu", store,
+		   zv->name, row->first / (int)chunk[0],
+		   c / n_lon / n_lat, c / n_lon % n_lat, c % n_lon);
+     write_file(path, out, len);
+     stats_add(STAGE_CHUNK_WRITE, t0, len);
+}
+
+/* bytes of scratch space per worker: the chunk, and its shuffled and
+ * deflated images (deflate output can be a little larger than its
+ * input) */
+static size_t scratch_bytes ()
+{
+     return level > 0 ? 3 * max_chunk_bytes + max_chunk_bytes / 1000 + 64 :
+	  max_chunk_bytes;
+}
+
+static void *work (void *arg)
+{
+     unsigned char *raw = arg;
+     unsigned char *tmp = raw + max_chunk_bytes;
+     unsigned char *zbuf = tmp + max_chunk_bytes;
+
+     pthread_mutex_lock(&lock);
+     while (1) {
+	  job_t job;
+	  while (!quit && job_head == job_tail)
+	       pthread_cond_wait(&cond, &lock);
+	  if (job_head == job_tail)
+	       break;
+	  job = queue[job_head++ % n_jobs_max];
+	  pthread_mutex_unlock(&lock);
+
+	  write_chunk(&job, raw, tmp, zbuf);
+
+	  pthread_mutex_lock(&lock);
+	  zvars[job.var].rows[job.row].pending--;
+	  pthread_cond_broadcast(&cond);
+     }
+     pthread_mutex_unlock(&lock);
+     return 0;
+}
+
+/* hand the current row of variable v to the workers and move on to
+ * the next one, waiting until its chunks are written */
+static void submit_row (zvar_t *zv)
+{
+     const int var = zv - zvars;
+     row_t *row = &zv->rows[zv->cur];
+
+     if (row->fill == 0)
+	  return;
+     pthread_mutex_lock(&lock);
+     row->pending = zv->n_chunks;
+     for (size_t c = 0; c < zv->n_chunks; ++c) {
+	  job_t *job = &queue[job_tail++ % n_jobs_max];
+	  job->var = var;
+	  job->row = zv->cur;
+	  job->chunk = c;
+     }
+     pthread_cond_broadcast(&cond);
+     zv->cur = (zv->cur + 1) % n_rows;
+     row = &zv->rows[zv->cur];
+     while (row->pending > 0)
+	  pthread_cond_wait(&cond, &lock);
+     pthread_mutex_unlock(&lock);
+     row->first = zv->records;
+     row->fill = 0;
+}
+
+void zarr_open (const char *out_fname, int clobber, int compress,
+		dim_t dim, int n_lon, int n_lat, int n_p,
+		int n_vars, const var_t *vars)
+{
+     size_t row_bytes = 0, memory = ROW_MEMORY;
+     json_t doc = { 0, 0, 0 };
+
+#ifndef HAVE_ZLIB
+     if (compress > 0) {
+	  fprintf(stderr, "sprintars2nc was built without zlib; rebuild "
+		  "with it (see Makefile) to compress Zarr output\n");
+	  exit(1);
+     }
+#endif
+     strncpy(store, out_fname, sizeof(store) - 1);
+     clear_store(clobber);
+     make_dir(store);
+     jprintf(&doc, "{\n    \"zarr_format\": 2\n}\n");
+     put_meta(".zgroup", &doc);
+
+     level = compress;
+     shuffle_ = shuffle();
+     dimension = dim;
+     n_zvars = n_vars;
+     zvars = calloc(n_vars, sizeof(zvar_t));
+     max_chunk_bytes = 0;
+     for (int v = 0; v < n_vars; ++v) {
+	  zvar_t *zv = &zvars[v];
+	  char path[2048];
+	  size_t chunk_bytes;
+	  zv->name = vars[v].name;
+	  zv->units = vars[v].units;
+	  zv->ndims = vars[v].kdim == 1 ? 3 : 4;
+	  zv->shape[1] = vars[v].kdim == 1 ? 1 : n_p;
+	  zv->shape[2] = n_lat;
+	  zv->shape[3] = n_lon;
+	  chunk_shape(vars[v].kdim, n_lon, n_lat, n_p, zv->chunk);
+	  zv->field = zv->shape[1] * zv->shape[2] * zv->shape[3];
+	  zv->n_chunks = (zv->shape[1] + zv->chunk[1] - 1) / zv->chunk[1] *
+	       ((zv->shape[2] + zv->chunk[2] - 1) / zv->chunk[2]) *
+	       ((zv->shape[3] + zv->chunk[3] - 1) / zv->chunk[3]);
+	  zv->esize = pack() == PACK_SHORT ? 2 : pack() == PACK_BYTE ? 1 :
+	       sizeof(float);
+	  zv->scale = vars[v].scale;
+	  zv->offset = vars[v].offset;
+	  chunk_bytes = zv->esize * zv->chunk[0] * zv->chunk[1] *
+	       zv->chunk[2] * zv->chunk[3];
+	  if (chunk_bytes > max_chunk_bytes)
+	       max_chunk_bytes = chunk_bytes;
+	  row_bytes += zv->esize * zv->chunk[0] * zv->field;
+	  snprintf(path, sizeof(path), "%s/%s", store, zv->name);
+	  make_dir(path);
+	  if (verbose())
+	       printf("chunks: %zu x %zu x %zu x %zu\n", zv->chunk[0],
+		      zv->chunk[1], zv->chunk[2], zv->chunk[3]);
+     }
+
+     /* one compressing worker per --compress-threads or processor, and
+      * rows enough to keep them busy, as far as memory goes */
+     n_workers = compress_threads() > 0 ? compress_threads() :
+	  sysconf(_SC_NPROCESSORS_ONLN);
+     if (n_workers < 1)
+	  n_workers = 1;
+     while (max_memory() > 0 && n_workers > 1 &&
+	    n_workers * scratch_bytes() > pool_left() / 4)
+	  n_workers--;
+     scratch = malloc(sizeof(unsigned char *) * n_workers);
+     for (int i = 0; i < n_workers; ++i)
+	  scratch[i] = pool_alloc(scratch_bytes(), "the Zarr workers");
+     if (max_memory() > 0 && pool_left() / 2 < memory)
+	  memory = pool_left() / 2;
+     n_rows = n_workers + 1;
+     if ((size_t)n_rows * row_bytes > memory)
+	  n_rows = memory / row_bytes;
+     if (n_rows < 1)
+	  n_rows = 1;
+     n_jobs_max = 0;
+     for (int v = 0; v < n_vars; ++v) {
+	  zvar_t *zv = &zvars[v];
+	  zv->rows = calloc(n_rows, sizeof(row_t));
+	  for (int r = 0; r < n_rows; ++r)
+	       zv->rows[r].data = pool_alloc(zv->esize * zv->chunk[0] *
+					     zv->field, "the Zarr rows");
+	  n_jobs_max += n_rows * zv->n_chunks;
+     }
+     queue = malloc(sizeof(job_t) * n_jobs_max);
+     job_head = job_tail = 0;
+     quit = 0;
+     workers = malloc(sizeof(pthread_t) * n_workers);
+     for (int i = 0; i < n_workers; ++i) {
+	  if (pthread_create(&workers[i], 0, work, scratch[i]) != 0) {
+	       perror("Starting Zarr worker thread");
+	       exit(1);
+	  }
+     }
+     if (verbose())
+	  printf("zarr: %d worker(s), %d row(s) of chunks per variable\n",
+		 n_workers, n_rows);
+}
+
+/* collect nsteps timesteps of variable var starting at record step,
+ * packing them if asked, and hand over each row once it is full */
+void zarr_write (int var, const float *buf, int step, int nsteps)
+{
+     zvar_t *zv = &zvars[var];
+
+     if (step != zv->records) {
+	  fprintf(stderr, "Zarr writes must be in order (got record %d, "
+		  "expected %d)\n", step, zv->records);
+	  exit(2);
+     }
+     for (int s = 0; s < nsteps; ++s) {
+	  row_t *row = &zv->rows[zv->cur];
+	  unsigned char *dst = row->data + zv->esize * zv->field * row->fill;
+	  if (pack() != PACK_NONE)
+	       pack_field(dst, buf + zv->field * s, zv->field, pack(),
+			  zv->scale, zv->offset);
+	  else
+	       memcpy(dst, buf + zv->field * s, sizeof(float) * zv->field);
+	  zv->records++;
+	  if (++row->fill == (int)zv->chunk[0])
+	       submit_row(zv);
+     }
+}
+
+/* bytes of one decoded timestep of variable var */
+size_t zarr_bytes (int var)
+{
+     return sizeof(float) * zvars[var].field;
+}
+
+/* .zarray of an array of the given shape and chunks */
+static void put_zarray (const char *name, int ndims, const size_t *shape,
+			const size_t *chunk, const char *dtype,
+			const char *fill, int compressed, size_t esize)
+{
+     char key[1100];
+     json_t doc = { 0, 0, 0 };
+
+     jprintf(&doc, "{\n    \"chunks\": [");
+     for (int d = 0; d < ndims; ++d)
+	  jprintf(&doc, "%s%zu", d > 0 ? ", " : "", chunk[d]);
+     jprintf(&doc, "],\n    \"compressor\": ");
+     if (compressed)
+	  jprintf(&doc, "{\"id\": \"zlib\", \"level\": %d}", level);
+     else
+	  jprintf(&doc, "null");
+     jprintf(&doc, ",\n    \"dimension_separator\": \".\",\n"
+	     "    \"dtype\": \"%s\",\n    \"fill_value\": %s,\n"
+	     "    \"filters\": ", dtype, fill);
+     if (compressed && shuffle_ && esize > 1)
+	  jprintf(&doc, "[{\"id\": \"shuffle\", \"elementsize\": %zu}]",
+		  esize);
+     else
+	  jprintf(&doc, "null");
+     jprintf(&doc, ",\n    \"order\": \"C\",\n    \"shape\": [");
+     for (int d = 0; d < ndims; ++d)
+	  jprintf(&doc, "%s%zu", d > 0 ? ", " : "", shape[d]);
+     jprintf(&doc, "],\n    \"zarr_format\": 2\n}\n");
+     snprintf(key, sizeof(key), "%s/.zarray", name);
+     put_meta(key, &doc);
+}
+
+/* start of a .zattrs with the array's dimension names; the caller
+ * adds its attributes and closes it with end_zattrs */
+static void begin_zattrs (json_t *doc, int ndims, const char **dims)
+{
+     jprintf(doc, "{\n    \"_ARRAY_DIMENSIONS\": [");
+     for (int d = 0; d < ndims; ++d) {
+	  jprintf(doc, "%s", d > 0 ? ", " : "");
+	  jstring(doc, dims[d]);
+     }
+     jprintf(doc, "]");
+}
+
+static void text_attr (json_t *doc, const char *name, const char *val)
+{
+     jprintf(doc, ",\n    ");
+     jstring(doc, name);
+     jprintf(doc, ": ");
+     jstring(doc, val);
+}
+
+static void end_zattrs (json_t *doc, const char *name)
+{
+     char key[1100];
+
+     jprintf(doc, "\n}\n");
+     snprintf(key, sizeof(key), "%s/.zattrs", name);
+     put_meta(key, doc);
+}
+
+/* a coordinate variable: one uncompressed chunk */
+static void put_coord (const char *name, int ndims, const size_t *shape,
+		       const char **dims, char type, const void *vals,
+		       const char *units, const char *bounds)
+{
+     char dtype[8], path[2048];
+     size_t chunk[2], n = 1;
+     json_t doc = { 0, 0, 0 };
+
+     snprintf(path, sizeof(path), "%s/%s", store, name);
+     make_dir(path);
+     for (int d = 0; d < ndims; ++d) {
+	  chunk[d] = shape[d] > 0 ? shape[d] : 1;
+	  n *= shape[d];
+     }
+     snprintf(dtype, sizeof(dtype), "%c%c4", endian(), type);
+     put_zarray(name, ndims, shape, chunk, dtype,
+		type == 'f' ? "\"NaN\"" : "null", 0, 4);
+     begin_zattrs(&doc, ndims, dims);
+     if (units != 0)
+	  text_attr(&doc, "units", units);
+     if (bounds != 0)
+	  text_attr(&doc, "bounds", bounds);
+     end_zattrs(&doc, name);
+     if (n > 0) {
+	  snprintf(path, sizeof(path), "%s/%s/0%s", store, name,
+		   ndims == 2 ? ".0" : "");
+	  write_file(path, vals, 4 * n);
+     }
+}
+
+void zarr_close (int n_lon, int n_lat, int n_p, int n_t,
+		 float *vals_lon, float *vals_lat, float *vals_p,
+		 int *vals_t, int *bnds_t)
+{
+     const char *lvl = dimension == DIM3P ? "pressure" : "sigma";
+     char path[2048];
+     json_t doc = { 0, 0, 0 };
+
+     /* the last, partial rows, and wait for everything */
+     for (int v = 0; v < n_zvars; ++v)
+	  submit_row(&zvars[v]);
+     pthread_mutex_lock(&lock);
+     quit = 1;
+     pthread_cond_broadcast(&cond);
+     pthread_mutex_unlock(&lock);
+     for (int i = 0; i < n_workers; ++i) {
+	  pthread_join(workers[i], 0);
+	  pool_free(scratch[i]);
+     }
+     free(scratch);
+
+     for (int v = 0; v < n_zvars; ++v) {
+	  zvar_t *zv = &zvars[v];
+	  const char *dims[4] = { "time", lvl, "lat", "lon" };
+	  size_t shape[4], chunk[4];
+	  char dtype[8], fill[32];
+	  /* 2D fields have no level dimension */
+	  for (int d = 0, e = 0; d < 4; ++d) {
+	       if (d == 1 && zv->ndims == 3)
+		    continue;
+	       dims[e] = dims[d];
+	       shape[e] = d == 0 ? (size_t)n_t : zv->shape[d];
+	       chunk[e++] = zv->chunk[d];
+	  }
+	  if (pack() == PACK_SHORT) {
+	       snprintf(dtype, sizeof(dtype), "%ci2", endian());
+	       strcpy(fill, "-32768");
+	  } else if (pack() == PACK_BYTE) {
+	       strcpy(dtype, "|i1");
+	       strcpy(fill, "-128");
+	  } else {
+	       snprintf(dtype, sizeof(dtype), "%cf4", endian());
+	       strcpy(fill, "\"NaN\"");
+	  }
+	  put_zarray(zv->name, zv->ndims, shape, chunk, dtype, fill,
+		     level > 0, zv->esize);
+	  begin_zattrs(&doc, zv->ndims, dims);
+	  text_attr(&doc, "units", zv->units);
+	  /* how to unpack, or how much precision is left */
+	  if (pack() != PACK_NONE)
+	       jprintf(&doc, ",\n    \"scale_factor\": %.9g,\n"
+		       "    \"add_offset\": %.9g", zv->scale, zv->offset);
+	  if (reduce() != REDUCE_NONE)
+	       text_attr(&doc, "cell_methods",
+			 reduce() == REDUCE_MEAN ? "time: mean" :
+			 reduce() == REDUCE_SUM ? "time: sum" :
+			 reduce() == REDUCE_MIN ? "time: minimum" :
+			 "time: maximum");
+	  if (keep_bits() > 0)
+	       jprintf(&doc, ",\n    "
+		       "\"_QuantizeBitRoundNumberOfSignificantBits\": %d",
+		       keep_bits());
+	  end_zattrs(&doc, zv->name);
+	  for (int r = 0; r < n_rows; ++r)
+	       pool_free(zv->rows[r].data);
+	  free(zv->rows);
+     }
+
+     /* the coordinates */
+     {
+	  const char *lat_dims[1] = { "lat" }, *lon_dims[1] = { "lon" };
+	  const char *lvl_dims[1] = { lvl }, *t_dims[1] = { "time" };
+	  const char *bnds_dims[2] = { "time", "bnds" };
+	  size_t shape[2];
+	  shape[0] = n_lat;
+	  put_coord("lat", 1, shape, lat_dims, 'f', vals_lat,
+		    "degrees north", 0);
+	  shape[0] = n_lon;
+	  put_coord("lon", 1, shape, lon_dims, 'f', vals_lon,
+		    "degrees east", 0);
+	  if (dimension != DIM2) {
+	       shape[0] = n_p;
+	       put_coord(lvl, 1, shape, lvl_dims, 'f', vals_p,
+			 dimension == DIM3P ? "Pa" : "[0-1]", 0);
+	  }
+	  shape[0] = n_t;
+	  put_coord("time", 1, shape, t_dims, 'i', vals_t,
+		    "seconds since 1970-01-01 00:00:00 UTC",
+		    bnds_t != 0 ? "time_bnds" : 0);
+	  if (bnds_t != 0) {
+	       shape[1] = 2;
+	       put_coord("time_bnds", 2, shape, bnds_dims, 'i', bnds_t,
+			 0, 0);
+	  }
+     }
+
+     /* no global attributes; then everything in one document */
+     jprintf(&doc, "{}\n");
+     put_meta(".zattrs", &doc);
+     jprintf(&doc, "{\n    \"metadata\": {\n    %s\n    },\n"
+	     "    \"zarr_consolidated_format\": 1\n}\n",
+	     consolidated != 0 ? consolidated : "");
+     snprintf(path, sizeof(path), "%s/.zmetadata", store);
+     write_file(path, doc.s, doc.len);
+     free(doc.s);
+     free(consolidated);
+     consolidated = 0;
+     cons_len = cons_cap = 0;
+     free(zvars);
+     zvars = 0;
+     free(queue);
+     free(workers);
+}